@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include "profiler.h"
+#include "workStealing.h"
+
+namespace tp
+{
+
+    // Sense reversing barrier for a fixed set of participants. Each participant keeps its
+    // own sense flag, the last one to arrive flips the shared sense and releases the others.
+    // Waiters spin while every participant has a core, then block.
+    struct Barrier
+    {
+        static constexpr uint32_t spin_count = 256;
+
+        const uint32_t          m_count;
+        const uint32_t          m_spin_rounds;
+        std::atomic<uint32_t>   m_arrived{ 0 };
+        std::atomic<bool>       m_sense{ false };
+        std::atomic<uint32_t>   m_sleeping{ 0 };
+        std::mutex              m_mutex;
+        std::condition_variable m_cv;
+
+        explicit
+            Barrier(uint32_t count)
+            : m_count{ count }
+            , m_spin_rounds{ count <= std::thread::hardware_concurrency() ? spin_count : 0u }
+        {
+        }
+
+        void arriveAndWait(bool& local_sense)
+        {
+            PROFILE_IDLE("barrier");
+            local_sense = !local_sense;
+            if (m_arrived.fetch_add(1) + 1 == m_count) {
+                m_arrived.store(0);
+                m_sense.store(local_sense);
+                if (m_sleeping.load()) {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_cv.notify_all();
+                }
+                return;
+            }
+
+            Backoff backoff;
+            while (backoff.m_count < m_spin_rounds) {
+                if (m_sense.load() == local_sense) {
+                    return;
+                }
+                backoff.wait();
+            }
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_sleeping.fetch_add(1);
+            m_cv.wait(lock, [this, local_sense] { return m_sense.load() == local_sense; });
+            m_sleeping.fetch_sub(1);
+        }
+    };
+
+}
@@ -1,6 +1,65 @@
 #pragma once
 #include <cstdint>
-#include <mutex>
+#include <atomic>
+
+// Contiguous ids of the objects in one cell
+struct CellSpan {
+    const uint32_t* ids;
+    uint32_t count;
+};
+
+// Occupancy telemetry of one grid build, or merged over the builds of a step
+struct GridStats {
+    uint32_t max_occupancy = 0;
+    // Cells holding more objects than their slots
+    uint32_t overflow_cells = 0;
+    // Objects that did not fit their cell's slots
+    uint32_t overflow_objects = 0;
+
+    void merge(const GridStats& other)
+    {
+        max_occupancy = max_occupancy > other.max_occupancy ? max_occupancy : other.max_occupancy;
+        overflow_cells += other.overflow_cells;
+        overflow_objects += other.overflow_objects;
+    }
+};
+
+// Contact and energy telemetry of one update, collected when PhysicSolver::collect_stats
+// is set. Contacts are counted on every sub-step's grid before its collisions are solved.
+struct SolverStats {
+    static constexpr uint32_t occupancy_buckets = 16;
+
+    // Pairs the pairwise narrow phase tests: a cell against itself and its neighbours
+    uint64_t pairs_tested = 0;
+    // Distinct overlapping pairs
+    uint64_t contacts = 0;
+    // Overlap depth (radius sum minus distance) in world units
+    float max_penetration = 0.f;
+    double total_penetration = 0.;
+    // Cells by object count, the last bucket counts every cell from occupancy_buckets - 1 up
+    uint64_t occupancy[occupancy_buckets] = {};
+    uint32_t grid_builds = 0;
+    // Sum of m v^2 / 2 after the update, m = (r / solver radius)^2, v in world units per second
+    double kinetic_energy = 0.;
+
+    double meanPenetration() const
+    {
+        return contacts ? total_penetration / static_cast<double>(contacts) : 0.;
+    }
+
+    void merge(const SolverStats& other)
+    {
+        pairs_tested += other.pairs_tested;
+        contacts += other.contacts;
+        max_penetration = max_penetration > other.max_penetration ? max_penetration : other.max_penetration;
+        total_penetration += other.total_penetration;
+        for (uint32_t i = 0; i < occupancy_buckets; ++i) {
+            occupancy[i] += other.occupancy[i];
+        }
+        grid_builds += other.grid_builds;
+        kinetic_energy += other.kinetic_energy;
+    }
+};
 
 template<uint32_t maxNum>
 struct CollisionCell
@@ -8,38 +67,77 @@ struct CollisionCell
     static constexpr uint8_t cell_capacity = maxNum;
     static constexpr uint8_t max_cell_idx = cell_capacity - 1;
 
-    uint32_t objects_count = 0;
-    uint32_t objects[cell_capacity] = {};
-    std::mutex mutex;
+    // Only max_cell_idx slots are stored. The counter keeps counting past them so the
+    // owner can place the extra objects elsewhere, readers go through size().
+    // No initializers: a default initialized cell is left unwritten and must be cleared,
+    // value initialization (CollisionCell()) still zeroes it.
+    std::atomic<uint32_t> objects_count;
+    uint32_t objects[max_cell_idx];
 
     CollisionCell() = default;
-    CollisionCell(const CollisionCell<maxNum>& a) {
-
+    CollisionCell(const CollisionCell<maxNum>& a)
+        : objects_count{ a.objects_count.load(std::memory_order_relaxed) }
+    {
+        for (uint32_t i{ 0 }; i < max_cell_idx; ++i) {
+            objects[i] = a.objects[i];
+        }
     }
 
     inline uint32_t& operator[](int i) {
         return objects[i];
     }
 
-    void push_back(uint32_t id)
+    inline uint32_t size() const
+    {
+        const uint32_t count = objects_count.load(std::memory_order_relaxed);
+        return count < max_cell_idx ? count : max_cell_idx;
+    }
+
+    inline CellSpan span() const
+    {
+        return { objects, size() };
+    }
+
+    // Lock free, safe to call from several threads while the grid is being built.
+    // Returns the claimed slot, the id was not stored if it is >= max_cell_idx.
+    uint32_t push_back(uint32_t id)
     {
-        std::lock_guard<std::mutex> lock(mutex);
-        objects[objects_count] = id;
-        objects_count += objects_count < max_cell_idx;
+        const uint32_t slot = objects_count.fetch_add(1, std::memory_order_relaxed);
+        if (slot < max_cell_idx) {
+            objects[slot] = id;
+        }
+        return slot;
     }
 
     void clear()
     {
-        objects_count = 0u;
+        objects_count.store(0u, std::memory_order_relaxed);
+    }
+
+    // Stored ids in increasing order, so the contact order no longer depends on which
+    // thread inserted first. Not thread safe.
+    void sort()
+    {
+        const uint32_t count = size();
+        for (uint32_t i{ 1 }; i < count; ++i) {
+            const uint32_t id = objects[i];
+            uint32_t k = i;
+            for (; k > 0 && objects[k - 1] > id; --k) {
+                objects[k] = objects[k - 1];
+            }
+            objects[k] = id;
+        }
     }
 
+    // Not thread safe
     void remove(uint32_t id)
     {
-        for (uint32_t i{ 0 }; i < objects_count; ++i) {
+        const uint32_t count = size();
+        for (uint32_t i{ 0 }; i < count; ++i) {
             if (objects[i] == id) {
                 // Swap pop
-                objects[i] = objects[objects_count - 1];
-                --objects_count;
+                objects[i] = objects[count - 1];
+                objects_count.store(count - 1, std::memory_order_relaxed);
                 return;
             }
         }
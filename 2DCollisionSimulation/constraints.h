@@ -0,0 +1,157 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "utils.h"
+
+// Keeps objects a and b length apart. stiffness in (0, 1] is the part of the error
+// removed per solve, the correction is shared by mass like contacts (mass ~ radius^2).
+struct DistanceConstraint {
+    uint32_t a;
+    uint32_t b;
+    float length;
+    float stiffness;
+};
+
+// Holds an object at a fixed position
+struct ConstraintPin {
+    uint32_t id;
+    Vec2 position;
+};
+
+// Links between objects for chains, cloth and soft bodies. The links are greedy graph
+// coloured into batches in which no object appears twice, so a batch can be split
+// anywhere and solved in parallel without locks, like the stripes of one parity.
+// Links of objects with more than max_colors links of their own go to a last batch
+// solved on one thread.
+struct ConstraintSet {
+    static constexpr uint32_t max_colors = 64;
+
+    std::vector<DistanceConstraint> links;
+    std::vector<ConstraintPin> pins;
+
+    // links in batch order, batch b is [batch_start[b], batch_start[b + 1])
+    std::vector<DistanceConstraint> batched;
+    std::vector<uint32_t> batch_start;
+    // Whether the last batch holds the links that could not be coloured
+    bool serial_batch = false;
+    bool dirty = false;
+
+    bool empty() const {
+        return links.empty() && pins.empty();
+    }
+
+    void clear() {
+        links.clear();
+        pins.clear();
+        dirty = true;
+    }
+
+    void addLink(uint32_t a, uint32_t b, float length, float stiffness = 1.f) {
+        links.push_back({ a, b, length, stiffness });
+        dirty = true;
+    }
+
+    void addPin(uint32_t id, Vec2 position) {
+        pins.push_back({ id, position });
+        dirty = true;
+    }
+
+    uint32_t batchCount() const {
+        return batch_start.empty() ? 0 : to<uint32_t>(batch_start.size() - 1);
+    }
+
+    // Colours links into batches, the order of links inside a batch follows links.
+    // Links and pins of ids >= object_count (objects removed since) are dropped first.
+    void color(uint32_t object_count) {
+        dirty = false;
+        links.erase(std::remove_if(links.begin(), links.end(), [object_count](const DistanceConstraint& link) {
+            return link.a >= object_count || link.b >= object_count;
+        }), links.end());
+        pins.erase(std::remove_if(pins.begin(), pins.end(), [object_count](const ConstraintPin& pin) {
+            return pin.id >= object_count;
+        }), pins.end());
+        std::vector<uint64_t> used(object_count, 0ull);
+        std::vector<uint8_t> link_color(links.size());
+        uint32_t counts[max_colors + 1] = {};
+        for (size_t k = 0; k < links.size(); ++k) {
+            const DistanceConstraint& link = links[k];
+            const uint64_t free = ~(used[link.a] | used[link.b]);
+            uint32_t c = max_colors;
+            if (free) {
+                c = 0;
+                while (!(free >> c & 1ull)) {
+                    ++c;
+                }
+                used[link.a] |= 1ull << c;
+                used[link.b] |= 1ull << c;
+            }
+            link_color[k] = to<uint8_t>(c);
+            ++counts[c];
+        }
+
+        uint32_t color_count = 0;
+        for (uint32_t c = 0; c < max_colors; ++c) {
+            color_count = counts[c] ? c + 1 : color_count;
+        }
+        serial_batch = counts[max_colors] > 0;
+        const uint32_t batches = color_count + (serial_batch ? 1 : 0);
+        batch_start.assign(batches + 1, 0u);
+        for (uint32_t c = 0; c < color_count; ++c) {
+            batch_start[c + 1] = batch_start[c] + counts[c];
+        }
+        if (serial_batch) {
+            batch_start[batches] = batch_start[color_count] + counts[max_colors];
+        }
+
+        batched.resize(links.size());
+        std::vector<uint32_t> cursor(batch_start.begin(), batch_start.end() - 1);
+        for (size_t k = 0; k < links.size(); ++k) {
+            const uint32_t c = link_color[k];
+            batched[cursor[c == max_colors ? batches - 1 : c]++] = links[k];
+        }
+    }
+
+    // Ids changed, new_id[old] is where the object went. Colours do not depend on ids.
+    void remap(const std::vector<uint32_t>& new_id) {
+        for (std::vector<DistanceConstraint>* list : { &links, &batched }) {
+            for (DistanceConstraint& link : *list) {
+                link.a = new_id[link.a];
+                link.b = new_id[link.b];
+            }
+        }
+        for (ConstraintPin& pin : pins) {
+            pin.id = new_id[pin.id];
+        }
+    }
+
+    // Links [start, end) of the batched list
+    void solveLinks(float* x, float* y, const float* r, uint32_t start, uint32_t end) const {
+        constexpr float eps = 0.0001f;
+        for (uint32_t k = start; k < end; ++k) {
+            const DistanceConstraint& link = batched[k];
+            const float dx = x[link.b] - x[link.a];
+            const float dy = y[link.b] - y[link.a];
+            const float dist2 = dx * dx + dy * dy;
+            if (dist2 < eps) {
+                continue;
+            }
+            const float dist = std::sqrt(dist2);
+            const float ma = r[link.a] * r[link.a];
+            const float mb = r[link.b] * r[link.b];
+            const float delta = link.stiffness * (dist - link.length) / (dist * (ma + mb));
+            x[link.a] += dx * delta * mb;
+            y[link.a] += dy * delta * mb;
+            x[link.b] -= dx * delta * ma;
+            y[link.b] -= dy * delta * ma;
+        }
+    }
+
+    void solvePins(float* x, float* y) const {
+        for (const ConstraintPin& pin : pins) {
+            x[pin.id] = pin.position.x;
+            y[pin.id] = pin.position.y;
+        }
+    }
+};
@@ -0,0 +1,295 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CONTACT_KERNEL_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CONTACT_KERNEL_TARGET_AVX2
+#else
+#define CONTACT_KERNEL_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define CONTACT_KERNEL_X86 0
+#endif
+
+// Narrow phase over one cell neighbourhood.
+//
+// The caller gathers the positions of every object in a cell and its neighbour
+// cells into lanes, the centre cell first (lanes [0, own)). Each centre object is
+// tested against all lanes at once: every touching lane is pushed away, and the sum
+// of the pushes is applied to the centre object. Lanes are processed in blocks of 8
+// and the pushes reduced in a fixed order, so the scalar, SSE and AVX2 kernels give
+// bit-identical results. The fast reciprocal square root path is approximate and is
+// excluded from that guarantee.
+
+enum class ContactKernelType {
+    // Legacy one pair at a time solveContact loop, no lanes
+    Pairwise,
+    Scalar,
+    SSE,
+    AVX2,
+};
+
+struct ContactParams {
+    float diameter;
+    float diameter2;
+    // response_coef * 0.5
+    float coef;
+    float eps = 0.0001f;
+    bool fast_rsqrt = false;
+};
+
+struct ContactLanes {
+    static constexpr uint32_t block = 8;
+    // Value of padding lanes, far enough to never collide and small enough to stay finite when squared
+    static constexpr float far_away = -1.0e6f;
+
+    static constexpr uint32_t padded(uint32_t count)
+    {
+        return (count + block - 1) & ~(block - 1);
+    }
+};
+
+struct ContactKernel
+{
+    using Fn = void(*)(float* x, float* y, uint32_t count, uint32_t own, const ContactParams& p);
+
+    static float hsum8(const float* a)
+    {
+        const float a0 = a[0] + a[4];
+        const float a1 = a[1] + a[5];
+        const float a2 = a[2] + a[6];
+        const float a3 = a[3] + a[7];
+        return (a0 + a2) + (a1 + a3);
+    }
+
+    static void solveScalar(float* x, float* y, uint32_t count, uint32_t own, const ContactParams& p)
+    {
+        const uint32_t padded = ContactLanes::padded(count);
+        for (uint32_t k = 0; k < own; ++k) {
+            const float px = x[k];
+            const float py = y[k];
+            float acc_x[ContactLanes::block] = {};
+            float acc_y[ContactLanes::block] = {};
+
+            for (uint32_t j = 0; j < padded; ++j) {
+                const float dx = px - x[j];
+                const float dy = py - y[j];
+                const float dist2 = dx * dx + dy * dy;
+                float col_x = 0.f;
+                float col_y = 0.f;
+                if (dist2 < p.diameter2 && dist2 > p.eps) {
+                    // Push along the normal: d * delta / dist
+                    float scale;
+                    if (p.fast_rsqrt) {
+                        const float inv = 1.f / std::sqrt(dist2);
+                        scale = p.coef * (p.diameter - dist2 * inv) * inv;
+                    }
+                    else {
+                        const float dist = std::sqrt(dist2);
+                        scale = p.coef * (p.diameter - dist) / dist;
+                    }
+                    col_x = dx * scale;
+                    col_y = dy * scale;
+                }
+                x[j] -= col_x;
+                y[j] -= col_y;
+                acc_x[j % ContactLanes::block] += col_x;
+                acc_y[j % ContactLanes::block] += col_y;
+            }
+
+            x[k] += hsum8(acc_x);
+            y[k] += hsum8(acc_y);
+        }
+    }
+
+#if CONTACT_KERNEL_X86
+    static __m128 contact4(__m128 px, __m128 py, __m128& qx, __m128& qy, __m128& col_y, const ContactParams& p)
+    {
+        const __m128 dx = _mm_sub_ps(px, qx);
+        const __m128 dy = _mm_sub_ps(py, qy);
+        const __m128 dist2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        const __m128 mask = _mm_and_ps(_mm_cmplt_ps(dist2, _mm_set1_ps(p.diameter2)), _mm_cmpgt_ps(dist2, _mm_set1_ps(p.eps)));
+
+        __m128 scale;
+        if (p.fast_rsqrt) {
+            __m128 inv = _mm_rsqrt_ps(dist2);
+            // One Newton step: inv * (1.5 - 0.5 * d2 * inv^2)
+            inv = _mm_mul_ps(inv, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), dist2), _mm_mul_ps(inv, inv))));
+            scale = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(p.coef), _mm_sub_ps(_mm_set1_ps(p.diameter), _mm_mul_ps(dist2, inv))), inv);
+        }
+        else {
+            const __m128 dist = _mm_sqrt_ps(dist2);
+            scale = _mm_div_ps(_mm_mul_ps(_mm_set1_ps(p.coef), _mm_sub_ps(_mm_set1_ps(p.diameter), dist)), dist);
+        }
+        // Masked lanes may hold NaN from 0/0, drop them
+        scale = _mm_and_ps(scale, mask);
+        const __m128 col_x = _mm_mul_ps(dx, scale);
+        col_y = _mm_mul_ps(dy, scale);
+
+        qx = _mm_sub_ps(qx, col_x);
+        qy = _mm_sub_ps(qy, col_y);
+        return col_x;
+    }
+
+    static float hsum4(__m128 v)
+    {
+        const __m128 t = _mm_add_ps(v, _mm_movehl_ps(v, v));
+        return _mm_cvtss_f32(_mm_add_ss(t, _mm_shuffle_ps(t, t, 1)));
+    }
+
+    static void solveSSE(float* x, float* y, uint32_t count, uint32_t own, const ContactParams& p)
+    {
+        const uint32_t padded = ContactLanes::padded(count);
+        for (uint32_t k = 0; k < own; ++k) {
+            const __m128 px = _mm_set1_ps(x[k]);
+            const __m128 py = _mm_set1_ps(y[k]);
+            // Low and high half of the 8 wide accumulator
+            __m128 acc_x_lo = _mm_setzero_ps();
+            __m128 acc_x_hi = _mm_setzero_ps();
+            __m128 acc_y_lo = _mm_setzero_ps();
+            __m128 acc_y_hi = _mm_setzero_ps();
+
+            for (uint32_t j = 0; j < padded; j += ContactLanes::block) {
+                __m128 qx = _mm_loadu_ps(x + j);
+                __m128 qy = _mm_loadu_ps(y + j);
+                __m128 col_y;
+                __m128 col_x = contact4(px, py, qx, qy, col_y, p);
+                _mm_storeu_ps(x + j, qx);
+                _mm_storeu_ps(y + j, qy);
+                acc_x_lo = _mm_add_ps(acc_x_lo, col_x);
+                acc_y_lo = _mm_add_ps(acc_y_lo, col_y);
+
+                qx = _mm_loadu_ps(x + j + 4);
+                qy = _mm_loadu_ps(y + j + 4);
+                col_x = contact4(px, py, qx, qy, col_y, p);
+                _mm_storeu_ps(x + j + 4, qx);
+                _mm_storeu_ps(y + j + 4, qy);
+                acc_x_hi = _mm_add_ps(acc_x_hi, col_x);
+                acc_y_hi = _mm_add_ps(acc_y_hi, col_y);
+            }
+
+            x[k] += hsum4(_mm_add_ps(acc_x_lo, acc_x_hi));
+            y[k] += hsum4(_mm_add_ps(acc_y_lo, acc_y_hi));
+        }
+    }
+
+    CONTACT_KERNEL_TARGET_AVX2
+    static void solveAVX2(float* x, float* y, uint32_t count, uint32_t own, const ContactParams& p)
+    {
+        const uint32_t padded = ContactLanes::padded(count);
+        const __m256 diameter2 = _mm256_set1_ps(p.diameter2);
+        const __m256 eps = _mm256_set1_ps(p.eps);
+        const __m256 diameter = _mm256_set1_ps(p.diameter);
+        const __m256 coef = _mm256_set1_ps(p.coef);
+
+        for (uint32_t k = 0; k < own; ++k) {
+            const __m256 px = _mm256_set1_ps(x[k]);
+            const __m256 py = _mm256_set1_ps(y[k]);
+            __m256 acc_x = _mm256_setzero_ps();
+            __m256 acc_y = _mm256_setzero_ps();
+
+            for (uint32_t j = 0; j < padded; j += ContactLanes::block) {
+                __m256 qx = _mm256_loadu_ps(x + j);
+                __m256 qy = _mm256_loadu_ps(y + j);
+                const __m256 dx = _mm256_sub_ps(px, qx);
+                const __m256 dy = _mm256_sub_ps(py, qy);
+                const __m256 dist2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+                const __m256 mask = _mm256_and_ps(_mm256_cmp_ps(dist2, diameter2, _CMP_LT_OQ), _mm256_cmp_ps(dist2, eps, _CMP_GT_OQ));
+                // Nothing touches in this block, adding zeros would not change anything
+                if (!_mm256_movemask_ps(mask)) {
+                    continue;
+                }
+
+                __m256 scale;
+                if (p.fast_rsqrt) {
+                    __m256 inv = _mm256_rsqrt_ps(dist2);
+                    inv = _mm256_mul_ps(inv, _mm256_sub_ps(_mm256_set1_ps(1.5f), _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), dist2), _mm256_mul_ps(inv, inv))));
+                    scale = _mm256_mul_ps(_mm256_mul_ps(coef, _mm256_sub_ps(diameter, _mm256_mul_ps(dist2, inv))), inv);
+                }
+                else {
+                    const __m256 dist = _mm256_sqrt_ps(dist2);
+                    scale = _mm256_div_ps(_mm256_mul_ps(coef, _mm256_sub_ps(diameter, dist)), dist);
+                }
+                scale = _mm256_and_ps(scale, mask);
+                const __m256 col_x = _mm256_mul_ps(dx, scale);
+                const __m256 col_y = _mm256_mul_ps(dy, scale);
+
+                _mm256_storeu_ps(x + j, _mm256_sub_ps(qx, col_x));
+                _mm256_storeu_ps(y + j, _mm256_sub_ps(qy, col_y));
+                acc_x = _mm256_add_ps(acc_x, col_x);
+                acc_y = _mm256_add_ps(acc_y, col_y);
+            }
+
+            x[k] += hsum4(_mm_add_ps(_mm256_castps256_ps128(acc_x), _mm256_extractf128_ps(acc_x, 1)));
+            y[k] += hsum4(_mm_add_ps(_mm256_castps256_ps128(acc_y), _mm256_extractf128_ps(acc_y, 1)));
+        }
+    }
+
+    static bool detectAVX2()
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) {
+            return false;
+        }
+        __cpuid(info, 1);
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        const bool avx = (info[2] & (1 << 28)) != 0;
+        // The OS must save the YMM registers
+        if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+            return false;
+        }
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+
+    static bool cpuHasAVX2()
+    {
+        static const bool has_avx2 = detectAVX2();
+        return has_avx2;
+    }
+#endif
+
+    // Widest kernel the running CPU supports
+    static ContactKernelType best()
+    {
+#if CONTACT_KERNEL_X86
+        return cpuHasAVX2() ? ContactKernelType::AVX2 : ContactKernelType::SSE;
+#else
+        return ContactKernelType::Scalar;
+#endif
+    }
+
+    // Falls back to the next narrower kernel when the requested one is not available
+    static Fn get(ContactKernelType type)
+    {
+#if CONTACT_KERNEL_X86
+        if (type == ContactKernelType::AVX2 && cpuHasAVX2()) {
+            return &solveAVX2;
+        }
+        if (type == ContactKernelType::AVX2 || type == ContactKernelType::SSE) {
+            return &solveSSE;
+        }
+#endif
+        return &solveScalar;
+    }
+
+    static const char* name(ContactKernelType type)
+    {
+        switch (type) {
+        case ContactKernelType::Pairwise: return "pairwise";
+        case ContactKernelType::Scalar:   return "scalar";
+        case ContactKernelType::SSE:      return "sse";
+        case ContactKernelType::AVX2:     return "avx2";
+        }
+        return "unknown";
+    }
+};
@@ -0,0 +1,37 @@
+#pragma once
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// std::allocator that default initializes instead of value initializing, so resize()
+// leaves trivial elements unwritten. The pages of a fresh allocation are then placed
+// (on NUMA systems, next to the CPU) by the first thread that writes them instead of
+// the thread that resized.
+template<typename T>
+struct DefaultInitAllocator : std::allocator<T>
+{
+    template<typename U>
+    struct rebind {
+        using other = DefaultInitAllocator<U>;
+    };
+
+    DefaultInitAllocator() = default;
+
+    template<typename U>
+    DefaultInitAllocator(const DefaultInitAllocator<U>&) noexcept {}
+
+    template<typename U>
+    void construct(U* p) noexcept(std::is_nothrow_default_constructible<U>::value) {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    template<typename U, typename... TArgs>
+    void construct(U* p, TArgs&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<TArgs>(args)...);
+    }
+};
+
+template<typename T>
+using FirstTouchVector = std::vector<T, DefaultInitAllocator<T>>;
@@ -0,0 +1,114 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "collision.h"
+#include "utils.h"
+
+// Coarse grid of one size class, built by a counting sort of its members only
+struct LevelGrid {
+    float cell_size = 1.f;
+    unsigned int sizeX = 1;
+    unsigned int sizeY = 1;
+    // Largest member radius, how far a query must reach into this level
+    float max_radius = 0.f;
+
+    std::vector<uint32_t> members;
+    std::vector<uint32_t> cell_start;
+    std::vector<uint32_t> ids;
+    std::vector<uint32_t> cell_of;
+
+    void init(const Vec2& WorldSize, float cell) {
+        cell_size = cell;
+        sizeX = to<unsigned int>(WorldSize.x / cell) + 1;
+        sizeY = to<unsigned int>(WorldSize.y / cell) + 1;
+    }
+
+    inline unsigned int cellX(float pos) const {
+        const int x = to<int>(pos / cell_size);
+        return x < 0 ? 0 : (to<unsigned int>(x) < sizeX ? to<unsigned int>(x) : sizeX - 1);
+    }
+
+    inline unsigned int cellY(float pos) const {
+        const int y = to<int>(pos / cell_size);
+        return y < 0 ? 0 : (to<unsigned int>(y) < sizeY ? to<unsigned int>(y) : sizeY - 1);
+    }
+
+    inline CellSpan span(unsigned int i) const {
+        return { ids.data() + cell_start[i], cell_start[i + 1] - cell_start[i] };
+    }
+
+    void build(const float* x, const float* y) {
+        const uint32_t size = sizeX * sizeY;
+        cell_start.assign(size + 1, 0u);
+        cell_of.resize(members.size());
+        ids.resize(members.size());
+
+        for (size_t k = 0; k < members.size(); ++k) {
+            const uint32_t id = members[k];
+            cell_of[k] = cellX(x[id]) + cellY(y[id]) * sizeX;
+            ++cell_start[cell_of[k] + 1];
+        }
+        for (uint32_t i = 0; i < size; ++i) {
+            cell_start[i + 1] += cell_start[i];
+        }
+        // cell_start[c] is the cursor of cell c and ends at the start of c + 1, shift back after
+        for (size_t k = 0; k < members.size(); ++k) {
+            ids[cell_start[cell_of[k]]++] = members[k];
+        }
+        for (uint32_t i = size; i > 0; --i) {
+            cell_start[i] = cell_start[i - 1];
+        }
+        cell_start[0] = 0;
+    }
+};
+
+// Size classes for objects that do not fit the base grid. Level l (from 1) has cells of
+// base_cell * 2^l and holds objects up to base_radius * 2^l, larger ones go to the top level.
+struct HierarchicalGrid {
+    static constexpr uint32_t max_levels = 8;
+
+    float base_radius = 0.f;
+    // levels[l - 1] is level l
+    std::vector<LevelGrid> levels;
+    uint32_t large_count = 0;
+
+    void init(const Vec2& WorldSize, float radius) {
+        base_radius = radius;
+        levels.resize(max_levels);
+        for (uint32_t l = 1; l <= max_levels; ++l) {
+            levels[l - 1].init(WorldSize, 2.f * radius * to<float>(1u << l));
+        }
+    }
+
+    uint32_t levelOf(float radius) const {
+        uint32_t l = 1;
+        while (l < max_levels && base_radius * to<float>(1u << l) < radius) {
+            ++l;
+        }
+        return l;
+    }
+
+    void clear() {
+        for (LevelGrid& level : levels) {
+            level.members.clear();
+            level.max_radius = 0.f;
+        }
+        large_count = 0;
+    }
+
+    // Only objects larger than base_radius belong here
+    void add(uint32_t id, float radius) {
+        LevelGrid& level = levels[levelOf(radius) - 1];
+        level.members.push_back(id);
+        level.max_radius = level.max_radius > radius ? level.max_radius : radius;
+        ++large_count;
+    }
+
+    void build(const float* x, const float* y) {
+        for (LevelGrid& level : levels) {
+            if (!level.members.empty()) {
+                level.build(x, y);
+            }
+        }
+    }
+};
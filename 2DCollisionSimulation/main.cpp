@@ -1,14 +1,18 @@
 #include <SFML/Graphics.hpp>
 #include <chrono>
 #include "physics.h"
+#include "profiler.h"
 #include "render.h"
+#include "renderSnapshot.h"
 #include <string>
 #include "threadPool.h"
+#include "timestep.h"
+#include "trajectory.h"
 
 const float radius = 1.2f;
 
 
-int main() {
+int main(int argc, char** argv) {
     const Vec2 worldSize{ 1600,1600 };
     // һ
     sf::RenderWindow window(sf::VideoMode(worldSize.x, worldSize.y), "Batch Render Colored Quads");
@@ -18,9 +22,13 @@ int main() {
 
     PhysicSolver solver(worldSize, radius);
 
-    tp::ThreadPool threadPool(15);
+    // The solver runs on the pipeline thread with threadPool while the main thread builds
+    // the vertices of the previous state with renderPool
+    tp::ThreadPool threadPool(12);
+    tp::ThreadPool renderPool(3);
+    RenderPipeline pipeline;
 
-    Renderer render(solver, radius);
+    Renderer render(solver);
     solver.gravity.y = 40.f;
     solver.friction = 40.f;
     solver.sub_steps = 1;
@@ -42,9 +50,26 @@ int main() {
     emiter1.emitNum = num;
     emiter1.intervel = interval;
 
-    double accum = 0.;
+    const float dt = 1 / 280.0f;
+    // Physics runs at 1 / dt of simulated time per wall second, the frame rate is free.
+    // Under overload at most max_steps_per_frame steps run and the simulation slows down.
+    const uint32_t max_steps_per_frame = 8;
+    const unsigned int frame_rate_limit = 0;
+    window.setFramerateLimit(frame_rate_limit);
+    FixedTimestep timestep(dt, max_steps_per_frame);
+
+    // The first argument, if any, is a trajectory file every update is recorded to
+    TrajectoryRecorder recorder;
+    if (argc > 1) {
+        recorder.open(argv[1], solver, dt);
+    }
+    uint32_t step = 0;
 
-    float dt = 1 / 280.0f;
+    // Phase timings for the HUD, T writes the last second or so as trace.json (chrome://tracing)
+    Profiler& profiler = Profiler::instance();
+    profiler.enabled = true;
+    profiler.setThreadName("main");
+    std::string profile_text;
 
     // ѭ
     while (window.isOpen()) {
@@ -52,24 +77,45 @@ int main() {
         while (window.pollEvent(event)) {
             if (event.type == sf::Event::Closed)
                 window.close();
+            if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::T)
+                profiler.writeChromeTrace("trace.json");
         }
 
         time_now = std::chrono::high_resolution_clock::now();
         double elapsed = std::chrono::duration<double>(time_now - time_last).count();
         time_last = time_now;
 
-        if (solver.objects.size() < 600000) {
-            emiter.Emit(solver, dt);
-            //emiter1.Emit(solver, dt);
-        }
-        
-        solver.update(dt,threadPool);
-
-        render.text.setString("FPS: "+std::to_string(1.0/ elapsed)+"\nNum: "+std::to_string(solver.objects.size()));
+        const uint32_t steps = timestep.advance(elapsed);
+        const float alpha = timestep.alpha();
+        pipeline.begin([&, steps, alpha]() {
+            for (uint32_t i = steps; i--;) {
+                if (solver.objects.size() < 600000) {
+                    emiter.Emit(solver, dt);
+                    //emiter1.Emit(solver, dt);
+                }
+
+                solver.update(dt, threadPool);
+                if (recorder.isOpen()) {
+                    recorder.record(solver, step);
+                }
+                ++step;
+            }
+            RenderSnapshot& snapshot = pipeline.back();
+            snapshot.extract(solver, threadPool);
+            snapshot.interpolation = alpha;
+        });
+
+        // Drawn while the steps above run, the solver must not be read here
+        const RenderSnapshot& snapshot = pipeline.front();
+        render.text.setString("FPS: " + std::to_string(1.0 / elapsed) + "\nSteps: " + std::to_string(timestep.last_steps)
+            + "\nBehind: " + std::to_string(timestep.dropped_time) + " s\nNum: " + std::to_string(snapshot.count) + profile_text);
 
         window.clear();
         //render.render(window);
-        render.renderMultiThread(window, threadPool);
+        render.renderSnapshot(window, snapshot, renderPool);
+        pipeline.end();
+        // Every pool is idle until the next begin
+        profile_text = profiler.hudText();
         window.display();
     }
 
@@ -1,5 +1,7 @@
 #pragma once
 #include <SFML/Graphics.hpp>
+#include <vector>
+#include "firstTouch.h"
 #include "utils.h"
 #include "math.h"
 
@@ -9,7 +11,9 @@ struct PhysicObject
     Vec2 position = { 0.0f, 0.0f };
     Vec2 last_position = { 0.0f, 0.0f };
     Vec2 acceleration = { 0.0f, 0.0f };
-    sf::Color color;
+    ParticleColor color{ 0, 0, 0, 255 };
+    // 0 means the solver radius
+    float radius = 0.0f;
 
     PhysicObject() = default;
 
@@ -74,4 +78,153 @@ struct PhysicObject
     {
         position += v;
     }
-};
\ No newline at end of file
+};
+
+// Structure of arrays particle storage, the collision pass only streams x/y.
+// resize() does not write the new elements, see PhysicSolver::placeMemory.
+struct ParticleStore
+{
+    FirstTouchVector<float> x;
+    FirstTouchVector<float> y;
+    FirstTouchVector<float> last_x;
+    FirstTouchVector<float> last_y;
+    FirstTouchVector<ParticleColor> color;
+    FirstTouchVector<float> radius;
+
+    // Thin accessor mirroring the PhysicObject interface for one particle
+    struct Ref
+    {
+        float& x;
+        float& y;
+        float& last_x;
+        float& last_y;
+        ParticleColor& color;
+        float& radius;
+
+        [[nodiscard]]
+        Vec2 getPosition() const
+        {
+            return { x, y };
+        }
+
+        [[nodiscard]]
+        Vec2 getLastPosition() const
+        {
+            return { last_x, last_y };
+        }
+
+        void setPosition(Vec2 pos)
+        {
+            x = last_x = pos.x;
+            y = last_y = pos.y;
+        }
+
+        void setPositionSameSpeed(Vec2 new_position)
+        {
+            const Vec2 to_last = getLastPosition() - getPosition();
+            x = new_position.x;
+            y = new_position.y;
+            last_x = x + to_last.x;
+            last_y = y + to_last.y;
+        }
+
+        void stop()
+        {
+            last_x = x;
+            last_y = y;
+        }
+
+        [[nodiscard]]
+        Vec2 getVelocity() const
+        {
+            return getPosition() - getLastPosition();
+        }
+
+        [[nodiscard]]
+        float getSpeed() const
+        {
+            return MathVec2::length(getVelocity());
+        }
+
+        void addVelocity(Vec2 v)
+        {
+            last_x -= v.x;
+            last_y -= v.y;
+        }
+
+        void move(Vec2 v)
+        {
+            x += v.x;
+            y += v.y;
+        }
+
+        operator PhysicObject() const
+        {
+            PhysicObject object;
+            object.position = getPosition();
+            object.last_position = getLastPosition();
+            object.color = color;
+            object.radius = radius;
+            return object;
+        }
+    };
+
+    [[nodiscard]]
+    size_t size() const
+    {
+        return x.size();
+    }
+
+    [[nodiscard]]
+    bool empty() const
+    {
+        return x.empty();
+    }
+
+    Ref operator[](size_t i)
+    {
+        return { x[i], y[i], last_x[i], last_y[i], color[i], radius[i] };
+    }
+
+    void reserve(size_t count)
+    {
+        x.reserve(count);
+        y.reserve(count);
+        last_x.reserve(count);
+        last_y.reserve(count);
+        color.reserve(count);
+        radius.reserve(count);
+    }
+
+    void resize(size_t count)
+    {
+        x.resize(count);
+        y.resize(count);
+        last_x.resize(count);
+        last_y.resize(count);
+        color.resize(count);
+        radius.resize(count);
+    }
+
+    void clear()
+    {
+        resize(0);
+    }
+
+    void push_back(const PhysicObject& object)
+    {
+        x.push_back(object.position.x);
+        y.push_back(object.position.y);
+        last_x.push_back(object.last_position.x);
+        last_y.push_back(object.last_position.y);
+        color.push_back(object.color);
+        radius.push_back(object.radius);
+    }
+
+    void emplace_back(Vec2 position, float object_radius)
+    {
+        PhysicObject object(position);
+        object.radius = object_radius;
+        push_back(object);
+    }
+};
@@ -4,7 +4,19 @@
 #include "collision.h"
 #include "utils.h"
 #include <algorithm>
+#include <chrono>
+#include <cstring>
+#include "profiler.h"
 #include "threadPool.h"
+#include "contactKernel.h"
+#include "sortedGrid.h"
+#include "sparseGrid.h"
+#include "barrier.h"
+#include "taskGraph.h"
+#include "levelGrid.h"
+#include "sleepRegions.h"
+#include "staticColliders.h"
+#include "constraints.h"
 
 using cell = CollisionCell<5>;
 
@@ -13,37 +25,273 @@ struct Grid {
     const unsigned int sizeX;
     const unsigned int sizeY;
 
-    std::vector<cell> Date;
+    // Cells are not initialized on allocation, every build clears them first
+    FirstTouchVector<cell> Date;
 
+    // Objects that do not fit their cell go to a per build spill arena, sized for
+    // the object count so nothing is ever dropped
+    std::vector<uint32_t> spill_cell;
+    std::vector<uint32_t> spill_id;
+    std::atomic<uint32_t> spill_count{ 0 };
+    std::atomic<uint32_t> max_occupancy{ 0 };
+
+    // Overflowed cells sorted by index, each with all its objects contiguous in overflow_ids
+    struct Overflow {
+        uint32_t cell;
+        uint32_t start;
+        uint32_t count;
+    };
+    std::vector<Overflow> overflows;
+    std::vector<uint32_t> overflow_ids;
+    std::vector<uint64_t> spill_keys;
+
+    GridStats stats;
+
+    // Cells are allocated by the first build, a solver on another grid mode does not pay for them
     Grid(unsigned int sizeX,unsigned int sizeY)
     :size(sizeX*sizeY),sizeX(sizeX),sizeY(sizeY){
-        Date.resize(size);
+    }
+
+    void Allocate() {
+        if (Date.empty()) {
+            Date.resize(size);
+        }
     }
 
     void Clear() {
-        for (int i = 0; i < size; i++) {
+        ClearRange(0, size);
+        ResetCounters();
+    }
+
+    void Clear_Multi(tp::ThreadPool& tp) {
+        Allocate();
+        tp.dispatch(size, [this](uint32_t start, uint32_t end) {
+            ClearRange(start, end);
+            });
+        ResetCounters();
+    }
+
+    void ClearRange(uint32_t start, uint32_t end) {
+        for (uint32_t i = start; i < end; i++) {
             Date[i].clear();
         }
     }
 
-    void Insert(const Vec2& position, unsigned int id,const Vec2& WorldSize,float radius) {
-        unsigned int x = position.x * sizeX / WorldSize.x;
-        unsigned int y = position.y * sizeY / WorldSize.y;
+    void ResetCounters() {
+        spill_count = 0;
+        max_occupancy = 0;
+    }
+
+    // Must be called before inserting object_count objects
+    void Reserve(uint32_t object_count) {
+        Allocate();
+        if (spill_id.size() < object_count) {
+            spill_cell.resize(object_count);
+            spill_id.resize(object_count);
+        }
+    }
+
+    void Insert(float posX, float posY, unsigned int id,const Vec2& WorldSize,float radius) {
+        unsigned int x = posX * sizeX / WorldSize.x;
+        unsigned int y = posY * sizeY / WorldSize.y;
+        const unsigned int c = x + y * sizeX;
+
+        const uint32_t slot = Date[c].push_back(id);
+        if (slot >= cell::max_cell_idx) {
+            const uint32_t spill = spill_count.fetch_add(1, std::memory_order_relaxed);
+            spill_cell[spill] = c;
+            spill_id[spill] = id;
+        }
+
+        // Only the first objects reaching a new maximum write the shared counter
+        uint32_t current = max_occupancy.load(std::memory_order_relaxed);
+        while (slot + 1 > current && !max_occupancy.compare_exchange_weak(current, slot + 1, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Sorts the stored ids of cells [start, end), see CollisionCell::sort
+    void SortRange(uint32_t start, uint32_t end) {
+        for (uint32_t i = start; i < end; i++) {
+            Date[i].sort();
+        }
+    }
+
+    // Gathers spilled objects per cell, call once all insertions are done. Which objects
+    // got a slot depends on timing, canonical sorts every overflow span by id.
+    void Finalize(bool canonical = false) {
+        const uint32_t spilled = spill_count.load(std::memory_order_relaxed);
+        overflows.clear();
+        overflow_ids.clear();
+
+        if (spilled) {
+            spill_keys.resize(spilled);
+            for (uint32_t i = 0; i < spilled; ++i) {
+                spill_keys[i] = (uint64_t(spill_cell[i]) << 32) | spill_id[i];
+            }
+            std::sort(spill_keys.begin(), spill_keys.end());
+
+            for (uint32_t i = 0; i < spilled;) {
+                const uint32_t c = uint32_t(spill_keys[i] >> 32);
+                Overflow overflow{ c, to<uint32_t>(overflow_ids.size()), 0 };
+                for (uint32_t k = 0; k < cell::max_cell_idx; ++k) {
+                    overflow_ids.push_back(Date[c].objects[k]);
+                }
+                for (; i < spilled && uint32_t(spill_keys[i] >> 32) == c; ++i) {
+                    overflow_ids.push_back(uint32_t(spill_keys[i]));
+                }
+                overflow.count = to<uint32_t>(overflow_ids.size()) - overflow.start;
+                if (canonical) {
+                    std::sort(overflow_ids.begin() + overflow.start, overflow_ids.end());
+                }
+                overflows.push_back(overflow);
+            }
+        }
 
-        Date[x + y * sizeX].push_back(id);
+        stats.max_occupancy = max_occupancy.load(std::memory_order_relaxed);
+        stats.overflow_cells = to<uint32_t>(overflows.size());
+        stats.overflow_objects = spilled;
     }
 
     inline cell& Get(unsigned int x,unsigned int y) {
         return Date[x + y * sizeX];
     }
+
+    inline CellSpan span(unsigned int i) const {
+        const cell& c = Date[i];
+        if (c.objects_count.load(std::memory_order_relaxed) <= cell::max_cell_idx) {
+            return c.span();
+        }
+        return overflowSpan(i);
+    }
+
+    CellSpan overflowSpan(unsigned int i) const {
+        const auto it = std::lower_bound(overflows.begin(), overflows.end(), i,
+            [](const Overflow& o, unsigned int c) { return o.cell < c; });
+        return { overflow_ids.data() + it->start, it->count };
+    }
+};
+
+enum class GridMode {
+    // Fixed capacity cells filled by atomic insertion
+    Cells,
+    // Counting sort into a compact id array, see sortedGrid.h
+    Sorted,
+    // Hashed tiles allocated where objects are, for large or open worlds, see sparseGrid.h.
+    // Runs the Dispatch phases whatever step_mode is set. Sleeping is not supported, and
+    // objects larger than the solver radius are only found inside the world_size box.
+    Sparse,
+};
+
+enum class StepMode {
+    // Every phase is a pool dispatch followed by a wait
+    Dispatch,
+    // The pool workers stay in one task for the whole update call, each owns fixed
+    // slices of cells, stripes and objects and phases are separated by a barrier
+    Persistent,
+    // Grid build as in Dispatch, then collision stripes and integration run as one task
+    // graph: an odd stripe starts once its two even neighbours are done
+    Graph,
+};
+
+// Accumulated wall time of each sub-step phase, in seconds.
+// In StepMode::Graph the collision time includes the integration.
+struct PhaseTimings {
+    double grid = 0.;
+    double collision = 0.;
+    double integration = 0.;
+    double reorder = 0.;
+    double constraints = 0.;
+    // Statistics passes, only when collect_stats is set
+    double stats = 0.;
+
+    void reset() {
+        grid = 0.;
+        collision = 0.;
+        integration = 0.;
+        reorder = 0.;
+        constraints = 0.;
+        stats = 0.;
+    }
 };
 
 struct PhysicSolver
 {
-    std::vector<PhysicObject> objects;
+    ParticleStore objects;
     Vec2 world_size;
     Vec2 gravity = { 0.0f, 20.0f };
     Grid grid;
+    SortedGrid sorted_grid;
+    SparseGrid sparse_grid;
+    GridMode grid_mode = GridMode::Cells;
+    // Objects are kept inside world_size. Open worlds need GridMode::Sparse, world_size
+    // then only places the bounded helpers (emitters, sleep regions, level grids).
+    bool bounded = true;
+    StepMode step_mode = StepMode::Dispatch;
+    std::unique_ptr<tp::Barrier> phase_barrier;
+
+    // Collisions are solved in stripes of this many grid rows, stripes of one parity are
+    // never neighbours. Wider stripes give each task a longer contiguous run of cells.
+    unsigned int stripe_rows = 1;
+    // When set, collisions use this many stripes of about equal cost instead: every update
+    // cuts the rows where a sampled row occupancy prefix sum crosses equal shares. Stripes
+    // keep at least one row, so the parity passes stay lock free. The count does not follow
+    // the pool size, deterministic runs stay identical across thread counts.
+    unsigned int balanced_stripes = 0;
+    // Cost of visiting a cell relative to one object in it
+    float balance_cell_cost = 0.25f;
+    // Every balance_sample_stride-th object is counted
+    static constexpr uint32_t balance_sample_stride = 8;
+    std::vector<float> row_cost;
+    // Stripe s is rows [stripe_first_row[s], stripe_first_row[s + 1]) while balanced
+    std::vector<uint32_t> stripe_first_row;
+    tp::TaskGraph phase_graph;
+    // What phase_graph was built for, it is rebuilt when any of these change
+    uint32_t graph_stripe_count = 0;
+    uint32_t graph_participants = 0;
+    // Integration chunks of phase_graph read these when they run
+    float graph_dt = 0.f;
+    uint32_t graph_object_count = 0;
+
+    // Every reorder_interval update calls the objects are stored again in grid cell
+    // order so neighbours are close in memory, 0 disables it
+    unsigned int reorder_interval = 0;
+    unsigned int updates_since_reorder = 0;
+    ParticleStore reorder_scratch;
+    // Incremented by every reorder, reorder_order[i] is the id the object at i had before it
+    uint32_t reorder_count = 0;
+    std::vector<uint32_t> reorder_order;
+
+    // Objects may have their own radius. Those up to radius live in the base grid only,
+    // larger ones are also binned by size class in large_grid and solved in a separate
+    // pass. While every object has the solver radius the uniform paths are used.
+    HierarchicalGrid large_grid;
+    bool mixed_radii = false;
+    bool large_dirty = false;
+
+    // Static scene geometry, see staticColliders.h. Objects are pushed out of it after
+    // every integration, it is binned again by the first update after a change.
+    StaticColliders colliders;
+    // Bin width in base grid cells
+    float collider_bin_cells = 2.f;
+
+    // Distance links and pins, see constraints.h. Solved constraint_iterations times
+    // between the collisions and the integration of every sub-step, links are coloured
+    // again by the first update after links were added. Graph step mode falls back to
+    // dispatch while there are constraints.
+    ConstraintSet constraints;
+    unsigned int constraint_iterations = 1;
+    // Links per task of a parallel batch
+    static constexpr uint32_t constraint_chunk = 4096;
+
+    // Regions of settled objects stop being solved and integrated, see sleepRegions.h.
+    // sleep_speed is in world units per second, sleep_delay in update calls. Regions
+    // holding linked or pinned objects stay awake.
+    SleepRegions sleep_regions;
+    bool sleeping = false;
+    float sleep_speed = 5.f;
+    uint16_t sleep_delay = 30;
+    // Squared sleep_speed displacement over one sub-step, set by update
+    float sleep_threshold2 = 0.f;
 
     // Simulation solving pass count
     unsigned int sub_steps;
@@ -53,10 +301,38 @@ struct PhysicSolver
     float friction = 50.;
     float response_coef = 0.1f;
 
+    PhaseTimings timings;
+    // Grid occupancy over the sub-steps of the last update call
+    GridStats grid_stats;
+    // Contacts, penetration, occupancy histogram and kinetic energy of the last update
+    // call. Off by default: the extra read only passes then cost nothing.
+    bool collect_stats = false;
+    SolverStats stats;
+    // One partial per parallel slice, merged in slice order
+    std::vector<SolverStats> stats_partials;
+
+    // Results independent of thread timing and pool size: the contents of every cell are
+    // sorted by id after each grid build (and before a reorder), the rest of the step
+    // is order independent (fixed stripe schedule, per object integration). Bit identical
+    // runs still need the same kernel, stripe layout and options.
+    bool deterministic = false;
+
+    // Narrow phase implementation, see contactKernel.h. The lane kernels only pay off
+    // once cells hold several objects, a settled pile at one object per cell is bound
+    // by the neighbourhood gather and is faster pairwise.
+    ContactKernelType contact_kernel = ContactKernelType::Pairwise;
+    bool fast_rsqrt = false;
+
+    // A cell and the five neighbours solveCollision visits, at most max_cell_idx objects each
+    static constexpr uint32_t max_lanes = ContactLanes::padded(6 * cell::max_cell_idx);
+
     PhysicSolver(Vec2 size,float radius = 5.f)
         : world_size{ to<float>(size.x), to<float>(size.y) }
         , sub_steps{ 8 }, radius(radius), diameter(radius * 2), diameter2(radius* radius * 4), grid(size.x / (radius * 2), size.y / (radius * 2))
+        , sorted_grid(grid.sizeX, grid.sizeY)
     {
+        large_grid.init(world_size, radius);
+        sleep_regions.init(grid.sizeX, grid.sizeY, world_size);
     }
 
     void setRadius(float radius) {
@@ -73,132 +349,1298 @@ struct PhysicSolver
     void solveContact(unsigned int atom_1_idx, unsigned int atom_2_idx)
     {
         constexpr float eps = 0.0001f;
-        PhysicObject& obj_1 = objects[atom_1_idx];
-        PhysicObject& obj_2 = objects[atom_2_idx];
-        const Vec2 o2_o1 = obj_1.position - obj_2.position;
-        const float dist2 = o2_o1.x * o2_o1.x + o2_o1.y * o2_o1.y;
+        float* x = objects.x.data();
+        float* y = objects.y.data();
+        const float dx = x[atom_1_idx] - x[atom_2_idx];
+        const float dy = y[atom_1_idx] - y[atom_2_idx];
+        const float dist2 = dx * dx + dy * dy;
         if (dist2 < diameter2 && dist2 > eps) {
             const float dist = sqrt(dist2);
             const float delta = response_coef * 0.5f * (diameter - dist);
-            const Vec2 col_vec = (o2_o1 / dist) * delta;
-            obj_1.position += col_vec;
-            obj_2.position -= col_vec;
+            const float col_x = (dx / dist) * delta;
+            const float col_y = (dy / dist) * delta;
+            x[atom_1_idx] += col_x;
+            y[atom_1_idx] += col_y;
+            x[atom_2_idx] -= col_x;
+            y[atom_2_idx] -= col_y;
         }
     }
 
-    void checkCellCollisions(const cell& a, const cell& b)
+    // Contact between objects of any radius, the push is shared by mass (area).
+    // Equal radii give the same half and half split as solveContact.
+    void solveContactSized(unsigned int atom_1_idx, unsigned int atom_2_idx)
+    {
+        constexpr float eps = 0.0001f;
+        float* x = objects.x.data();
+        float* y = objects.y.data();
+        const float r1 = objects.radius[atom_1_idx];
+        const float r2 = objects.radius[atom_2_idx];
+        const float min_dist = r1 + r2;
+        const float dx = x[atom_1_idx] - x[atom_2_idx];
+        const float dy = y[atom_1_idx] - y[atom_2_idx];
+        const float dist2 = dx * dx + dy * dy;
+        if (dist2 < min_dist * min_dist && dist2 > eps) {
+            const float dist = sqrt(dist2);
+            const float m1 = r1 * r1;
+            const float m2 = r2 * r2;
+            const float delta = response_coef * (min_dist - dist) / (dist * (m1 + m2));
+            const float col_x = dx * delta;
+            const float col_y = dy * delta;
+            x[atom_1_idx] += col_x * m2;
+            y[atom_1_idx] += col_y * m2;
+            x[atom_2_idx] -= col_x * m1;
+            y[atom_2_idx] -= col_y * m1;
+        }
+    }
+
+    // Base grid pairs when radii differ, pairs with a large object are left to solveLargeObjects
+    void checkCellCollisionsSized(const CellSpan& a, const CellSpan& b)
+    {
+        const float* r = objects.radius.data();
+        for (uint32_t i = 0; i < a.count; ++i) {
+            if (r[a.ids[i]] > radius) {
+                continue;
+            }
+            for (uint32_t j = 0; j < b.count; ++j) {
+                if (r[b.ids[j]] <= radius) {
+                    solveContactSized(a.ids[i], b.ids[j]);
+                }
+            }
+        }
+    }
+
+    void checkCellCollisions(const CellSpan& a, const CellSpan& b)
     {
-        for (int i = 0; i < a.objects_count; ++i) {
-            for (int j = 0; j < b.objects_count; ++j) {
-                solveContact(a.objects[i], b.objects[j]);
+        for (uint32_t i = 0; i < a.count; ++i) {
+            for (uint32_t j = 0; j < b.count; ++j) {
+                solveContact(a.ids[i], b.ids[j]);
             }
         }
     }
 
+    void checkCellCollisions(const cell& a, const cell& b)
+    {
+        checkCellCollisions(a.span(), b.span());
+    }
+
+    // The cell itself first, then left, down left, right, down right and down
+    template<typename TGrid>
+    static uint32_t neighbourhood(const TGrid& g, unsigned int i, CellSpan* spans)
+    {
+        uint32_t n = 0;
+        spans[n++] = g.span(i);
+
+        if (i % g.sizeX) {
+            spans[n++] = g.span(i - 1);
+            if (i + g.sizeX - 1 < g.size)
+                spans[n++] = g.span(i + g.sizeX - 1);
+        }
+
+        if ((i + 1) % g.sizeX && i + 1 < g.size) {
+            spans[n++] = g.span(i + 1);
+            if (i + g.sizeX + 1 < g.size)
+                spans[n++] = g.span(i + g.sizeX + 1);
+        }
+
+        if (i + g.sizeX < g.size) {
+            spans[n++] = g.span(i + g.sizeX);
+        }
+        return n;
+    }
+
+    static uint32_t neighbourhood(const SparseGridTile& g, unsigned int i, CellSpan* spans)
+    {
+        return g.neighbourhood(i, spans);
+    }
+
     void solveCollision(unsigned int start, unsigned int end)
     {
-        for (int i = start; i < end; ++i) {
-            auto& the = grid.Date[i];
-            checkCellCollisions(the, the);
+        if (grid_mode == GridMode::Sorted) {
+            solveCollision(sorted_grid, start, end);
+        }
+        else {
+            solveCollision(grid, start, end);
+        }
+    }
+
+    template<typename TGrid>
+    void solveCollision(const TGrid& g, unsigned int start, unsigned int end)
+    {
+        if (mixed_radii) {
+            // The lane kernels assume one diameter
+            solveCollisionSized(g, start, end);
+        }
+        else if (contact_kernel == ContactKernelType::Pairwise) {
+            solveCollisionPairwise(g, start, end);
+        }
+        else {
+            solveCollisionLanes(g, start, end);
+        }
+    }
+
+    template<typename TGrid>
+    void solveCollisionPairwise(const TGrid& g, unsigned int start, unsigned int end)
+    {
+        CellSpan spans[6];
+        for (unsigned int i = start; i < end; ++i) {
+            if (!g.span(i).count) {
+                continue;
+            }
+            const uint32_t n = neighbourhood(g, i, spans);
+            for (uint32_t k = 0; k < n; ++k) {
+                checkCellCollisions(spans[0], spans[k]);
+            }
+        }
+    }
+
+    template<typename TGrid>
+    void solveCollisionSized(const TGrid& g, unsigned int start, unsigned int end)
+    {
+        CellSpan spans[6];
+        for (unsigned int i = start; i < end; ++i) {
+            if (!g.span(i).count) {
+                continue;
+            }
+            const uint32_t n = neighbourhood(g, i, spans);
+            for (uint32_t k = 0; k < n; ++k) {
+                checkCellCollisionsSized(spans[0], spans[k]);
+            }
+        }
+    }
 
-            if (i % grid.sizeX) {
-                checkCellCollisions(the, grid.Date[i - 1]);
-                if (i + grid.sizeX - 1 < grid.size)
-                    checkCellCollisions(the, grid.Date[i + grid.sizeX - 1]);
+    // Objects of the base grid cells within reach of (px, py)
+    template<typename TGrid, typename TCallback>
+    void forBaseCells(const TGrid& g, float px, float py, float reach, TCallback&& callback) const
+    {
+        const float cell_x = world_size.x / to<float>(g.sizeX);
+        const float cell_y = world_size.y / to<float>(g.sizeY);
+        const int x0 = std::max(0, to<int>((px - reach) / cell_x));
+        const int x1 = std::min(to<int>(g.sizeX) - 1, to<int>((px + reach) / cell_x));
+        const int y0 = std::max(0, to<int>((py - reach) / cell_y));
+        const int y1 = std::min(to<int>(g.sizeY) - 1, to<int>((py + reach) / cell_y));
+        for (int cy = y0; cy <= y1; ++cy) {
+            for (int cx = x0; cx <= x1; ++cx) {
+                callback(g.span(to<unsigned int>(cx + cy * to<int>(g.sizeX))));
             }
+        }
+    }
 
-            if ((i + 1) % grid.sizeX && i+1<grid.size) {
-                checkCellCollisions(the, grid.Date[i + 1]);
-                if (i + grid.sizeX + 1 < grid.size)
-                    checkCellCollisions(the, grid.Date[i + grid.sizeX + 1]);
+    template<typename TCallback>
+    void forBaseCells(const SparseGrid& g, float px, float py, float reach, TCallback&& callback) const
+    {
+        const int32_t x0 = g.cellCoord(px - reach);
+        const int32_t x1 = g.cellCoord(px + reach);
+        const int32_t y0 = g.cellCoord(py - reach);
+        const int32_t y1 = g.cellCoord(py + reach);
+        for (int32_t cy = y0; cy <= y1; ++cy) {
+            for (int32_t cx = x0; cx <= x1; ++cx) {
+                callback(g.cellSpan(cx, cy));
             }
+        }
+    }
 
-            if (i + grid.sizeX < grid.size) {
-                checkCellCollisions(the, grid.Date[i + grid.sizeX]);
+    template<typename TCallback>
+    static void forLevelCells(const LevelGrid& level, float px, float py, float reach, TCallback&& callback)
+    {
+        const unsigned int x0 = level.cellX(px - reach);
+        const unsigned int x1 = level.cellX(px + reach);
+        const unsigned int y0 = level.cellY(py - reach);
+        const unsigned int y1 = level.cellY(py + reach);
+        for (unsigned int cy = y0; cy <= y1; ++cy) {
+            for (unsigned int cx = x0; cx <= x1; ++cx) {
+                callback(level.span(cx + cy * level.sizeX));
             }
         }
     }
 
-    void solveCollisions_Multi(tp::ThreadPool& tp)
+    // Every pair with a large object: against base objects, then against large objects of
+    // the same or a coarser level (same level pairs once, by id). Runs on one thread
+    // between the base collision pass and integration.
+    template<typename TGrid>
+    void solveLargeObjects(const TGrid& g)
     {
-        for (int i = 0; i < grid.sizeY; i += 2) {
-            tp.addTask([i,this] {
-                solveCollision(i * grid.sizeX, i * grid.sizeX + grid.sizeX);
+        const float* r = objects.radius.data();
+        for (uint32_t l = 1; l <= HierarchicalGrid::max_levels; ++l) {
+            for (const uint32_t a : large_grid.levels[l - 1].members) {
+                const float ra = r[a];
+                if (sleeping && !trackLargeObject(a, ra)) {
+                    continue;
+                }
+                forBaseCells(g, objects.x[a], objects.y[a], ra + radius, [&](const CellSpan& c) {
+                    for (uint32_t k = 0; k < c.count; ++k) {
+                        if (r[c.ids[k]] <= radius) {
+                            solveContactSized(a, c.ids[k]);
+                        }
+                    }
                 });
+                for (uint32_t m = l; m <= HierarchicalGrid::max_levels; ++m) {
+                    const LevelGrid& level = large_grid.levels[m - 1];
+                    if (level.members.empty()) {
+                        continue;
+                    }
+                    forLevelCells(level, objects.x[a], objects.y[a], ra + level.max_radius, [&](const CellSpan& c) {
+                        for (uint32_t k = 0; k < c.count; ++k) {
+                            if (m != l || c.ids[k] > a) {
+                                solveContactSized(a, c.ids[k]);
+                            }
+                        }
+                    });
+                }
+            }
+        }
+    }
+
+    // False when the object is frozen. A moving large object keeps every region within
+    // its reach awake, it may reach past the neighbour regions of its own.
+    bool trackLargeObject(uint32_t a, float ra)
+    {
+        const float px = objects.x[a];
+        const float py = objects.y[a];
+        if (sleep_regions.isFrozen(sleep_regions.regionAt(px, py))) {
+            return false;
+        }
+        const float vx = px - objects.last_x[a];
+        const float vy = py - objects.last_y[a];
+        if (vx * vx + vy * vy > sleep_threshold2) {
+            const float reach = ra + radius;
+            const float x0 = std::max(0.f, px - reach);
+            const float y0 = std::max(0.f, py - reach);
+            const float x1 = std::min(world_size.x - 1.f, px + reach);
+            const float y1 = std::min(world_size.y - 1.f, py + reach);
+            const uint32_t first = sleep_regions.regionAt(x0, y0);
+            const uint32_t last = sleep_regions.regionAt(x1, y1);
+            for (uint32_t ry = first / sleep_regions.sizeX; ry <= last / sleep_regions.sizeX; ++ry) {
+                for (uint32_t rx = first % sleep_regions.sizeX; rx <= last % sleep_regions.sizeX; ++rx) {
+                    sleep_regions.markMoving(rx + ry * sleep_regions.sizeX);
+                }
+            }
+        }
+        return true;
+    }
+
+    void solveLargeObjects()
+    {
+        if (!large_grid.large_count) {
+            return;
         }
+        if (grid_mode == GridMode::Sparse) {
+            solveLargeObjects(sparse_grid);
+        }
+        else if (grid_mode == GridMode::Sorted) {
+            solveLargeObjects(sorted_grid);
+        }
+        else {
+            solveLargeObjects(grid);
+        }
+    }
+
+    // Appends the objects of a cell to the contact lanes
+    static void gatherCell(const CellSpan& c, const float* x, const float* y, uint32_t* ids, float* lane_x, float* lane_y, uint32_t& count)
+    {
+        for (uint32_t k = 0; k < c.count; ++k) {
+            const uint32_t id = c.ids[k];
+            ids[count] = id;
+            lane_x[count] = x[id];
+            lane_y[count] = y[id];
+            ++count;
+        }
+    }
+
+    // Same neighbourhood and cell order as solveCollisionPairwise, solved by the lane kernel.
+    // Neighbourhoods that do not fit the lanes (only possible with the sorted grid) are solved pairwise.
+    template<typename TGrid>
+    void solveCollisionLanes(const TGrid& g, unsigned int start, unsigned int end)
+    {
+        const ContactKernel::Fn kernel = ContactKernel::get(contact_kernel);
+        const ContactParams params{ diameter, diameter2, response_coef * 0.5f, 0.0001f, fast_rsqrt };
+        float* x = objects.x.data();
+        float* y = objects.y.data();
+
+        CellSpan spans[6];
+        uint32_t ids[max_lanes];
+        alignas(32) float lane_x[max_lanes];
+        alignas(32) float lane_y[max_lanes];
+
+        for (unsigned int i = start; i < end; ++i) {
+            if (!g.span(i).count) {
+                continue;
+            }
+            const uint32_t n = neighbourhood(g, i, spans);
 
+            uint32_t total = 0;
+            for (uint32_t k = 0; k < n; ++k) {
+                total += spans[k].count;
+            }
+            if (total > max_lanes) {
+                for (uint32_t k = 0; k < n; ++k) {
+                    checkCellCollisions(spans[0], spans[k]);
+                }
+                continue;
+            }
+
+            uint32_t count = 0;
+            for (uint32_t k = 0; k < n; ++k) {
+                gatherCell(spans[k], x, y, ids, lane_x, lane_y, count);
+            }
+            const uint32_t own = spans[0].count;
+
+            for (uint32_t k = count; k < ContactLanes::padded(count); ++k) {
+                lane_x[k] = ContactLanes::far_away;
+                lane_y[k] = ContactLanes::far_away;
+            }
 
-        tp.waitForCompletion();
+            kernel(lane_x, lane_y, count, own, params);
 
-        for (int i = 1; i < grid.sizeY; i += 2) {
-            tp.addTask([i, this] {
-                solveCollision(i * grid.sizeX, i * grid.sizeX + grid.sizeX);
+            // Only write back lanes that were pushed, most of a settled pile is untouched
+            for (uint32_t k = 0; k < count; ++k) {
+                const uint32_t id = ids[k];
+                if (x[id] != lane_x[k] || y[id] != lane_y[k]) {
+                    x[id] = lane_x[k];
+                    y[id] = lane_y[k];
+                }
+            }
+        }
+    }
+
+    uint32_t stripeCount() const
+    {
+        if (balanced_stripes) {
+            return std::min(balanced_stripes, grid.sizeY);
+        }
+        const unsigned int rows = stripe_rows ? stripe_rows : 1;
+        return (grid.sizeY + rows - 1) / rows;
+    }
+
+    void stripeRows(uint32_t stripe, unsigned int& first_row, unsigned int& end_row) const
+    {
+        if (balanced_stripes) {
+            first_row = stripe_first_row[stripe];
+            end_row = stripe_first_row[stripe + 1];
+            return;
+        }
+        const unsigned int rows = stripe_rows ? stripe_rows : 1;
+        first_row = stripe * rows;
+        end_row = first_row + rows < grid.sizeY ? first_row + rows : grid.sizeY;
+    }
+
+    // Stripe boundaries for balanced_stripes from the current positions. A row costs its
+    // cells times balance_cell_cost plus its objects, estimated from a strided sample.
+    void balanceStripes()
+    {
+        PROFILE_SCOPE("balance");
+        const uint32_t count = stripeCount();
+        const unsigned int rows = grid.sizeY;
+        row_cost.assign(rows, balance_cell_cost * to<float>(grid.sizeX));
+        const float* y = objects.y.data();
+        const float row_scale = to<float>(rows) / world_size.y;
+        const float sample_weight = to<float>(balance_sample_stride);
+        for (uint32_t i = 0; i < to<uint32_t>(objects.size()); i += balance_sample_stride) {
+            const int row = to<int>(y[i] * row_scale);
+            row_cost[row < 0 ? 0 : std::min(to<unsigned int>(row), rows - 1)] += sample_weight;
+        }
+        double total = 0.;
+        for (const float cost : row_cost) {
+            total += cost;
+        }
+
+        // Cut after a row once the running cost passes the next share, or when the rows
+        // left are just enough for one per remaining stripe
+        stripe_first_row.resize(count + 1);
+        stripe_first_row[0] = 0;
+        uint32_t stripe = 1;
+        double running = 0.;
+        for (unsigned int row = 0; row < rows && stripe < count; ++row) {
+            running += row_cost[row];
+            const unsigned int rows_left = rows - row - 1;
+            if (running >= total * stripe / count || rows_left <= count - stripe) {
+                stripe_first_row[stripe++] = row + 1;
+            }
+        }
+        stripe_first_row[count] = rows;
+    }
+
+    uint32_t parityStripeCount(unsigned int parity) const
+    {
+        return (stripeCount() - parity + 1) / 2;
+    }
+
+    // A cell reaches one row down, so stripe s writes its own rows and the first row of
+    // stripe s + 1 but never stripe s + 2
+    void solveCollisionStripe(uint32_t stripe)
+    {
+        unsigned int first_row;
+        unsigned int end_row;
+        stripeRows(stripe, first_row, end_row);
+        if (!sleeping || !sleep_regions.frozen_count) {
+            solveCollision(first_row * grid.sizeX, end_row * grid.sizeX);
+            return;
+        }
+
+        // Row by row, skipping the spans of frozen regions
+        for (unsigned int row = first_row; row < end_row; ++row) {
+            const unsigned int row_start = row * grid.sizeX;
+            for (unsigned int cx = 0; cx < grid.sizeX; cx += SleepRegions::region_cells) {
+                const unsigned int start = row_start + cx;
+                if (sleep_regions.isFrozen(sleep_regions.regionOfCell(start))) {
+                    continue;
+                }
+                const unsigned int span = std::min(SleepRegions::region_cells, grid.sizeX - cx);
+                solveCollision(start, start + span);
+            }
+        }
+    }
+
+    // Stripes [start, end) of one parity
+    void solveCollisionStripes(unsigned int parity, uint32_t start, uint32_t end)
+    {
+        PROFILE_SCOPE_ARG("stripes", 2 * start + parity);
+        for (uint32_t s = start; s < end; ++s) {
+            solveCollisionStripe(2 * s + parity);
+        }
+    }
+
+    // Stripes of one parity never share a cell neighbourhood, so each pass runs without locks
+    void solveCollisions_Multi(tp::ThreadPool& tp)
+    {
+        PROFILE_SCOPE("collisions");
+        if (grid_mode == GridMode::Sparse) {
+            solveCollisionsSparse(tp);
+            return;
+        }
+        for (unsigned int parity = 0; parity < 2; ++parity) {
+            tp.parallelFor(parityStripeCount(parity), 1, [parity, this](uint32_t start, uint32_t end) {
+                solveCollisionStripes(parity, start, end);
                 });
         }
+        solveLargeObjects();
+    }
 
+    // Four passes over the tiles of one (x, y) parity, each tile a task
+    void solveCollisionsSparse(tp::ThreadPool& tp)
+    {
+        for (const std::vector<uint32_t>& tiles : sparse_grid.parity_tiles) {
+            tp.parallelFor(to<uint32_t>(tiles.size()), 1, [this, &tiles](uint32_t start, uint32_t end) {
+                for (uint32_t t = start; t < end; ++t) {
+                    PROFILE_SCOPE_ARG("tile", tiles[t]);
+                    solveCollision(SparseGridTile{ &sparse_grid, tiles[t] }, 0, SparseGrid::tile_area);
+                }
+            });
+        }
+        solveLargeObjects();
+    }
+
+    // Even stripes, then each odd stripe after its even neighbours, then integration
+    // chunks once every stripe is done (objects are not stored by row, any chunk may
+    // hold objects of any stripe)
+    void buildPhaseGraph(uint32_t participant_count)
+    {
+        phase_graph.clear();
+        const uint32_t stripe_count = stripeCount();
+        std::vector<uint32_t> stripe_nodes(stripe_count);
+        for (uint32_t s = 0; s < stripe_count; s += 2) {
+            stripe_nodes[s] = phase_graph.addNode([this, s]() { solveCollisionStripe(s); });
+        }
+        for (uint32_t s = 1; s < stripe_count; s += 2) {
+            stripe_nodes[s] = phase_graph.addNode([this, s]() { solveCollisionStripe(s); });
+            phase_graph.addDependency(stripe_nodes[s - 1], stripe_nodes[s]);
+            if (s + 1 < stripe_count) {
+                phase_graph.addDependency(stripe_nodes[s + 1], stripe_nodes[s]);
+            }
+        }
+
+        const uint32_t join = phase_graph.addNode([this]() { solveLargeObjects(); });
+        for (uint32_t s = 0; s < stripe_count; ++s) {
+            phase_graph.addDependency(stripe_nodes[s], join);
+        }
+
+        // A few chunks per participant to even out the tail
+        const uint32_t chunk_count = participant_count * 4;
+        for (uint32_t c = 0; c < chunk_count; ++c) {
+            const uint32_t node = phase_graph.addNode([this, c, chunk_count]() {
+                const uint32_t start = to<uint32_t>(uint64_t(graph_object_count) * c / chunk_count);
+                const uint32_t end = to<uint32_t>(uint64_t(graph_object_count) * (c + 1) / chunk_count);
+                integrateObjects(graph_dt, start, end);
+            });
+            phase_graph.addDependency(join, node);
+        }
+
+        graph_stripe_count = stripe_count;
+        graph_participants = participant_count;
+    }
+
+    void solveAndIntegrate_Graph(float dt, tp::ThreadPool& tp)
+    {
+        PROFILE_SCOPE("graph");
+        const uint32_t participant_count = tp.m_thread_count + 1;
+        if (graph_stripe_count != stripeCount() || graph_participants != participant_count) {
+            buildPhaseGraph(participant_count);
+        }
+        graph_dt = dt;
+        graph_object_count = to<uint32_t>(objects.size());
+        phase_graph.run(tp);
+    }
+
+    // Statistics of cells [start, end) of the current grid into out, read only. Pairs with
+    // an object larger than the solver radius are left out, like in the base grid pass.
+    template<typename TGrid>
+    void collectContacts(const TGrid& g, uint32_t start, uint32_t end, SolverStats& out) const
+    {
+        constexpr float eps = 0.0001f;
+        const float* x = objects.x.data();
+        const float* y = objects.y.data();
+        const float* r = objects.radius.data();
+        CellSpan spans[6];
+        for (uint32_t i = start; i < end; ++i) {
+            const CellSpan own = g.span(i);
+            ++out.occupancy[std::min(own.count, SolverStats::occupancy_buckets - 1)];
+            if (!own.count) {
+                continue;
+            }
+            const uint32_t n = neighbourhood(g, i, spans);
+            for (uint32_t k = 0; k < n; ++k) {
+                out.pairs_tested += uint64_t(own.count) * spans[k].count;
+                for (uint32_t a = 0; a < own.count; ++a) {
+                    const uint32_t id_a = own.ids[a];
+                    if (mixed_radii && r[id_a] > radius) {
+                        continue;
+                    }
+                    // Within the cell each pair once
+                    for (uint32_t b = k ? 0 : a + 1; b < spans[k].count; ++b) {
+                        const uint32_t id_b = spans[k].ids[b];
+                        if (mixed_radii && r[id_b] > radius) {
+                            continue;
+                        }
+                        const float min_dist = mixed_radii ? r[id_a] + r[id_b] : diameter;
+                        const float dx = x[id_a] - x[id_b];
+                        const float dy = y[id_a] - y[id_b];
+                        const float dist2 = dx * dx + dy * dy;
+                        if (dist2 < min_dist * min_dist && dist2 > eps) {
+                            const float depth = min_dist - std::sqrt(dist2);
+                            ++out.contacts;
+                            out.total_penetration += depth;
+                            out.max_penetration = std::max(out.max_penetration, depth);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void collectContacts(uint32_t start, uint32_t end, SolverStats& out) const
+    {
+        if (grid_mode == GridMode::Sorted) {
+            collectContacts(sorted_grid, start, end, out);
+        }
+        else {
+            collectContacts(grid, start, end, out);
+        }
+    }
+
+    // Slices of whole rows (or tiles), merged in order, so the totals do not depend on the pool
+    void collectContacts(tp::ThreadPool& tp)
+    {
+        if (grid_mode == GridMode::Sparse) {
+            const std::vector<uint32_t>& tiles = sparse_grid.ordered;
+            stats_partials.assign(tiles.size(), SolverStats());
+            tp.parallelFor(to<uint32_t>(tiles.size()), 1, [this, &tiles](uint32_t start, uint32_t end) {
+                for (uint32_t t = start; t < end; ++t) {
+                    collectContacts(SparseGridTile{ &sparse_grid, tiles[t] }, 0, SparseGrid::tile_area, stats_partials[t]);
+                }
+            });
+            for (const SolverStats& partial : stats_partials) {
+                stats.merge(partial);
+            }
+            ++stats.grid_builds;
+            return;
+        }
+        const uint32_t rows = 8;
+        const uint32_t slice_count = (grid.sizeY + rows - 1) / rows;
+        stats_partials.assign(slice_count, SolverStats());
+        tp.parallelFor(slice_count, 1, [this, rows](uint32_t start, uint32_t end) {
+            for (uint32_t slice = start; slice < end; ++slice) {
+                const uint32_t first_row = slice * rows;
+                const uint32_t end_row = std::min(first_row + rows, grid.sizeY);
+                collectContacts(first_row * grid.sizeX, end_row * grid.sizeX, stats_partials[slice]);
+            }
+        });
+        for (const SolverStats& partial : stats_partials) {
+            stats.merge(partial);
+        }
+        ++stats.grid_builds;
+    }
+
+    // Velocity from the last sub-step, sub_dt long
+    void collectEnergy(float sub_dt, tp::ThreadPool& tp)
+    {
+        const uint32_t count = to<uint32_t>(objects.size());
+        const uint32_t chunk = 16384;
+        const uint32_t slice_count = (count + chunk - 1) / chunk;
+        std::vector<double> energy(slice_count, 0.);
+        const double inv_dt = 1. / sub_dt;
+        const double inv_radius2 = 1. / (double(radius) * radius);
+        tp.parallelFor(slice_count, 1, [&](uint32_t start, uint32_t end) {
+            for (uint32_t slice = start; slice < end; ++slice) {
+                double sum = 0.;
+                for (uint32_t i = slice * chunk; i < std::min(count, (slice + 1) * chunk); ++i) {
+                    const double vx = (double(objects.x[i]) - objects.last_x[i]) * inv_dt;
+                    const double vy = (double(objects.y[i]) - objects.last_y[i]) * inv_dt;
+                    const double r = objects.radius[i];
+                    sum += 0.5 * r * r * inv_radius2 * (vx * vx + vy * vy);
+                }
+                energy[slice] = sum;
+            }
+        });
+        stats.kinetic_energy = 0.;
+        for (double e : energy) {
+            stats.kinetic_energy += e;
+        }
     }
 
     // Add a new object to the solver
     uint64_t addObject(const PhysicObject& object)
     {
         objects.push_back(object);
-        return objects.size() - 1;
+        const uint32_t id = to<uint32_t>(objects.size() - 1);
+        if (objects.radius[id] <= 0.f) {
+            objects.radius[id] = radius;
+        }
+        registerRadius(id);
+        wakeObject(id);
+        return id;
     }
 
-    // Add a new object to the solver
-    uint64_t createObject(Vec2 pos)
+    // Add a new object to the solver, object_radius 0 uses the solver radius
+    uint64_t createObject(Vec2 pos, float object_radius = 0.f)
+    {
+        objects.emplace_back(pos, object_radius > 0.f ? object_radius : radius);
+        const uint32_t id = to<uint32_t>(objects.size() - 1);
+        registerRadius(id);
+        wakeObject(id);
+        return id;
+    }
+
+    void setObjectRadius(uint32_t id, float object_radius)
+    {
+        const float previous = objects.radius[id];
+        objects.radius[id] = object_radius;
+        if (previous > radius) {
+            // Its size class may change, rebuild the classes on the next grid build
+            large_dirty = true;
+        }
+        registerRadius(id);
+        wakeObject(id);
+    }
+
+    // Objects added or changed between updates must not land in a frozen region
+    void wakeObject(uint32_t id)
     {
-        objects.emplace_back(pos);
-        return objects.size() - 1;
+        if (sleeping) {
+            sleep_regions.wake(sleep_regions.regionAt(objects.x[id], objects.y[id]));
+        }
+    }
+
+    void registerRadius(uint32_t id)
+    {
+        const float r = objects.radius[id];
+        if (r != radius) {
+            mixed_radii = true;
+        }
+        if (r > radius && !large_dirty) {
+            large_grid.add(id, r);
+        }
+    }
+
+    void rebuildLargeObjects()
+    {
+        large_grid.clear();
+        const float* r = objects.radius.data();
+        for (uint32_t i = 0; i < to<uint32_t>(objects.size()); ++i) {
+            if (r[i] > radius) {
+                large_grid.add(i, r[i]);
+            }
+        }
+        large_dirty = false;
+    }
+
+    // Link between existing objects, a negative length keeps their current distance.
+    // Returns false, adding nothing, unless a and b are two existing objects.
+    bool addLink(uint32_t a, uint32_t b, float length = -1.f, float stiffness = 1.f)
+    {
+        const uint32_t count = to<uint32_t>(objects.size());
+        if (a >= count || b >= count || a == b) {
+            return false;
+        }
+        if (length < 0.f) {
+            const float dx = objects.x[b] - objects.x[a];
+            const float dy = objects.y[b] - objects.y[a];
+            length = sqrt(dx * dx + dy * dy);
+        }
+        constraints.addLink(a, b, length, stiffness);
+        return true;
+    }
+
+    // Links and pins move their objects wherever they are, so those never sleep: a
+    // frozen object would be moved without being integrated or put in its new cell
+    void wakeConstrained()
+    {
+        for (const DistanceConstraint& link : constraints.links) {
+            wakeObject(link.a);
+            wakeObject(link.b);
+        }
+        for (const ConstraintPin& pin : constraints.pins) {
+            wakeObject(pin.id);
+        }
+    }
+
+    // Holds an existing object at position, false when id is not one
+    bool addPin(uint32_t id, Vec2 position)
+    {
+        if (id >= to<uint32_t>(objects.size())) {
+            return false;
+        }
+        constraints.addPin(id, position);
+        return true;
+    }
+
+    // One pass over the links batch by batch, then the pins
+    void solveConstraints_Multi(tp::ThreadPool& tp)
+    {
+        if (constraints.empty()) {
+            return;
+        }
+        PROFILE_SCOPE("constraints");
+        float* x = objects.x.data();
+        float* y = objects.y.data();
+        const float* r = objects.radius.data();
+        const uint32_t batches = constraints.batchCount();
+        for (unsigned int iteration = 0; iteration < constraint_iterations; ++iteration) {
+            for (uint32_t b = 0; b < batches; ++b) {
+                const uint32_t start = constraints.batch_start[b];
+                const uint32_t count = constraints.batch_start[b + 1] - start;
+                const bool serial = constraints.serial_batch && b + 1 == batches;
+                if (serial || count <= constraint_chunk) {
+                    constraints.solveLinks(x, y, r, start, start + count);
+                    continue;
+                }
+                tp.parallelFor(count, constraint_chunk, [this, x, y, r, start](uint32_t s, uint32_t e) {
+                    constraints.solveLinks(x, y, r, start + s, start + e);
+                });
+            }
+            constraints.solvePins(x, y);
+        }
+    }
+
+    void prepareColliders()
+    {
+        if (colliders.empty()) {
+            return;
+        }
+        if (large_dirty) {
+            rebuildLargeObjects();
+        }
+        float reach = radius;
+        for (const LevelGrid& level : large_grid.levels) {
+            reach = std::max(reach, level.max_radius);
+        }
+        if (colliders.needsBuild(reach)) {
+            colliders.build(collider_bin_cells * diameter, reach);
+        }
+    }
+
+    void buildLargeGrid()
+    {
+        if (large_dirty) {
+            rebuildLargeObjects();
+        }
+        if (large_grid.large_count) {
+            large_grid.build(objects.x.data(), objects.y.data());
+        }
     }
 
     void addObjectsToGrid_Multi(tp::ThreadPool& tp) {
-        grid.Clear();
+        PROFILE_SCOPE("grid");
+        buildLargeGrid();
+        if (grid_mode == GridMode::Sparse) {
+            sparse_grid.build(objects.x.data(), objects.y.data(), to<uint32_t>(objects.size()), diameter, tp, deterministic);
+            return;
+        }
+        if (grid_mode == GridMode::Sorted) {
+            sorted_grid.build(objects.x.data(), objects.y.data(), to<uint32_t>(objects.size()), world_size, tp, deterministic);
+            return;
+        }
+
+        grid.Clear_Multi(tp);
+        grid.Reserve(to<uint32_t>(objects.size()));
 
         tp.dispatch(objects.size(), [this](uint32_t start, uint32_t end) {
-            for (int i = start; i < end; i++) {
-                grid.Insert(objects[i].position, i, world_size, radius);
-            }
+            insertObjects(start, end);
             });
+        if (deterministic) {
+            tp.dispatch(grid.size, [this](uint32_t start, uint32_t end) {
+                grid.SortRange(start, end);
+                });
+        }
+
+        grid.Finalize(deterministic);
+    }
+
+    void insertObjects(uint32_t start, uint32_t end) {
+        for (uint32_t i = start; i < end; i++) {
+            grid.Insert(objects.x[i], objects.y[i], i, world_size, radius);
+        }
+    }
+
+    const GridStats& lastGridStats() const
+    {
+        if (grid_mode == GridMode::Sparse) {
+            return sparse_grid.stats;
+        }
+        return grid_mode == GridMode::Sorted ? sorted_grid.stats : grid.stats;
+    }
+
+    // Allocates the cells and room for object_capacity objects (and their reorder copy),
+    // each slice first written by the forkJoin participant that owns it in
+    // StepMode::Persistent. With a pinned pool the pages end up on the NUMA node of the
+    // worker that solves them. Persistent steps slice by the current object count, so
+    // ownership only matches while the count equals object_capacity: place the objects
+    // about to be added, not a maximum. Call before adding objects: pages never move
+    // afterwards and growing past object_capacity reallocates from the calling thread.
+    void placeMemory(tp::ThreadPool& tp, uint32_t object_capacity)
+    {
+        const uint32_t count = to<uint32_t>(objects.size());
+        const uint32_t scratch_count = to<uint32_t>(reorder_scratch.size());
+        if (grid_mode == GridMode::Cells) {
+            grid.Allocate();
+        }
+        const uint32_t capacity = std::max({ object_capacity, count, scratch_count });
+        // Resizing writes nothing, the participants below are the first to touch the pages
+        objects.reserve(capacity);
+        objects.resize(capacity);
+        reorder_scratch.reserve(capacity);
+        reorder_scratch.resize(capacity);
+
+        tp.forkJoin([&](uint32_t p, uint32_t participant_count) {
+            const auto slice = [p, participant_count](uint32_t n, uint32_t& start, uint32_t& end) {
+                start = to<uint32_t>(uint64_t(n) * p / participant_count);
+                end = to<uint32_t>(uint64_t(n) * (p + 1) / participant_count);
+            };
+            if (!grid.Date.empty()) {
+                uint32_t cell_start, cell_end;
+                slice(grid.size, cell_start, cell_end);
+                grid.ClearRange(cell_start, cell_end);
+            }
+            uint32_t start, end;
+            slice(capacity, start, end);
+            for (ParticleStore* store : { &objects, &reorder_scratch }) {
+                // Existing objects were already placed by whoever wrote them
+                const uint32_t first = std::max(start, store == &objects ? count : scratch_count);
+                if (first >= end) {
+                    continue;
+                }
+                for (FirstTouchVector<float>* values : { &store->x, &store->y, &store->last_x, &store->last_y, &store->radius }) {
+                    std::fill(values->begin() + first, values->begin() + end, 0.f);
+                }
+                std::fill(store->color.begin() + first, store->color.begin() + end, ParticleColor());
+            }
+        });
+        objects.resize(count);
+        reorder_scratch.resize(scratch_count);
+    }
+
+    // FNV-1a over 32 bit words: the object count and the bits of every position and last
+    // position. Equal checksums after the same steps mean bit identical states.
+    uint64_t checksum() const
+    {
+        uint64_t hash = 14695981039346656037ull;
+        const auto mix = [&hash](uint32_t word) {
+            hash = (hash ^ word) * 1099511628211ull;
+        };
+        const uint32_t count = to<uint32_t>(objects.size());
+        mix(count);
+        for (const FirstTouchVector<float>* values : { &objects.x, &objects.y, &objects.last_x, &objects.last_y }) {
+            for (uint32_t i = 0; i < count; ++i) {
+                uint32_t word;
+                std::memcpy(&word, &(*values)[i], sizeof(word));
+                mix(word);
+            }
+        }
+        return hash;
+    }
+
+    // Stores the objects in grid cell order, ids change so this must not run while ids are held
+    void reorderObjects(tp::ThreadPool& tp)
+    {
+        PROFILE_SCOPE("reorder");
+        const uint32_t count = to<uint32_t>(objects.size());
+        // The dense sorted grid would cover the whole world, a sparse world sorts by tile
+        const bool sparse = grid_mode == GridMode::Sparse;
+        if (sparse) {
+            sparse_grid.build(objects.x.data(), objects.y.data(), count, diameter, tp, deterministic);
+        }
+        else {
+            sorted_grid.build(objects.x.data(), objects.y.data(), count, world_size, tp, deterministic);
+        }
+        const std::vector<uint32_t>& order_ids = sparse ? sparse_grid.ids : sorted_grid.ids;
+
+        reorder_scratch.resize(count);
+        tp.dispatch(count, [this, &order_ids](uint32_t start, uint32_t end) {
+            const uint32_t* order = order_ids.data();
+            for (uint32_t i = start; i < end; ++i) {
+                const uint32_t id = order[i];
+                reorder_scratch.x[i] = objects.x[id];
+                reorder_scratch.y[i] = objects.y[id];
+                reorder_scratch.last_x[i] = objects.last_x[id];
+                reorder_scratch.last_y[i] = objects.last_y[id];
+                reorder_scratch.color[i] = objects.color[id];
+                reorder_scratch.radius[i] = objects.radius[id];
+            }
+        });
+        std::swap(objects, reorder_scratch);
+        reorder_order.assign(order_ids.begin(), order_ids.begin() + count);
+        if (!constraints.empty()) {
+            std::vector<uint32_t> new_id(count);
+            for (uint32_t i = 0; i < count; ++i) {
+                new_id[reorder_order[i]] = i;
+            }
+            constraints.remap(new_id);
+        }
+        ++reorder_count;
+        if (!sparse) {
+            sorted_grid.setIdentityOrder(tp);
+        }
+        if (large_grid.large_count) {
+            large_dirty = true;
+        }
     }
 
     void update(float dt,tp::ThreadPool& tp)
     {
+        PROFILE_SCOPE("update");
+        using clock = std::chrono::high_resolution_clock;
+        grid_stats = GridStats();
+        if (collect_stats) {
+            stats = SolverStats();
+        }
+
+        if (reorder_interval && ++updates_since_reorder >= reorder_interval) {
+            const auto t0 = clock::now();
+            updates_since_reorder = 0;
+            reorderObjects(tp);
+            timings.reorder += std::chrono::duration<double>(clock::now() - t0).count();
+        }
+
+        prepareColliders();
+        if (balanced_stripes && grid_mode != GridMode::Sparse) {
+            balanceStripes();
+        }
+        if (constraints.dirty) {
+            constraints.color(to<uint32_t>(objects.size()));
+        }
+        if (sleeping && !constraints.empty()) {
+            wakeConstrained();
+        }
         const float sub_dt = dt / to<float>(sub_steps);
+        sleep_threshold2 = sleep_speed * sub_dt * sleep_speed * sub_dt;
+        if (step_mode == StepMode::Persistent && grid_mode != GridMode::Sparse) {
+            updatePersistent(sub_dt, tp);
+        }
+        else {
+            updatePhases(sub_dt, tp);
+        }
+
+        if (sleeping) {
+            sleep_regions.update(sleep_delay);
+        }
+        else if (sleep_regions.frozen_count) {
+            sleep_regions.wakeAll();
+        }
+
+        if (collect_stats) {
+            const auto t0 = clock::now();
+            collectEnergy(sub_dt, tp);
+            timings.stats += std::chrono::duration<double>(clock::now() - t0).count();
+        }
+    }
+
+    void updatePhases(float sub_dt, tp::ThreadPool& tp)
+    {
+        using clock = std::chrono::high_resolution_clock;
         for (unsigned int i(sub_steps); i--;) {
+            const auto t0 = clock::now();
             addObjectsToGrid_Multi(tp);
-            solveCollisions_Multi(tp);
-            updateObjects_Multi(sub_dt,tp);
+            grid_stats.merge(lastGridStats());
+            double stats_time = 0.;
+            if (collect_stats) {
+                const auto s0 = clock::now();
+                collectContacts(tp);
+                stats_time = std::chrono::duration<double>(clock::now() - s0).count();
+            }
+            const auto t1 = clock::now();
+            const bool graph = step_mode == StepMode::Graph && grid_mode != GridMode::Sparse && constraints.empty();
+            if (graph) {
+                solveAndIntegrate_Graph(sub_dt, tp);
+            }
+            else {
+                solveCollisions_Multi(tp);
+            }
+            const auto t2 = clock::now();
+            solveConstraints_Multi(tp);
+            const auto t3 = clock::now();
+            if (!graph) {
+                updateObjects_Multi(sub_dt, tp);
+            }
+            const auto t4 = clock::now();
+
+            timings.grid += std::chrono::duration<double>(t1 - t0).count() - stats_time;
+            timings.stats += stats_time;
+            timings.collision += std::chrono::duration<double>(t2 - t1).count();
+            timings.constraints += std::chrono::duration<double>(t3 - t2).count();
+            timings.integration += std::chrono::duration<double>(t4 - t3).count();
         }
     }
 
-    void updateObjects_Multi(float dt,tp::ThreadPool& tp)
+    // Same phases as update, run by resident participants. Slices are fixed for the whole
+    // call, the participant running on the calling thread also records the timings.
+    void updatePersistent(float sub_dt, tp::ThreadPool& tp)
     {
-        tp.dispatch(to<unsigned int>(objects.size()), [this,dt](unsigned int start, unsigned int end) {
-            for (unsigned int i = start; i < end; ++i) {
+        using clock = std::chrono::high_resolution_clock;
+        const uint32_t object_count = to<uint32_t>(objects.size());
+        const uint32_t participant_count = tp.m_thread_count + 1;
+        if (!phase_barrier || phase_barrier->m_count != participant_count) {
+            phase_barrier.reset(new tp::Barrier(participant_count));
+        }
+        if (grid_mode == GridMode::Sorted) {
+            sorted_grid.prepare(object_count, participant_count);
+        }
+        else {
+            grid.Reserve(object_count);
+        }
+        if (collect_stats) {
+            // Each participant adds up its cell slice over every sub-step
+            stats_partials.assign(participant_count, SolverStats());
+        }
+
+        tp.forkJoin([&](uint32_t p, uint32_t count) {
+            tp::Barrier& barrier = *phase_barrier;
+            // The barrier outlives the call and the barrier count per call may be odd,
+            // start from its current sense (no participant can complete one before all arrive)
+            bool sense = barrier.m_sense.load();
+            const bool timer = p + 1 == count;
+            const auto slice = [p, count](uint32_t n, uint32_t& start, uint32_t& end) {
+                start = to<uint32_t>(uint64_t(n) * p / count);
+                end = to<uint32_t>(uint64_t(n) * (p + 1) / count);
+            };
+            uint32_t cell_start, cell_end, object_start, object_end;
+            slice(grid.size, cell_start, cell_end);
+            slice(object_count, object_start, object_end);
+            uint32_t stripe_start[2], stripe_end[2];
+            for (unsigned int parity = 0; parity < 2; ++parity) {
+                slice(parityStripeCount(parity), stripe_start[parity], stripe_end[parity]);
+            }
 
-                PhysicObject& obj = objects[i];
-                // Add gravity
-                obj.acceleration += gravity;
-                // Apply Verlet integration
-                obj.update(dt,friction);
-                // Apply map borders collisions
-                const float margin = diameter;
-                if (obj.position.x > world_size.x - margin) {
-                    obj.position.x = world_size.x - margin;
+            for (unsigned int i(sub_steps); i--;) {
+                const auto t0 = clock::now();
+                if (grid_mode == GridMode::Sorted) {
+                    sorted_grid.clearCounts(cell_start, cell_end);
+                    barrier.arriveAndWait(sense);
+                    sorted_grid.countObjects(objects.x.data(), objects.y.data(), object_start, object_end, world_size);
+                    barrier.arriveAndWait(sense);
+                    sorted_grid.sumChunk(p, cell_start, cell_end);
+                    barrier.arriveAndWait(sense);
+                    if (timer) {
+                        sorted_grid.scanChunks(object_count);
+                        buildLargeGrid();
+                    }
+                    barrier.arriveAndWait(sense);
+                    sorted_grid.offsetChunk(p, cell_start, cell_end);
+                    barrier.arriveAndWait(sense);
+                    sorted_grid.scatter(object_start, object_end);
+                    barrier.arriveAndWait(sense);
+                    if (deterministic) {
+                        sorted_grid.sortCells(cell_start, cell_end);
+                        barrier.arriveAndWait(sense);
+                    }
                 }
-                else if (obj.position.x < margin) {
-                    obj.position.x = margin;
+                else {
+                    grid.ClearRange(cell_start, cell_end);
+                    if (timer) {
+                        grid.ResetCounters();
+                    }
+                    barrier.arriveAndWait(sense);
+                    insertObjects(object_start, object_end);
+                    barrier.arriveAndWait(sense);
+                    if (deterministic) {
+                        grid.SortRange(cell_start, cell_end);
+                        barrier.arriveAndWait(sense);
+                    }
+                    if (timer) {
+                        grid.Finalize(deterministic);
+                        buildLargeGrid();
+                    }
+                    barrier.arriveAndWait(sense);
                 }
-                if (obj.position.y > world_size.y - margin) {
-                    obj.position.y = world_size.y - margin;
+                if (timer) {
+                    grid_stats.merge(lastGridStats());
+                }
+                double stats_time = 0.;
+                if (collect_stats) {
+                    const auto s0 = clock::now();
+                    collectContacts(cell_start, cell_end, stats_partials[p]);
+                    // Positions are read, the collision pass must not start before every slice is done
+                    barrier.arriveAndWait(sense);
+                    stats_time = std::chrono::duration<double>(clock::now() - s0).count();
+                }
+
+                const auto t1 = clock::now();
+                for (unsigned int parity = 0; parity < 2; ++parity) {
+                    solveCollisionStripes(parity, stripe_start[parity], stripe_end[parity]);
+                    barrier.arriveAndWait(sense);
                 }
-                else if (obj.position.y < margin) {
-                    obj.position.y = margin;
+                if (large_grid.large_count) {
+                    if (timer) {
+                        solveLargeObjects();
+                    }
+                    barrier.arriveAndWait(sense);
+                }
+
+                const auto t2 = clock::now();
+                if (!constraints.empty()) {
+                    solveConstraintsPersistent(p, count, barrier, sense);
+                }
+
+                const auto t3 = clock::now();
+                integrateObjects(sub_dt, object_start, object_end);
+                barrier.arriveAndWait(sense);
+
+                if (timer) {
+                    const auto t4 = clock::now();
+                    timings.grid += std::chrono::duration<double>(t1 - t0).count() - stats_time;
+                    timings.stats += stats_time;
+                    timings.collision += std::chrono::duration<double>(t2 - t1).count();
+                    timings.constraints += std::chrono::duration<double>(t3 - t2).count();
+                    timings.integration += std::chrono::duration<double>(t4 - t3).count();
                 }
             }
         });
 
+        if (collect_stats) {
+            for (const SolverStats& partial : stats_partials) {
+                stats.merge(partial);
+            }
+            stats.grid_builds += sub_steps;
+        }
+    }
+
+    // solveConstraints_Multi for participant p of a persistent pass, one barrier per batch
+    void solveConstraintsPersistent(uint32_t p, uint32_t count, tp::Barrier& barrier, bool& sense)
+    {
+        float* x = objects.x.data();
+        float* y = objects.y.data();
+        const float* r = objects.radius.data();
+        const uint32_t batches = constraints.batchCount();
+        const bool last = p + 1 == count;
+        for (unsigned int iteration = 0; iteration < constraint_iterations; ++iteration) {
+            for (uint32_t b = 0; b < batches; ++b) {
+                const uint32_t start = constraints.batch_start[b];
+                const uint32_t size = constraints.batch_start[b + 1] - start;
+                if (constraints.serial_batch && b + 1 == batches) {
+                    if (last) {
+                        constraints.solveLinks(x, y, r, start, start + size);
+                    }
+                }
+                else {
+                    constraints.solveLinks(x, y, r, start + to<uint32_t>(uint64_t(size) * p / count),
+                        start + to<uint32_t>(uint64_t(size) * (p + 1) / count));
+                }
+                barrier.arriveAndWait(sense);
+            }
+            if (last) {
+                constraints.solvePins(x, y);
+            }
+            barrier.arriveAndWait(sense);
+        }
+    }
+
+    void updateObjects_Multi(float dt,tp::ThreadPool& tp)
+    {
+        PROFILE_SCOPE("integrate");
+        tp.dispatch(to<unsigned int>(objects.size()), [this,dt](unsigned int start, unsigned int end) {
+            integrateObjects(dt, start, end);
+        });
+    }
+
+    // Verlet step of objects [start, end)
+    void integrateObjects(float dt, uint32_t start, uint32_t end)
+    {
+        if (sleeping) {
+            integrateObjects<true>(dt, start, end);
+        }
+        else {
+            integrateObjects<false>(dt, start, end);
+        }
+    }
+
+    // With track_sleep, objects of frozen regions are skipped and the others report motion
+    template<bool track_sleep>
+    void integrateObjects(float dt, uint32_t start, uint32_t end)
+    {
+        float* x = objects.x.data();
+        float* y = objects.y.data();
+        float* last_x = objects.last_x.data();
+        float* last_y = objects.last_y.data();
+        const float* r = objects.radius.data();
+        const float dt2 = dt * dt * 0.5f;
+        const bool collide_static = !colliders.empty();
+
+        for (unsigned int i = start; i < end; ++i) {
+            uint32_t region = 0;
+            if (track_sleep) {
+                region = sleep_regions.regionAt(x[i], y[i]);
+                if (sleep_regions.isFrozen(region)) {
+                    continue;
+                }
+            }
+
+            // Apply Verlet integration, gravity is the only acceleration
+            const float move_x = x[i] - last_x[i];
+            const float move_y = y[i] - last_y[i];
+            float new_x = x[i] + move_x + (gravity.x - move_x * friction) * dt2;
+            float new_y = y[i] + move_y + (gravity.y - move_y * friction) * dt2;
+            last_x[i] = x[i];
+            last_y[i] = y[i];
+
+            // Static geometry first: the border clamp must have the last word, the grids
+            // and sleep regions index with the result
+            if (collide_static) {
+                colliders.resolve(new_x, new_y, r[i]);
+            }
+
+            // Apply map borders collisions
+            if (bounded) {
+                const float margin = r[i] * 2.f;
+                if (new_x > world_size.x - margin) {
+                    new_x = world_size.x - margin;
+                }
+                else if (new_x < margin) {
+                    new_x = margin;
+                }
+                if (new_y > world_size.y - margin) {
+                    new_y = world_size.y - margin;
+                }
+                else if (new_y < margin) {
+                    new_y = margin;
+                }
+            }
+            if (track_sleep) {
+                const float step_x = new_x - x[i];
+                const float step_y = new_y - y[i];
+                if (step_x * step_x + step_y * step_y > sleep_threshold2) {
+                    sleep_regions.markMoving(region);
+                }
+            }
+            x[i] = new_x;
+            y[i] = new_y;
+        }
     }
 };
 
@@ -223,8 +1665,8 @@ struct Emiter {
 
             for (int i = 0; i < emitNum; i++) {
                 auto id = solver.createObject(Position + Vec2(0, intv * i));
-                auto& obj = solver.objects[id];
-                obj.last_position -= Speed * dt;
+                auto obj = solver.objects[id];
+                obj.addVelocity(Speed * dt);
                 obj.color = ColorUtils::getRainbow(id * 0.00001f);
             }
         }
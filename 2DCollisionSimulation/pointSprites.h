@@ -0,0 +1,98 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include "utils.h"
+
+// One vertex per object (center, color, radius in texCoords.x, 20 bytes) streamed to a
+// persistent GPU buffer and expanded to a textured quad by a geometry shader, instead of
+// four 20 byte vertices built on the CPU. Needs vertex buffers and geometry shaders;
+// when init fails the caller keeps drawing quads.
+struct PointSprites {
+    sf::VertexBuffer buffer{ sf::Points, sf::VertexBuffer::Stream };
+    std::vector<sf::Vertex> points;
+    sf::Shader shader;
+    bool available = false;
+
+    static constexpr const char* vertex_source = R"(
+        #version 150 compatibility
+        out vec4 v_color;
+        out float v_radius;
+        void main()
+        {
+            gl_Position = gl_Vertex;
+            v_color = gl_Color;
+            v_radius = gl_MultiTexCoord0.x;
+        }
+    )";
+
+    static constexpr const char* geometry_source = R"(
+        #version 150 compatibility
+        layout(points) in;
+        layout(triangle_strip, max_vertices = 4) out;
+        in vec4 v_color[];
+        in float v_radius[];
+        out vec4 g_color;
+        out vec2 g_uv;
+        void main()
+        {
+            const vec2 corners[4] = vec2[4](vec2(-1.0, -1.0), vec2(1.0, -1.0), vec2(-1.0, 1.0), vec2(1.0, 1.0));
+            for (int i = 0; i < 4; ++i) {
+                vec2 world = gl_in[0].gl_Position.xy + corners[i] * v_radius[0];
+                gl_Position = gl_ModelViewProjectionMatrix * vec4(world, 0.0, 1.0);
+                g_color = v_color[0];
+                g_uv = corners[i] * 0.5 + 0.5;
+                EmitVertex();
+            }
+            EndPrimitive();
+        }
+    )";
+
+    static constexpr const char* fragment_source = R"(
+        #version 150 compatibility
+        uniform sampler2D sprite_texture;
+        in vec4 g_color;
+        in vec2 g_uv;
+        void main()
+        {
+            gl_FragColor = texture2D(sprite_texture, g_uv) * g_color;
+        }
+    )";
+
+    // Needs an active GL context (a window or a RenderTexture)
+    bool init() {
+        available = sf::VertexBuffer::isAvailable() && sf::Shader::isAvailable() && sf::Shader::isGeometryAvailable()
+            && shader.loadFromMemory(vertex_source, geometry_source, fragment_source);
+        if (available) {
+            shader.setUniform("sprite_texture", sf::Shader::CurrentTexture);
+        }
+        return available;
+    }
+
+    void resize(uint32_t count) {
+        points.resize(count);
+    }
+
+    inline void set(uint32_t i, const Vec2& position, float radius, const sf::Color& color) {
+        points[i].position = position;
+        points[i].color = color;
+        points[i].texCoords.x = radius;
+    }
+
+    // Uploads the points filled since resize and draws them
+    void draw(sf::RenderTarget& target, const sf::Texture& texture) {
+        const uint32_t count = to<uint32_t>(points.size());
+        if (!count) {
+            return;
+        }
+        if (buffer.getVertexCount() < count) {
+            // Grown in steps so a growing world does not reallocate every frame
+            buffer.create(count + count / 2);
+        }
+        buffer.update(points.data(), count, 0);
+
+        sf::RenderStates states;
+        states.texture = &texture;
+        states.shader = &shader;
+        target.draw(buffer, 0, count, states);
+    }
+};
@@ -0,0 +1,249 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scoped timers recorded into per thread ring buffers. Recording is lock free and costs
+// a relaxed load while disabled; PROFILER_ENABLED=0 compiles the scopes out.
+#ifndef PROFILER_ENABLED
+#define PROFILER_ENABLED 1
+#endif
+
+struct ProfileEvent {
+    // String literal, compared by address
+    const char* name;
+    // Nanoseconds since the profiler was created
+    uint64_t start;
+    uint64_t duration;
+    uint32_t arg;
+    uint16_t depth;
+    // Waiting for other threads (a barrier, the end of a parallel for)
+    bool idle;
+};
+
+struct ProfileThread {
+    static constexpr uint32_t capacity = 1 << 16;
+
+    std::unique_ptr<ProfileEvent[]> events{ new ProfileEvent[capacity] };
+    // Events ever written, the last capacity of them are kept
+    std::atomic<uint64_t> written{ 0 };
+    uint16_t depth = 0;
+    std::string name;
+
+    void push(const ProfileEvent& event) {
+        const uint64_t index = written.load(std::memory_order_relaxed);
+        events[index % capacity] = event;
+        written.store(index + 1, std::memory_order_release);
+    }
+};
+
+// Aggregate of one scope name over a window
+struct ProfileStat {
+    const char* name = nullptr;
+    uint32_t count = 0;
+    double total = 0.;
+    double max = 0.;
+};
+
+struct Profiler {
+    using clock = std::chrono::high_resolution_clock;
+
+    std::atomic<bool> enabled{ false };
+    clock::time_point epoch = clock::now();
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ProfileThread>> threads;
+
+    static Profiler& instance() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    static bool active() {
+        return instance().enabled.load(std::memory_order_relaxed);
+    }
+
+    uint64_t now() const {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - epoch).count());
+    }
+
+    // The calling thread's buffer, registered on first use and kept after the thread exits
+    ProfileThread& local() {
+        ProfileThread*& thread = localPointer();
+        if (!thread) {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.emplace_back(new ProfileThread());
+            thread = threads.back().get();
+            thread->name = localName().empty() ? "thread " + std::to_string(threads.size() - 1) : localName();
+        }
+        return *thread;
+    }
+
+    // Names the calling thread in traces, does not allocate its buffer
+    void setThreadName(const std::string& name) {
+        localName() = name;
+        if (localPointer()) {
+            localPointer()->name = name;
+        }
+    }
+
+    static ProfileThread*& localPointer() {
+        thread_local ProfileThread* thread = nullptr;
+        return thread;
+    }
+
+    static std::string& localName() {
+        thread_local std::string name;
+        return name;
+    }
+
+    // The readers below copy the buffers without synchronization: call them while no
+    // thread records, e.g. between updates with every pool idle
+    template<typename TCallback>
+    void forEachEvent(uint64_t since, TCallback&& callback) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint32_t t = 0; t < threads.size(); ++t) {
+            const ProfileThread& thread = *threads[t];
+            const uint64_t written = thread.written.load(std::memory_order_acquire);
+            const uint64_t first = written > ProfileThread::capacity ? written - ProfileThread::capacity : 0;
+            for (uint64_t i = first; i < written; ++i) {
+                const ProfileEvent& event = thread.events[i % ProfileThread::capacity];
+                if (event.start + event.duration >= since) {
+                    callback(t, event);
+                }
+            }
+        }
+    }
+
+    // Per scope totals and per thread busy fractions over the last window seconds. Busy is
+    // the time in outermost scopes minus the idle scopes inside them.
+    void summarize(double window, std::vector<ProfileStat>& stats, std::vector<float>& busy) {
+        const uint64_t end = now();
+        const uint64_t window_ns = static_cast<uint64_t>(window * 1e9);
+        const uint64_t since = end > window_ns ? end - window_ns : 0;
+        stats.clear();
+        busy.assign(threads.size(), 0.f);
+        std::vector<double> busy_ns(threads.size(), 0.);
+        forEachEvent(since, [&](uint32_t thread, const ProfileEvent& event) {
+            auto it = std::find_if(stats.begin(), stats.end(), [&event](const ProfileStat& s) { return s.name == event.name; });
+            if (it == stats.end()) {
+                stats.emplace_back();
+                it = stats.end() - 1;
+                it->name = event.name;
+            }
+            const double seconds = static_cast<double>(event.duration) * 1e-9;
+            ++it->count;
+            it->total += seconds;
+            it->max = std::max(it->max, seconds);
+            // Only the part inside the window counts towards busy
+            const double inside = static_cast<double>(std::min(event.duration, event.start + event.duration - since));
+            if (!event.depth && !event.idle) {
+                busy_ns[thread] += inside;
+            }
+            else if (event.depth && event.idle) {
+                busy_ns[thread] -= inside;
+            }
+        });
+        for (uint32_t t = 0; t < busy.size(); ++t) {
+            busy[t] = static_cast<float>(std::max(0., busy_ns[t]) / static_cast<double>(end - since));
+        }
+    }
+
+    // Rolling overlay text: average and worst ms per call of every scope, then how busy
+    // each thread was, which shows imbalance between tasks and time lost waiting
+    std::string hudText(double window = 1.) {
+        std::vector<ProfileStat> stats;
+        std::vector<float> busy;
+        summarize(window, stats, busy);
+        std::string text;
+        char line[128];
+        for (const ProfileStat& stat : stats) {
+            snprintf(line, sizeof(line), "\n%-12s %7.3f ms %7.3f max %6u/s", stat.name,
+                stat.total * 1e3 / stat.count, stat.max * 1e3, static_cast<uint32_t>(stat.count / window));
+            text += line;
+        }
+        text += "\nBusy:";
+        for (float b : busy) {
+            snprintf(line, sizeof(line), " %.0f%%", b * 100.f);
+            text += line;
+        }
+        return text;
+    }
+
+    // Chrome trace event format, open in chrome://tracing or ui.perfetto.dev
+    bool writeChromeTrace(const char* path) {
+        std::ofstream out(path, std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+        out << "{\"traceEvents\":[";
+        bool first = true;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (uint32_t t = 0; t < threads.size(); ++t) {
+                out << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << t
+                    << ",\"args\":{\"name\":\"" << threads[t]->name << "\"}}";
+                first = false;
+            }
+        }
+        char line[256];
+        forEachEvent(0, [&](uint32_t thread, const ProfileEvent& event) {
+            snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"arg\":%u}}",
+                event.name, event.idle ? "idle" : "work", thread,
+                static_cast<double>(event.start) * 1e-3, static_cast<double>(event.duration) * 1e-3, event.arg);
+            out << line;
+        });
+        out << "\n]}\n";
+        return bool(out);
+    }
+};
+
+struct ProfileScope {
+    ProfileThread* thread = nullptr;
+    const char* name;
+    uint64_t start = 0;
+    uint32_t arg;
+    bool idle;
+
+    ProfileScope(const char* name, uint32_t arg = 0, bool idle = false)
+        : name(name)
+        , arg(arg)
+        , idle(idle)
+    {
+        if (Profiler::active()) {
+            Profiler& profiler = Profiler::instance();
+            thread = &profiler.local();
+            ++thread->depth;
+            start = profiler.now();
+        }
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+    ~ProfileScope() {
+        if (thread) {
+            const uint64_t end = Profiler::instance().now();
+            --thread->depth;
+            thread->push({ name, start, end - start, arg, thread->depth, idle });
+        }
+    }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#if PROFILER_ENABLED
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#define PROFILE_SCOPE_ARG(name, arg) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name, arg)
+#define PROFILE_IDLE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name, 0, true)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_SCOPE_ARG(name, arg)
+#define PROFILE_IDLE(name)
+#endif
@@ -2,6 +2,9 @@
 #include <SFML/Graphics.hpp>
 #include <chrono>
 #include "physics.h"
+#include "renderSnapshot.h"
+#include "pointSprites.h"
+#include "profiler.h"
 #include "threadPool.h"
 
 
@@ -11,16 +14,28 @@ struct Renderer
 
     sf::VertexArray world_va;
     sf::VertexArray objects_va;
+    // Static colliders as triangles, rebuilt when their version changes
+    sf::VertexArray colliders_va{ sf::Triangles };
+    uint32_t colliders_version = 0;
     sf::Texture     object_texture;
     sf::Font font;
     sf::Text text;
-    float radius;
+
+    // Drawn state between the previous update (0) and the latest one (1). last_position is
+    // one sub-step back, the previous update is extrapolated from that velocity.
+    float interpolation = 1.f;
+
+    // Particles as point sprites when the GPU can expand them, else quads built here.
+    // Either path draws to any sf::RenderTarget, a RenderTexture works offscreen.
+    PointSprites sprites;
+    bool point_sprites = false;
 
     explicit
-        Renderer(PhysicSolver& solver,float radius = 10.f)
-        : solver(solver),radius(radius)
+        Renderer(PhysicSolver& solver)
+        : solver(solver)
     {
         initializeWorldVA();
+        point_sprites = sprites.init();
 
         object_texture.loadFromFile("../res/circle.png");
         object_texture.generateMipmap();
@@ -34,22 +49,23 @@ struct Renderer
         //text.setStyle(sf::Text::Bold | sf::Text::Underlined); // ıʽ
     }
 
-    void render(sf::RenderWindow& window) {
+    void render(sf::RenderTarget& window) {
         window.draw(&world_va[0], 4, sf::Quads);
+        drawColliders(window);
 
         sf::RenderStates states;
         states.texture = &object_texture;
 
         // Particles
         updateParticlesVA();
-        if (objects_va.getVertexCount() > 0)
-            window.draw(&objects_va[0], objects_va.getVertexCount(), sf::Quads, states);
+        drawParticles(window, states);
 
         renderHUD(window);
     }
 
-    void renderMultiThread(sf::RenderWindow& window,tp::ThreadPool& tp) {
+    void renderMultiThread(sf::RenderTarget& window,tp::ThreadPool& tp) {
         window.draw(&world_va[0], 4, sf::Quads);
+        drawColliders(window);
 
         sf::RenderStates states;
         states.texture = &object_texture;
@@ -57,8 +73,28 @@ struct Renderer
         // Particles
         updateParticlesVAMultiThread(tp);
         //tp.waitForCompletion();
-        if (objects_va.getVertexCount() > 0)
-            window.draw(&objects_va[0], objects_va.getVertexCount(), sf::Quads, states);
+        drawParticles(window, states);
+
+        renderHUD(window);
+    }
+
+    // Draws a snapshot, safe while the solver is being updated on another thread. tp must
+    // not be the pool the solver is using.
+    void renderSnapshot(sf::RenderTarget& window, const RenderSnapshot& snapshot, tp::ThreadPool& tp) {
+        window.draw(&world_va[0], 4, sf::Quads);
+        drawColliders(window);
+
+        sf::RenderStates states;
+        states.texture = &object_texture;
+
+        resizeParticles(snapshot.count);
+        {
+            PROFILE_SCOPE("vertices");
+            tp.dispatch(snapshot.count, [this, &snapshot](uint32_t start, uint32_t end) {
+                updateParticlesVARange(snapshot, start, end);
+            });
+        }
+        drawParticles(window, states);
 
         renderHUD(window);
     }
@@ -78,59 +114,132 @@ struct Renderer
         world_va[3].color = background_color;
     }
 
-    void updateParticlesVA() {
-        objects_va.resize(solver.objects.size() * 4);
+    // The solver only reads the shapes, they can be drawn while it updates
+    void drawColliders(sf::RenderTarget& window) {
+        const StaticColliders& colliders = solver.colliders;
+        if (colliders_version != colliders.version) {
+            colliders_version = colliders.version;
+            updateCollidersVA();
+        }
+        if (colliders_va.getVertexCount() > 0) {
+            window.draw(colliders_va);
+        }
+    }
 
-        const float texture_size = 1024.0f;
+    void updateCollidersVA() {
+        const sf::Color color{ 40, 40, 40 };
+        const StaticColliders& colliders = solver.colliders;
+        colliders_va.clear();
+        for (const StaticSegment& segment : colliders.segments) {
+            const Vec2 ab = segment.b - segment.a;
+            const float length = std::sqrt(ab.x * ab.x + ab.y * ab.y);
+            if (length == 0.f) {
+                continue;
+            }
+            // At least a pixel wide, the rounded ends are left out
+            const float half_width = std::max(0.5f, segment.thickness);
+            const Vec2 n{ -ab.y / length * half_width, ab.x / length * half_width };
+            const Vec2 corners[6] = { segment.a + n, segment.b + n, segment.b - n, segment.a + n, segment.b - n, segment.a - n };
+            for (const Vec2& corner : corners) {
+                colliders_va.append(sf::Vertex(corner, color));
+            }
+        }
+        const uint32_t sides = 24;
+        for (const StaticCircle& circle : colliders.circles) {
+            for (uint32_t i = 0; i < sides; ++i) {
+                const float a0 = to<float>(i) * Math::TwoPI / to<float>(sides);
+                const float a1 = to<float>(i + 1) * Math::TwoPI / to<float>(sides);
+                colliders_va.append(sf::Vertex(circle.center, color));
+                colliders_va.append(sf::Vertex(circle.center + circle.radius * Vec2{ std::cos(a0), std::sin(a0) }, color));
+                colliders_va.append(sf::Vertex(circle.center + circle.radius * Vec2{ std::cos(a1), std::sin(a1) }, color));
+            }
+        }
+    }
 
-        for (uint32_t i = 0; i < solver.objects.size(); ++i) {
-            const PhysicObject& object = solver.objects[i];
-            const uint32_t idx = i << 2;
-            objects_va[idx + 0].position = object.position + Vec2{ -radius, -radius };
-            objects_va[idx + 1].position = object.position + Vec2{ radius, -radius };
-            objects_va[idx + 2].position = object.position + Vec2{ radius,  radius };
-            objects_va[idx + 3].position = object.position + Vec2{ -radius,  radius };
-            objects_va[idx + 0].texCoords = { 0.0f        , 0.0f };
-            objects_va[idx + 1].texCoords = { texture_size, 0.0f };
-            objects_va[idx + 2].texCoords = { texture_size, texture_size };
-            objects_va[idx + 3].texCoords = { 0.0f        , texture_size };
-
-            const sf::Color color = object.color;
-            objects_va[idx + 0].color = color;
-            objects_va[idx + 1].color = color;
-            objects_va[idx + 2].color = color;
-            objects_va[idx + 3].color = color;
+    void resizeParticles(uint32_t count) {
+        if (point_sprites) {
+            sprites.resize(count);
+        }
+        else {
+            objects_va.resize(count * 4);
         }
     }
 
-    void updateParticlesVAMultiThread(tp::ThreadPool& tp) {
-        objects_va.resize(solver.objects.size() * 4);
+    void drawParticles(sf::RenderTarget& window, const sf::RenderStates& states) {
+        if (point_sprites) {
+            sprites.draw(window, object_texture);
+        }
+        else if (objects_va.getVertexCount() > 0) {
+            window.draw(&objects_va[0], objects_va.getVertexCount(), sf::Quads, states);
+        }
+    }
+
+    inline void setParticle(uint32_t i, const Vec2& position, float radius, const sf::Color& color) {
+        if (point_sprites) {
+            sprites.set(i, position, radius, color);
+        }
+        else {
+            setQuad(i, position, radius, color);
+        }
+    }
+
+    void updateParticlesVA() {
+        resizeParticles(to<uint32_t>(solver.objects.size()));
+        updateParticlesVARange(0, to<uint32_t>(solver.objects.size()));
+    }
+
+    void updateParticlesVARange(uint32_t start, uint32_t end) {
+        const float* x = solver.objects.x.data();
+        const float* y = solver.objects.y.data();
+        const float* last_x = solver.objects.last_x.data();
+        const float* last_y = solver.objects.last_y.data();
+        const float back = (1.f - interpolation) * to<float>(solver.sub_steps);
+        const ParticleColor* colors = solver.objects.color.data();
+        const float* radii = solver.objects.radius.data();
+
+        for (uint32_t i = start; i < end; ++i) {
+            const Vec2 position{ x[i] - (x[i] - last_x[i]) * back, y[i] - (y[i] - last_y[i]) * back };
+            setParticle(i, position, radii[i], colors[i]);
+        }
+    }
+
+    void updateParticlesVARange(const RenderSnapshot& snapshot, uint32_t start, uint32_t end) {
+        const float t = snapshot.interpolation;
+        for (uint32_t i = start; i < end; ++i) {
+            const Vec2 position{ snapshot.prev_x[i] + (snapshot.x[i] - snapshot.prev_x[i]) * t,
+                                 snapshot.prev_y[i] + (snapshot.y[i] - snapshot.prev_y[i]) * t };
+            setParticle(i, position, snapshot.radius[i], snapshot.color[i]);
+        }
+    }
 
+    inline void setQuad(uint32_t i, const Vec2& position, float radius, const sf::Color& color) {
         const float texture_size = 1024.0f;
+        const uint32_t idx = i << 2;
+        objects_va[idx + 0].position = position + Vec2{ -radius, -radius };
+        objects_va[idx + 1].position = position + Vec2{ radius, -radius };
+        objects_va[idx + 2].position = position + Vec2{ radius,  radius };
+        objects_va[idx + 3].position = position + Vec2{ -radius,  radius };
+        objects_va[idx + 0].texCoords = { 0.0f        , 0.0f };
+        objects_va[idx + 1].texCoords = { texture_size, 0.0f };
+        objects_va[idx + 2].texCoords = { texture_size, texture_size };
+        objects_va[idx + 3].texCoords = { 0.0f        , texture_size };
+
+        objects_va[idx + 0].color = color;
+        objects_va[idx + 1].color = color;
+        objects_va[idx + 2].color = color;
+        objects_va[idx + 3].color = color;
+    }
 
-        tp.dispatch(to<uint32_t>(solver.objects.size()), [this, texture_size](uint32_t start, uint32_t end) {
-            for (uint32_t i = start; i < end; ++i) {
-                const PhysicObject& object = solver.objects[i];
-                const uint32_t idx = i << 2;
-                objects_va[idx + 0].position = object.position + Vec2{ -radius, -radius };
-                objects_va[idx + 1].position = object.position + Vec2{ radius, -radius };
-                objects_va[idx + 2].position = object.position + Vec2{ radius,  radius };
-                objects_va[idx + 3].position = object.position + Vec2{ -radius,  radius };
-                objects_va[idx + 0].texCoords = { 0.0f        , 0.0f };
-                objects_va[idx + 1].texCoords = { texture_size, 0.0f };
-                objects_va[idx + 2].texCoords = { texture_size, texture_size };
-                objects_va[idx + 3].texCoords = { 0.0f        , texture_size };
-
-                const sf::Color color = object.color;
-                objects_va[idx + 0].color = color;
-                objects_va[idx + 1].color = color;
-                objects_va[idx + 2].color = color;
-                objects_va[idx + 3].color = color;
-            }
+    void updateParticlesVAMultiThread(tp::ThreadPool& tp) {
+        PROFILE_SCOPE("vertices");
+        resizeParticles(to<uint32_t>(solver.objects.size()));
+
+        tp.dispatch(to<uint32_t>(solver.objects.size()), [this](uint32_t start, uint32_t end) {
+            updateParticlesVARange(start, end);
         });
     }
 
-    void renderHUD(sf::RenderWindow& window) {
+    void renderHUD(sf::RenderTarget& window) {
         window.draw(text); // ı
     }
 };
\ No newline at end of file
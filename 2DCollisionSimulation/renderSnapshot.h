@@ -0,0 +1,127 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "physics.h"
+#include "profiler.h"
+#include "threadPool.h"
+
+// What the renderer needs of one solver state, copied out so drawing can run while the
+// solver moves on
+struct RenderSnapshot {
+    std::vector<float> x;
+    std::vector<float> y;
+    // Position one update earlier, extrapolated from last_position for interpolation
+    std::vector<float> prev_x;
+    std::vector<float> prev_y;
+    std::vector<ParticleColor> color;
+    std::vector<float> radius;
+    uint32_t count = 0;
+    // Interpolation factor of the frame the snapshot was taken for, see Renderer
+    float interpolation = 1.f;
+
+    void resize(uint32_t object_count) {
+        count = object_count;
+        x.resize(count);
+        y.resize(count);
+        prev_x.resize(count);
+        prev_y.resize(count);
+        color.resize(count);
+        radius.resize(count);
+    }
+
+    void extract(const PhysicSolver& solver, tp::ThreadPool& tp) {
+        resize(to<uint32_t>(solver.objects.size()));
+        const float sub_steps = to<float>(solver.sub_steps);
+        tp.dispatch(count, [this, &solver, sub_steps](uint32_t start, uint32_t end) {
+            const ParticleStore& objects = solver.objects;
+            for (uint32_t i = start; i < end; ++i) {
+                x[i] = objects.x[i];
+                y[i] = objects.y[i];
+                prev_x[i] = objects.x[i] - (objects.x[i] - objects.last_x[i]) * sub_steps;
+                prev_y[i] = objects.y[i] - (objects.y[i] - objects.last_y[i]) * sub_steps;
+                color[i] = objects.color[i];
+                radius[i] = objects.radius[i];
+            }
+        });
+    }
+};
+
+// Two snapshots and a simulation thread. begin hands the thread a job that advances the
+// solver and extracts into back(), the caller draws front() meanwhile; end waits for the
+// job and swaps, so the drawn state is one frame behind the solver.
+struct RenderPipeline {
+    RenderSnapshot snapshots[2];
+    uint32_t front_index = 0;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::function<void()> job;
+    bool job_pending = false;
+    bool stopping = false;
+
+    RenderPipeline() {
+        thread = std::thread([this]() { run(); });
+    }
+
+    RenderPipeline(const RenderPipeline&) = delete;
+    RenderPipeline& operator=(const RenderPipeline&) = delete;
+
+    ~RenderPipeline() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        thread.join();
+    }
+
+    const RenderSnapshot& front() const {
+        return snapshots[front_index];
+    }
+
+    // Only the job may touch it between begin and end
+    RenderSnapshot& back() {
+        return snapshots[front_index ^ 1];
+    }
+
+    template<typename TCallback>
+    void begin(TCallback&& callback) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = std::forward<TCallback>(callback);
+            job_pending = true;
+        }
+        cv.notify_all();
+    }
+
+    void end() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return !job_pending; });
+        front_index ^= 1;
+    }
+
+    void run() {
+        Profiler::instance().setThreadName("pipeline");
+        for (;;) {
+            std::function<void()> current;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return job_pending || stopping; });
+                if (!job_pending) {
+                    return;
+                }
+                current = std::move(job);
+            }
+            current();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job_pending = false;
+            }
+            cv.notify_all();
+        }
+    }
+};
@@ -0,0 +1,122 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "utils.h"
+
+// Sleep state of square blocks of grid cells. A region falls asleep once none of its
+// objects moved faster than the threshold for sleep_delay update calls in a row. A
+// sleeping region whose neighbours all sleep too is frozen: its cells are not solved and
+// its objects are not integrated. An awake neighbour unfreezes it, so motion spreads
+// region by region.
+struct SleepRegions {
+    static constexpr unsigned int region_cells = 8;
+
+    unsigned int gridSizeX = 0;
+    unsigned int gridSizeY = 0;
+    unsigned int sizeX = 0;
+    unsigned int sizeY = 0;
+    Vec2 world_size;
+
+    std::vector<uint16_t> quiet_updates;
+    // Set by any thread that sees an object of the region move during an update call
+    std::unique_ptr<std::atomic<uint8_t>[]> moving;
+    std::vector<uint8_t> frozen;
+    uint32_t frozen_count = 0;
+
+    void init(unsigned int grid_size_x, unsigned int grid_size_y, const Vec2& WorldSize) {
+        gridSizeX = grid_size_x;
+        gridSizeY = grid_size_y;
+        sizeX = (grid_size_x + region_cells - 1) / region_cells;
+        sizeY = (grid_size_y + region_cells - 1) / region_cells;
+        world_size = WorldSize;
+        const uint32_t size = sizeX * sizeY;
+        quiet_updates.assign(size, 0);
+        frozen.assign(size, 0);
+        moving.reset(new std::atomic<uint8_t>[size]);
+        for (uint32_t i = 0; i < size; ++i) {
+            moving[i].store(0, std::memory_order_relaxed);
+        }
+        frozen_count = 0;
+    }
+
+    inline uint32_t size() const {
+        return sizeX * sizeY;
+    }
+
+    inline uint32_t regionOfCell(unsigned int cell) const {
+        return (cell % gridSizeX) / region_cells + (cell / gridSizeX) / region_cells * sizeX;
+    }
+
+    // Same binning as Grid::Insert
+    inline uint32_t regionAt(float x, float y) const {
+        const unsigned int cx = to<unsigned int>(x * gridSizeX / world_size.x);
+        const unsigned int cy = to<unsigned int>(y * gridSizeY / world_size.y);
+        return cx / region_cells + cy / region_cells * sizeX;
+    }
+
+    inline bool isFrozen(uint32_t region) const {
+        return frozen[region] != 0;
+    }
+
+    inline void markMoving(uint32_t region) {
+        if (!moving[region].load(std::memory_order_relaxed)) {
+            moving[region].store(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Also unfreezes the region right away, for objects added or changed between updates
+    void wake(uint32_t region) {
+        markMoving(region);
+        quiet_updates[region] = 0;
+        if (frozen[region]) {
+            frozen[region] = 0;
+            --frozen_count;
+        }
+    }
+
+    // Once per update call, after the last sub-step
+    void update(uint16_t sleep_delay) {
+        for (uint32_t i = 0; i < size(); ++i) {
+            if (moving[i].load(std::memory_order_relaxed)) {
+                quiet_updates[i] = 0;
+                moving[i].store(0, std::memory_order_relaxed);
+            }
+            else if (quiet_updates[i] < sleep_delay) {
+                ++quiet_updates[i];
+            }
+        }
+        refreeze(sleep_delay);
+    }
+
+    // Frozen flags from the current counters
+    void refreeze(uint16_t sleep_delay) {
+        frozen_count = 0;
+        for (unsigned int ry = 0; ry < sizeY; ++ry) {
+            for (unsigned int rx = 0; rx < sizeX; ++rx) {
+                bool all_asleep = true;
+                for (int dy = -1; dy <= 1 && all_asleep; ++dy) {
+                    for (int dx = -1; dx <= 1 && all_asleep; ++dx) {
+                        const int nx = to<int>(rx) + dx;
+                        const int ny = to<int>(ry) + dy;
+                        if (nx >= 0 && ny >= 0 && nx < to<int>(sizeX) && ny < to<int>(sizeY)) {
+                            all_asleep = quiet_updates[nx + ny * sizeX] >= sleep_delay;
+                        }
+                    }
+                }
+                frozen[rx + ry * sizeX] = all_asleep;
+                frozen_count += all_asleep;
+            }
+        }
+    }
+
+    // Wakes everything, for changes the regions cannot see (world or solver parameters)
+    void wakeAll() {
+        for (uint32_t i = 0; i < size(); ++i) {
+            quiet_updates[i] = 0;
+            frozen[i] = 0;
+        }
+        frozen_count = 0;
+    }
+};
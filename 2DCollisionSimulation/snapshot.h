@@ -0,0 +1,412 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+#include <vector>
+#include "physics.h"
+
+// Binary checkpoint of a PhysicSolver and its emitters.
+//
+// Layout, little endian: SnapshotHeader, emiter_count SnapshotEmiter, then the object
+// arrays, each starting on a snapshot_alignment boundary so a mapped file can be used in
+// place:
+//   exact      x, y, last_x, last_y as float
+//   quantized  x, y as uint16 over the world size, velocity (position - last position)
+//              as int16 in 1 / snapshot_velocity_scale units
+//   color as 4 bytes, radius as float only without snapshot_uniform_radius,
+//   then region_count uint16 sleep counters, link_count DistanceConstraint and
+//   pin_count ConstraintPin.
+// Exact snapshots restore the state bit for bit, quantized ones are half the size and
+// good for warm starts. Quantized positions only cover the world box, open worlds
+// (bounded false) can only be saved exactly.
+
+constexpr uint32_t snapshot_version = 3;
+constexpr uint32_t snapshot_alignment = 64;
+constexpr float snapshot_velocity_scale = 8192.f;
+
+enum SnapshotFlags : uint32_t {
+    snapshot_quantized = 1u << 0,
+    snapshot_uniform_radius = 1u << 1,
+};
+
+struct SnapshotHeader {
+    char magic[4] = { 'C', 'S', 'N', 'P' };
+    uint32_t version = snapshot_version;
+    uint32_t flags = 0;
+    uint32_t object_count = 0;
+    uint32_t emiter_count = 0;
+    uint32_t region_count = 0;
+
+    float world_x = 0.f;
+    float world_y = 0.f;
+    float radius = 0.f;
+    float gravity_x = 0.f;
+    float gravity_y = 0.f;
+    float friction = 0.f;
+    float response_coef = 0.f;
+    float sleep_speed = 0.f;
+    uint32_t sub_steps = 0;
+    uint32_t grid_mode = 0;
+    uint32_t reorder_interval = 0;
+    uint32_t updates_since_reorder = 0;
+    uint32_t contact_kernel = 0;
+    uint32_t fast_rsqrt = 0;
+    uint32_t step_mode = 0;
+    uint32_t stripe_rows = 0;
+    uint32_t sleeping = 0;
+    uint32_t sleep_delay = 0;
+    uint32_t bounded = 1;
+    uint32_t link_count = 0;
+    uint32_t pin_count = 0;
+    uint32_t reserved[5] = {};
+};
+static_assert(sizeof(SnapshotHeader) == 128, "snapshot header layout changed");
+
+struct SnapshotEmiter {
+    float speed_x = 0.f;
+    float speed_y = 0.f;
+    float position_x = 0.f;
+    float position_y = 0.f;
+    float time = 0.f;
+    float interval = 0.f;
+    uint32_t emit_num = 0;
+    uint32_t reserved = 0;
+};
+static_assert(sizeof(SnapshotEmiter) == 32, "snapshot emiter layout changed");
+static_assert(sizeof(DistanceConstraint) == 16 && sizeof(ConstraintPin) == 12, "snapshot constraint layout changed");
+
+struct SnapshotWriter {
+    std::ofstream file;
+    uint64_t offset = 0;
+
+    explicit
+        SnapshotWriter(const char* path)
+        : file(path, std::ios::binary | std::ios::trunc)
+    {
+    }
+
+    void write(const void* data, size_t bytes) {
+        file.write(static_cast<const char*>(data), to<std::streamsize>(bytes));
+        offset += bytes;
+    }
+
+    void align() {
+        static const char zeros[snapshot_alignment] = {};
+        const uint64_t padding = (snapshot_alignment - offset % snapshot_alignment) % snapshot_alignment;
+        write(zeros, to<size_t>(padding));
+    }
+
+    template<typename T>
+    void writeArray(const T* data, size_t count) {
+        static_assert(std::is_trivially_copyable<T>::value, "snapshot arrays must be trivially copyable");
+        align();
+        write(data, count * sizeof(T));
+    }
+};
+
+struct SnapshotReader {
+    std::ifstream file;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+
+    explicit
+        SnapshotReader(const char* path)
+        : file(path, std::ios::binary | std::ios::ate)
+    {
+        if (file) {
+            size = to<uint64_t>(file.tellg());
+            file.seekg(0);
+        }
+    }
+
+    // Whether the rest of the file can hold bytes more, checked before sizing buffers from
+    // counts in the header
+    bool holds(uint64_t bytes) const {
+        return offset <= size && bytes <= size - offset;
+    }
+
+    bool read(void* data, size_t bytes) {
+        file.read(static_cast<char*>(data), to<std::streamsize>(bytes));
+        offset += bytes;
+        return to<size_t>(file.gcount()) == bytes;
+    }
+
+    bool align() {
+        char skipped[snapshot_alignment];
+        const uint64_t padding = (snapshot_alignment - offset % snapshot_alignment) % snapshot_alignment;
+        return read(skipped, to<size_t>(padding));
+    }
+
+    template<typename T>
+    bool readArray(T* data, size_t count) {
+        return align() && read(data, count * sizeof(T));
+    }
+};
+
+inline uint16_t quantizePosition(float v, float size) {
+    const float q = std::round(v / size * 65535.f);
+    return to<uint16_t>(q < 0.f ? 0.f : (q > 65535.f ? 65535.f : q));
+}
+
+inline float dequantizePosition(uint16_t q, float size) {
+    return to<float>(q) * size / 65535.f;
+}
+
+inline int16_t quantizeVelocity(float v) {
+    const float q = std::round(v * snapshot_velocity_scale);
+    return to<int16_t>(q < -32767.f ? -32767.f : (q > 32767.f ? 32767.f : q));
+}
+
+// Reads only the header, to construct a solver with the saved world size and radius
+inline bool peekSnapshot(const char* path, SnapshotHeader& header) {
+    SnapshotReader reader(path);
+    if (!reader.file || !reader.read(&header, sizeof(header))) {
+        return false;
+    }
+    return !std::memcmp(header.magic, SnapshotHeader().magic, 4) && header.version == snapshot_version;
+}
+
+inline bool saveSnapshot(const char* path, const PhysicSolver& solver, const Emiter* emiters, uint32_t emiter_count, bool quantized = false) {
+    if (quantized && !solver.bounded) {
+        return false;
+    }
+    SnapshotWriter writer(path);
+    if (!writer.file) {
+        return false;
+    }
+
+    const uint32_t count = to<uint32_t>(solver.objects.size());
+    SnapshotHeader header;
+    header.flags = (quantized ? snapshot_quantized : 0u) | (solver.mixed_radii ? 0u : snapshot_uniform_radius);
+    header.object_count = count;
+    header.emiter_count = emiter_count;
+    header.region_count = solver.sleeping ? solver.sleep_regions.size() : 0u;
+    header.world_x = solver.world_size.x;
+    header.world_y = solver.world_size.y;
+    header.radius = solver.radius;
+    header.gravity_x = solver.gravity.x;
+    header.gravity_y = solver.gravity.y;
+    header.friction = solver.friction;
+    header.response_coef = solver.response_coef;
+    header.sleep_speed = solver.sleep_speed;
+    header.sub_steps = solver.sub_steps;
+    header.grid_mode = to<uint32_t>(solver.grid_mode);
+    header.reorder_interval = solver.reorder_interval;
+    header.updates_since_reorder = solver.updates_since_reorder;
+    header.contact_kernel = to<uint32_t>(solver.contact_kernel);
+    header.fast_rsqrt = solver.fast_rsqrt;
+    header.step_mode = to<uint32_t>(solver.step_mode);
+    header.stripe_rows = solver.stripe_rows;
+    header.sleeping = solver.sleeping;
+    header.sleep_delay = solver.sleep_delay;
+    header.bounded = solver.bounded;
+    header.link_count = to<uint32_t>(solver.constraints.links.size());
+    header.pin_count = to<uint32_t>(solver.constraints.pins.size());
+    writer.write(&header, sizeof(header));
+
+    for (uint32_t i = 0; i < emiter_count; ++i) {
+        SnapshotEmiter e;
+        e.speed_x = emiters[i].Speed.x;
+        e.speed_y = emiters[i].Speed.y;
+        e.position_x = emiters[i].Position.x;
+        e.position_y = emiters[i].Position.y;
+        e.time = emiters[i].time;
+        e.interval = emiters[i].intervel;
+        e.emit_num = emiters[i].emitNum;
+        writer.write(&e, sizeof(e));
+    }
+
+    const ParticleStore& objects = solver.objects;
+    if (quantized) {
+        std::vector<uint16_t> positions(count);
+        std::vector<int16_t> velocities(count);
+        for (int axis = 0; axis < 2; ++axis) {
+            const float* p = axis ? objects.y.data() : objects.x.data();
+            const float size = axis ? solver.world_size.y : solver.world_size.x;
+            for (uint32_t i = 0; i < count; ++i) {
+                positions[i] = quantizePosition(p[i], size);
+            }
+            writer.writeArray(positions.data(), count);
+        }
+        for (int axis = 0; axis < 2; ++axis) {
+            const float* p = axis ? objects.y.data() : objects.x.data();
+            const float* last = axis ? objects.last_y.data() : objects.last_x.data();
+            for (uint32_t i = 0; i < count; ++i) {
+                velocities[i] = quantizeVelocity(p[i] - last[i]);
+            }
+            writer.writeArray(velocities.data(), count);
+        }
+    }
+    else {
+        writer.writeArray(objects.x.data(), count);
+        writer.writeArray(objects.y.data(), count);
+        writer.writeArray(objects.last_x.data(), count);
+        writer.writeArray(objects.last_y.data(), count);
+    }
+    writer.writeArray(objects.color.data(), count);
+    if (solver.mixed_radii) {
+        writer.writeArray(objects.radius.data(), count);
+    }
+    if (header.region_count) {
+        writer.writeArray(solver.sleep_regions.quiet_updates.data(), header.region_count);
+    }
+    writer.writeArray(solver.constraints.links.data(), header.link_count);
+    writer.writeArray(solver.constraints.pins.data(), header.pin_count);
+    writer.align();
+    return to<bool>(writer.file);
+}
+
+// The solver must have been constructed with the saved world size and radius, see
+// peekSnapshot. At most emiter_count emitters are restored. The whole file is read and
+// checked first: on failure the solver and the emitters are left untouched.
+inline bool loadSnapshot(const char* path, PhysicSolver& solver, Emiter* emiters, uint32_t emiter_count) {
+        SnapshotReader reader(path);
+    SnapshotHeader header;
+    if (!reader.file || !reader.read(&header, sizeof(header))
+        || std::memcmp(header.magic, SnapshotHeader().magic, 4) || header.version != snapshot_version) {
+        return false;
+    }
+    if (header.world_x != solver.world_size.x || header.world_y != solver.world_size.y || header.radius != solver.radius) {
+        return false;
+    }
+    if (header.region_count && header.region_count != solver.sleep_regions.size()) {
+        return false;
+    }
+    if (header.grid_mode > to<uint32_t>(GridMode::Sparse) || header.contact_kernel > to<uint32_t>(ContactKernelType::AVX2)
+        || header.step_mode > to<uint32_t>(StepMode::Graph) || !header.sub_steps || !header.stripe_rows
+        || header.sleep_delay > UINT16_MAX || (!header.bounded && header.grid_mode != to<uint32_t>(GridMode::Sparse))) {
+        return false;
+    }
+
+    // Counts must fit in what is left of the file before anything is allocated for them
+    const bool quantized = (header.flags & snapshot_quantized) != 0;
+    const bool uniform_radius = (header.flags & snapshot_uniform_radius) != 0;
+    const uint64_t count = header.object_count;
+    const uint64_t object_bytes = (quantized ? 8u : 16u) + sizeof(ParticleColor) + (uniform_radius ? 0u : sizeof(float));
+    if (!reader.holds(uint64_t(header.emiter_count) * sizeof(SnapshotEmiter) + count * object_bytes
+        + uint64_t(header.region_count) * sizeof(uint16_t) + uint64_t(header.link_count) * sizeof(DistanceConstraint)
+        + uint64_t(header.pin_count) * sizeof(ConstraintPin))) {
+        return false;
+    }
+
+    std::vector<SnapshotEmiter> saved_emiters(header.emiter_count);
+    if (!reader.read(saved_emiters.data(), saved_emiters.size() * sizeof(SnapshotEmiter))) {
+        return false;
+    }
+
+    ParticleStore objects;
+    objects.resize(to<size_t>(count));
+    if (quantized) {
+        std::vector<uint16_t> positions(to<size_t>(count));
+        std::vector<int16_t> velocities(to<size_t>(count));
+        for (int axis = 0; axis < 2; ++axis) {
+            float* p = axis ? objects.y.data() : objects.x.data();
+            const float size = axis ? header.world_y : header.world_x;
+            if (!reader.readArray(positions.data(), to<size_t>(count))) {
+                return false;
+            }
+            for (uint32_t i = 0; i < count; ++i) {
+                p[i] = dequantizePosition(positions[i], size);
+            }
+        }
+        for (int axis = 0; axis < 2; ++axis) {
+            const float* p = axis ? objects.y.data() : objects.x.data();
+            float* last = axis ? objects.last_y.data() : objects.last_x.data();
+            if (!reader.readArray(velocities.data(), to<size_t>(count))) {
+                return false;
+            }
+            for (uint32_t i = 0; i < count; ++i) {
+                last[i] = p[i] - to<float>(velocities[i]) / snapshot_velocity_scale;
+            }
+        }
+    }
+    else if (!reader.readArray(objects.x.data(), to<size_t>(count)) || !reader.readArray(objects.y.data(), to<size_t>(count))
+        || !reader.readArray(objects.last_x.data(), to<size_t>(count)) || !reader.readArray(objects.last_y.data(), to<size_t>(count))) {
+        return false;
+    }
+    if (!reader.readArray(objects.color.data(), to<size_t>(count))) {
+        return false;
+    }
+    if (uniform_radius) {
+        std::fill(objects.radius.begin(), objects.radius.end(), solver.radius);
+    }
+    else if (!reader.readArray(objects.radius.data(), to<size_t>(count))) {
+        return false;
+    }
+
+    // The grids index cells with positions, bounded worlds need them inside the box
+    for (uint32_t i = 0; i < count; ++i) {
+        const bool inside = header.bounded
+            ? objects.x[i] >= 0.f && objects.x[i] < header.world_x && objects.y[i] >= 0.f && objects.y[i] < header.world_y
+            : std::isfinite(objects.x[i]) && std::isfinite(objects.y[i]);
+        if (!inside || !std::isfinite(objects.last_x[i]) || !std::isfinite(objects.last_y[i]) || !(objects.radius[i] > 0.f)) {
+            return false;
+        }
+    }
+
+    std::vector<uint16_t> quiet_updates(header.region_count);
+    if (header.region_count && !reader.readArray(quiet_updates.data(), header.region_count)) {
+        return false;
+    }
+
+    // Constraints refer to objects by id, the saved order is kept
+    std::vector<DistanceConstraint> links(header.link_count);
+    std::vector<ConstraintPin> pins(header.pin_count);
+    if (!reader.readArray(links.data(), header.link_count) || !reader.readArray(pins.data(), header.pin_count)) {
+        return false;
+    }
+    for (const DistanceConstraint& link : links) {
+        if (link.a >= count || link.b >= count) {
+            return false;
+        }
+    }
+    for (const ConstraintPin& pin : pins) {
+        if (pin.id >= count) {
+            return false;
+        }
+    }
+
+    // Everything parsed, apply
+    for (uint32_t i = 0; i < header.emiter_count && i < emiter_count; ++i) {
+        const SnapshotEmiter& e = saved_emiters[i];
+        emiters[i].Speed = { e.speed_x, e.speed_y };
+        emiters[i].Position = { e.position_x, e.position_y };
+        emiters[i].time = e.time;
+        emiters[i].intervel = e.interval;
+        emiters[i].emitNum = e.emit_num;
+    }
+
+    solver.objects = std::move(objects);
+    solver.gravity = { header.gravity_x, header.gravity_y };
+    solver.friction = header.friction;
+    solver.response_coef = header.response_coef;
+    solver.sleep_speed = header.sleep_speed;
+    solver.sub_steps = header.sub_steps;
+    solver.grid_mode = static_cast<GridMode>(header.grid_mode);
+    solver.reorder_interval = header.reorder_interval;
+    solver.updates_since_reorder = header.updates_since_reorder;
+    solver.contact_kernel = static_cast<ContactKernelType>(header.contact_kernel);
+    solver.fast_rsqrt = header.fast_rsqrt != 0;
+    solver.step_mode = static_cast<StepMode>(header.step_mode);
+    solver.stripe_rows = header.stripe_rows;
+    solver.sleeping = header.sleeping != 0;
+    solver.sleep_delay = to<uint16_t>(header.sleep_delay);
+    solver.bounded = header.bounded != 0;
+
+    // Derived state
+    solver.mixed_radii = !uniform_radius;
+    solver.large_dirty = true;
+    solver.sleep_regions.wakeAll();
+    if (header.region_count) {
+        solver.sleep_regions.quiet_updates = std::move(quiet_updates);
+        solver.sleep_regions.refreeze(solver.sleep_delay);
+    }
+
+    ConstraintSet& constraints = solver.constraints;
+    constraints.clear();
+    constraints.links = std::move(links);
+    constraints.pins = std::move(pins);
+    return true;
+}
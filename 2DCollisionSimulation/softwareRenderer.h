@@ -0,0 +1,258 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <vector>
+#include "renderSnapshot.h"
+#include "sortedGrid.h"
+#include "staticColliders.h"
+#include "threadPool.h"
+
+// CPU rasterizer for headless output. Objects are binned into screen tiles with a
+// SortedGrid and every tile splats the anti aliased discs of its own bin. A disc may
+// spill into the neighbouring tiles, so tiles are drawn in four passes by (x, y) parity,
+// like the collision stripes: tiles of one pass are never neighbours and run in parallel.
+// Discs must be smaller than a tile.
+struct SoftwareRenderer {
+    static constexpr uint32_t tile_size = 64;
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t tiles_x = 0;
+    uint32_t tiles_y = 0;
+    // RGBA, 4 bytes per pixel, rows top to bottom
+    std::vector<uint8_t> pixels;
+    std::unique_ptr<SortedGrid> bins;
+    ParticleColor background{ 120, 120, 120 };
+    ParticleColor collider_color{ 40, 40, 40 };
+
+    SoftwareRenderer(uint32_t width, uint32_t height)
+        : width(width)
+        , height(height)
+        , tiles_x((width + tile_size - 1) / tile_size)
+        , tiles_y((height + tile_size - 1) / tile_size)
+        , pixels(size_t(width) * height * 4)
+        , bins(new SortedGrid(tiles_x, tiles_y))
+    {
+    }
+
+    // Draws the world [0, world_size) scaled to the framebuffer
+    void render(const RenderSnapshot& snapshot, const Vec2& world_size, tp::ThreadPool& tp) {
+        // Tiles cover whole pixels, the grid spans the padded size
+        const float scale = to<float>(width) / world_size.x;
+        const Vec2 binned_size{ to<float>(tiles_x * tile_size) / scale, to<float>(tiles_y * tile_size) / scale };
+        // Canonical, overlapping discs are drawn in the same order every time
+        bins->build(snapshot.x.data(), snapshot.y.data(), snapshot.count, binned_size, tp, true);
+
+        tp.parallelFor(height, 16, [&](uint32_t start, uint32_t end) {
+            const uint32_t fill = background.r | background.g << 8 | background.b << 16 | 0xFFu << 24;
+            uint8_t* p = pixels.data() + size_t(start) * width * 4;
+            for (size_t k = 0, n = size_t(end - start) * width; k < n; ++k, p += 4) {
+                std::memcpy(p, &fill, 4);
+            }
+        });
+
+        const uint32_t pass_x = (tiles_x + 1) / 2;
+        const uint32_t pass_y = (tiles_y + 1) / 2;
+        for (uint32_t pass = 0; pass < 4; ++pass) {
+            const uint32_t ox = pass & 1;
+            const uint32_t oy = pass >> 1;
+            tp.parallelFor(pass_x * pass_y, 1, [&](uint32_t start, uint32_t end) {
+                for (uint32_t t = start; t < end; ++t) {
+                    const uint32_t tx = (t % pass_x) * 2 + ox;
+                    const uint32_t ty = (t / pass_x) * 2 + oy;
+                    if (tx < tiles_x && ty < tiles_y) {
+                        renderTile(snapshot, scale, tx + ty * tiles_x);
+                    }
+                }
+            });
+        }
+    }
+
+    void renderTile(const RenderSnapshot& snapshot, float scale, uint32_t tile) {
+        const CellSpan bin = bins->span(tile);
+        for (uint32_t k = 0; k < bin.count; ++k) {
+            const uint32_t i = bin.ids[k];
+            splat(snapshot.x[i] * scale, snapshot.y[i] * scale, snapshot.radius[i] * scale, snapshot.color[i]);
+        }
+    }
+
+    // Coverage is the distance of the pixel center inside the disc edge, clamped to [0, 1]
+    void splat(float cx, float cy, float r, const ParticleColor& color) {
+        const int px0 = std::max(0, to<int>(cx - r - 0.5f));
+        const int py0 = std::max(0, to<int>(cy - r - 0.5f));
+        const int px1 = std::min(to<int>(width), to<int>(cx + r + 1.5f));
+        const int py1 = std::min(to<int>(height), to<int>(cy + r + 1.5f));
+        const float alpha = to<float>(color.a) / 255.f;
+        // Pixels beyond the outer radius get nothing, the square root is only taken inside
+        const float outer2 = (r + 0.5f) * (r + 0.5f);
+
+        for (int y = py0; y < py1; ++y) {
+            const float dy = to<float>(y) + 0.5f - cy;
+            uint8_t* p = pixels.data() + (size_t(y) * width + px0) * 4;
+            for (int x = px0; x < px1; ++x, p += 4) {
+                const float dx = to<float>(x) + 0.5f - cx;
+                const float d2 = dx * dx + dy * dy;
+                if (d2 >= outer2) {
+                    continue;
+                }
+                float coverage = r + 0.5f - std::sqrt(d2);
+                coverage = (coverage < 1.f ? coverage : 1.f) * alpha;
+                p[0] = to<uint8_t>(p[0] + (to<float>(color.r) - p[0]) * coverage + 0.5f);
+                p[1] = to<uint8_t>(p[1] + (to<float>(color.g) - p[1]) * coverage + 0.5f);
+                p[2] = to<uint8_t>(p[2] + (to<float>(color.b) - p[2]) * coverage + 0.5f);
+            }
+        }
+    }
+
+    // Static geometry over the frame, on the calling thread. Segments are at least a pixel wide.
+    void drawColliders(const StaticColliders& colliders, const Vec2& world_size) {
+        const float scale = to<float>(width) / world_size.x;
+        for (const StaticSegment& segment : colliders.segments) {
+            const StaticSegment scaled{ segment.a * scale, segment.b * scale, std::max(0.5f, segment.thickness * scale) };
+            fillShape(std::min(scaled.a.x, scaled.b.x) - scaled.thickness, std::min(scaled.a.y, scaled.b.y) - scaled.thickness,
+                std::max(scaled.a.x, scaled.b.x) + scaled.thickness, std::max(scaled.a.y, scaled.b.y) + scaled.thickness,
+                [&scaled](float px, float py) {
+                    const Vec2 p = StaticColliders::closestPoint(scaled, px, py);
+                    return scaled.thickness - std::sqrt((px - p.x) * (px - p.x) + (py - p.y) * (py - p.y));
+                });
+        }
+        for (const StaticCircle& circle : colliders.circles) {
+            const Vec2 center = circle.center * scale;
+            const float r = circle.radius * scale;
+            fillShape(center.x - r, center.y - r, center.x + r, center.y + r, [center, r](float px, float py) {
+                return r - std::sqrt((px - center.x) * (px - center.x) + (py - center.y) * (py - center.y));
+            });
+        }
+    }
+
+    // Blends collider_color over the pixels of [x0, x1] x [y0, y1], inside(px, py) is the
+    // signed distance of a pixel center inside the shape
+    template<typename TInside>
+    void fillShape(float x0, float y0, float x1, float y1, TInside&& inside) {
+        const int px0 = std::max(0, to<int>(x0 - 0.5f));
+        const int py0 = std::max(0, to<int>(y0 - 0.5f));
+        const int px1 = std::min(to<int>(width), to<int>(x1 + 1.5f));
+        const int py1 = std::min(to<int>(height), to<int>(y1 + 1.5f));
+        for (int y = py0; y < py1; ++y) {
+            uint8_t* p = pixels.data() + (size_t(y) * width + px0) * 4;
+            for (int x = px0; x < px1; ++x, p += 4) {
+                float coverage = inside(to<float>(x) + 0.5f, to<float>(y) + 0.5f) + 0.5f;
+                if (coverage <= 0.f) {
+                    continue;
+                }
+                coverage = coverage < 1.f ? coverage : 1.f;
+                p[0] = to<uint8_t>(p[0] + (to<float>(collider_color.r) - p[0]) * coverage + 0.5f);
+                p[1] = to<uint8_t>(p[1] + (to<float>(collider_color.g) - p[1]) * coverage + 0.5f);
+                p[2] = to<uint8_t>(p[2] + (to<float>(collider_color.b) - p[2]) * coverage + 0.5f);
+            }
+        }
+    }
+
+    // Appends the framebuffer as one rawvideo rgba frame, e.g. for
+    // ffmpeg -f rawvideo -pix_fmt rgba -s WxH -r 60 -i frames.raw out.mp4
+    bool writeRaw(std::ostream& out) const {
+        out.write(reinterpret_cast<const char*>(pixels.data()), to<std::streamsize>(pixels.size()));
+        return bool(out);
+    }
+
+    // RGBA PNG with stored (uncompressed) deflate blocks, no codec dependency
+    bool writePNG(const char* path) const {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        file.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+
+        std::vector<uint8_t> ihdr;
+        putBE(ihdr, width);
+        putBE(ihdr, height);
+        // 8 bit RGBA, deflate, adaptive filtering, no interlace
+        for (uint8_t b : { uint8_t(8), uint8_t(6), uint8_t(0), uint8_t(0), uint8_t(0) }) {
+            ihdr.push_back(b);
+        }
+        writeChunk(file, "IHDR", ihdr);
+
+        // Every row is filter byte 0 then the pixels
+        const size_t row_bytes = size_t(width) * 4 + 1;
+        std::vector<uint8_t> raw(row_bytes * height);
+        for (uint32_t y = 0; y < height; ++y) {
+            raw[y * row_bytes] = 0;
+            std::memcpy(&raw[y * row_bytes + 1], &pixels[size_t(y) * width * 4], row_bytes - 1);
+        }
+        // Sums are reduced every 5552 bytes, the most that cannot overflow
+        uint32_t adler_a = 1;
+        uint32_t adler_b = 0;
+        for (size_t start = 0; start < raw.size(); start += 5552) {
+            const size_t end = std::min<size_t>(start + 5552, raw.size());
+            for (size_t k = start; k < end; ++k) {
+                adler_a += raw[k];
+                adler_b += adler_a;
+            }
+            adler_a %= 65521;
+            adler_b %= 65521;
+        }
+
+        std::vector<uint8_t> idat;
+        idat.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+        idat.push_back(0x78);
+        idat.push_back(0x01);
+        for (size_t start = 0; start < raw.size(); start += 65535) {
+            const size_t block = std::min<size_t>(raw.size() - start, 65535);
+            idat.push_back(start + block == raw.size() ? 1 : 0);
+            idat.push_back(to<uint8_t>(block & 0xFF));
+            idat.push_back(to<uint8_t>(block >> 8));
+            idat.push_back(to<uint8_t>(~block & 0xFF));
+            idat.push_back(to<uint8_t>((~block >> 8) & 0xFF));
+            idat.insert(idat.end(), raw.begin() + start, raw.begin() + start + block);
+        }
+        putBE(idat, (adler_b << 16) | adler_a);
+        writeChunk(file, "IDAT", idat);
+        writeChunk(file, "IEND", std::vector<uint8_t>());
+        return bool(file);
+    }
+
+    static void putBE(std::vector<uint8_t>& out, uint32_t v) {
+        out.push_back(to<uint8_t>(v >> 24));
+        out.push_back(to<uint8_t>(v >> 16));
+        out.push_back(to<uint8_t>(v >> 8));
+        out.push_back(to<uint8_t>(v));
+    }
+
+    static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size) {
+        static const std::vector<uint32_t> table = [] {
+            std::vector<uint32_t> t(256);
+            for (uint32_t n = 0; n < 256; ++n) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; ++k) {
+                    c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                t[n] = c;
+            }
+            return t;
+        }();
+        crc = ~crc;
+        for (size_t i = 0; i < size; ++i) {
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    static void writeChunk(std::ofstream& file, const char type[4], const std::vector<uint8_t>& data) {
+        std::vector<uint8_t> header;
+        putBE(header, to<uint32_t>(data.size()));
+        file.write(reinterpret_cast<const char*>(header.data()), 4);
+        file.write(type, 4);
+        file.write(reinterpret_cast<const char*>(data.data()), to<std::streamsize>(data.size()));
+        uint32_t crc = crc32(0, reinterpret_cast<const uint8_t*>(type), 4);
+        crc = crc32(crc, data.data(), data.size());
+        std::vector<uint8_t> trailer;
+        putBE(trailer, crc);
+        file.write(reinterpret_cast<const char*>(trailer.data()), 4);
+    }
+};
@@ -0,0 +1,200 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "collision.h"
+#include "threadPool.h"
+#include "utils.h"
+
+// Grid built by a parallel counting sort: object ids are sorted by cell index into one
+// compact array, a cell is the range [cell_start[i], cell_start[i + 1]). No capacity
+// limit, and once objects are stored in cell order the ids of a cell are contiguous.
+struct SortedGrid {
+    const unsigned int size;
+    const unsigned int sizeX;
+    const unsigned int sizeY;
+
+    std::vector<uint32_t> cell_start;
+    std::vector<uint32_t> ids;
+    std::vector<uint32_t> cell_of;
+    // Per cell counters, then per cell scatter cursors
+    std::unique_ptr<std::atomic<uint32_t>[]> counts;
+    // Per chunk totals of the prefix sum
+    std::vector<uint32_t> chunk_sums;
+    std::vector<uint32_t> chunk_max;
+
+    // Cells have no capacity here, only max_occupancy is ever set
+    GridStats stats;
+
+    // Storage is allocated by the first build, the grid costs nothing while unused
+    SortedGrid(unsigned int sizeX, unsigned int sizeY)
+        : size(sizeX* sizeY), sizeX(sizeX), sizeY(sizeY)
+    {
+    }
+
+    inline unsigned int cellIndex(float posX, float posY, const Vec2& WorldSize) const {
+        const unsigned int x = posX * sizeX / WorldSize.x;
+        const unsigned int y = posY * sizeY / WorldSize.y;
+        return x + y * sizeX;
+    }
+
+    inline CellSpan span(unsigned int i) const {
+        return { ids.data() + cell_start[i], cell_start[i + 1] - cell_start[i] };
+    }
+
+    // Runs callback(chunk, start, end) over chunk_count equal slices of [0, count)
+    template<typename TCallback>
+    static void forChunks(tp::ThreadPool& tp, uint32_t count, uint32_t chunk_count, TCallback&& callback)
+    {
+        for (uint32_t c = 0; c < chunk_count; ++c) {
+            const uint32_t start = to<uint32_t>(uint64_t(count) * c / chunk_count);
+            const uint32_t end = to<uint32_t>(uint64_t(count) * (c + 1) / chunk_count);
+            tp.addTask([c, start, end, &callback]() { callback(c, start, end); });
+        }
+        tp.waitForCompletion();
+    }
+
+    // The build is split in stages so it can run either as pool dispatches (build) or
+    // between the barriers of a persistent pass. Stages marked single run on one thread,
+    // the others over any split of their range.
+
+    // Single, before the other stages
+    void prepare(uint32_t object_count, uint32_t chunk_count)
+    {
+        if (!counts) {
+            counts.reset(new std::atomic<uint32_t>[size]);
+            cell_start.resize(size + 1);
+        }
+        ids.resize(object_count);
+        cell_of.resize(object_count);
+        chunk_sums.assign(chunk_count, 0u);
+        chunk_max.assign(chunk_count, 0u);
+    }
+
+    // Cells [start, end)
+    void clearCounts(uint32_t start, uint32_t end)
+    {
+        for (uint32_t i = start; i < end; ++i) {
+            counts[i].store(0u, std::memory_order_relaxed);
+        }
+    }
+
+    // Objects [start, end)
+    void countObjects(const float* x, const float* y, uint32_t start, uint32_t end, const Vec2& WorldSize)
+    {
+        for (uint32_t i = start; i < end; ++i) {
+            const unsigned int c = cellIndex(x[i], y[i], WorldSize);
+            cell_of[i] = c;
+            counts[c].fetch_add(1u, std::memory_order_relaxed);
+        }
+    }
+
+    // Cells [start, end) of chunk, first pass of the exclusive prefix sum
+    void sumChunk(uint32_t chunk, uint32_t start, uint32_t end)
+    {
+        uint32_t sum = 0;
+        uint32_t max_count = 0;
+        for (uint32_t i = start; i < end; ++i) {
+            const uint32_t count = counts[i].load(std::memory_order_relaxed);
+            sum += count;
+            max_count = max_count > count ? max_count : count;
+        }
+        chunk_sums[chunk] = sum;
+        chunk_max[chunk] = max_count;
+    }
+
+    // Single, turns the chunk totals into chunk offsets
+    void scanChunks(uint32_t object_count)
+    {
+        stats = GridStats();
+        for (uint32_t max_count : chunk_max) {
+            stats.max_occupancy = stats.max_occupancy > max_count ? stats.max_occupancy : max_count;
+        }
+        uint32_t offset = 0;
+        for (uint32_t& sum : chunk_sums) {
+            const uint32_t chunk_total = sum;
+            sum = offset;
+            offset += chunk_total;
+        }
+        cell_start[size] = object_count;
+    }
+
+    // Cells [start, end) of chunk, second pass, the counters become scatter cursors
+    void offsetChunk(uint32_t chunk, uint32_t start, uint32_t end)
+    {
+        uint32_t sum = chunk_sums[chunk];
+        for (uint32_t i = start; i < end; ++i) {
+            const uint32_t count = counts[i].load(std::memory_order_relaxed);
+            cell_start[i] = sum;
+            counts[i].store(sum, std::memory_order_relaxed);
+            sum += count;
+        }
+    }
+
+    // Objects [start, end)
+    void scatter(uint32_t start, uint32_t end)
+    {
+        for (uint32_t i = start; i < end; ++i) {
+            ids[counts[cell_of[i]].fetch_add(1u, std::memory_order_relaxed)] = i;
+        }
+    }
+
+    // Cells [start, end), after scatter. Scatter cursors are shared, so the order inside a
+    // cell depends on thread timing until the ids are sorted.
+    void sortCells(uint32_t start, uint32_t end)
+    {
+        for (uint32_t i = start; i < end; ++i) {
+            uint32_t* first = ids.data() + cell_start[i];
+            uint32_t* last = ids.data() + cell_start[i + 1];
+            for (uint32_t* it = first + (first < last); it < last; ++it) {
+                const uint32_t id = *it;
+                uint32_t* k = it;
+                for (; k > first && *(k - 1) > id; --k) {
+                    *k = *(k - 1);
+                }
+                *k = id;
+            }
+        }
+    }
+
+    void build(const float* x, const float* y, uint32_t object_count, const Vec2& WorldSize, tp::ThreadPool& tp, bool canonical = false)
+    {
+        const uint32_t chunk_count = tp.m_thread_count + 1;
+        prepare(object_count, chunk_count);
+
+        tp.dispatch(size, [this](uint32_t start, uint32_t end) {
+            clearCounts(start, end);
+        });
+        tp.dispatch(object_count, [&](uint32_t start, uint32_t end) {
+            countObjects(x, y, start, end, WorldSize);
+        });
+
+        forChunks(tp, size, chunk_count, [this](uint32_t chunk, uint32_t start, uint32_t end) {
+            sumChunk(chunk, start, end);
+        });
+        scanChunks(object_count);
+        forChunks(tp, size, chunk_count, [this](uint32_t chunk, uint32_t start, uint32_t end) {
+            offsetChunk(chunk, start, end);
+        });
+
+        tp.dispatch(object_count, [this](uint32_t start, uint32_t end) {
+            scatter(start, end);
+        });
+        if (canonical) {
+            tp.dispatch(size, [this](uint32_t start, uint32_t end) {
+                sortCells(start, end);
+            });
+        }
+    }
+
+    // After the objects themselves were permuted into cell order
+    void setIdentityOrder(tp::ThreadPool& tp)
+    {
+        tp.dispatch(to<uint32_t>(ids.size()), [this](uint32_t start, uint32_t end) {
+            for (uint32_t i = start; i < end; ++i) {
+                ids[i] = i;
+            }
+        });
+    }
+};
@@ -0,0 +1,409 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "collision.h"
+#include "threadPool.h"
+#include "utils.h"
+
+// Grid for large or open worlds. Cells are grouped in square tiles that exist only where
+// objects are, found by a hash of the tile coordinates, so memory follows the object
+// count and cell coordinates may be anywhere in int32 range. Objects are counting sorted
+// like in SortedGrid: cell c is [cell_start[c], cell_start[c + 1]) with
+// c = slot * tile_area + local cell. Tiles left empty for keep_builds builds are released.
+struct SparseGrid {
+    static constexpr int32_t tile_shift = 5;
+    static constexpr int32_t tile_cells = 1 << tile_shift;
+    static constexpr uint32_t tile_area = tile_cells * tile_cells;
+    static constexpr uint32_t no_tile = 0xFFFFFFFFu;
+    static constexpr uint32_t keep_builds = 8;
+
+    struct Tile {
+        int32_t tx = 0;
+        int32_t ty = 0;
+        // Objects in the last build
+        uint32_t count = 0;
+        uint32_t empty_builds = 0;
+        bool live = false;
+        // Slots of the tiles the cell neighbourhood reaches, no_tile when absent
+        uint32_t left = no_tile;
+        uint32_t right = no_tile;
+        uint32_t down_left = no_tile;
+        uint32_t down = no_tile;
+        uint32_t down_right = no_tile;
+    };
+
+    float cell_size = 1.f;
+    std::vector<Tile> tiles;
+    std::vector<uint32_t> free_slots;
+    // Open addressing with linear probing, a power of two at most half full
+    std::vector<uint64_t> table_keys;
+    std::vector<uint32_t> table_slots;
+    // Live slots ordered by tile row then column, and the same split by (tx & 1) + 2 * (ty & 1):
+    // tiles of one parity are at least two apart, their neighbourhoods never share an object
+    std::vector<uint32_t> ordered;
+    std::vector<uint32_t> parity_tiles[4];
+
+    std::vector<uint32_t> cell_of;
+    std::vector<uint64_t> key_of;
+    std::vector<uint32_t> ids;
+    std::vector<uint32_t> cell_start;
+    std::unique_ptr<std::atomic<uint32_t>[]> counts;
+    uint32_t counts_capacity = 0;
+    std::vector<uint32_t> tile_max;
+    // Objects whose tile did not exist when they were counted
+    std::vector<uint32_t> misses;
+    std::atomic<uint32_t> miss_count{ 0 };
+
+    // Cells have no capacity, only max_occupancy is ever set
+    GridStats stats;
+
+    static uint64_t tileKey(int32_t tx, int32_t ty) {
+        return (uint64_t(uint32_t(tx)) << 32) | uint32_t(ty);
+    }
+
+    uint32_t tableIndex(uint64_t key) const {
+        const uint32_t mask = to<uint32_t>(table_keys.size()) - 1;
+        return to<uint32_t>((key * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+    }
+
+    uint32_t find(uint64_t key) const {
+        if (table_keys.empty()) {
+            return no_tile;
+        }
+        const uint32_t mask = to<uint32_t>(table_keys.size()) - 1;
+        for (uint32_t i = tableIndex(key);; i = (i + 1) & mask) {
+            if (table_slots[i] == no_tile || table_keys[i] == key) {
+                return table_slots[i];
+            }
+        }
+    }
+
+    uint32_t find(int32_t tx, int32_t ty) const {
+        return find(tileKey(tx, ty));
+    }
+
+    void tableInsert(uint64_t key, uint32_t slot) {
+        const uint32_t mask = to<uint32_t>(table_keys.size()) - 1;
+        uint32_t i = tableIndex(key);
+        while (table_slots[i] != no_tile) {
+            i = (i + 1) & mask;
+        }
+        table_keys[i] = key;
+        table_slots[i] = slot;
+    }
+
+    // Rehashes the live tiles, the table is also how tiles are removed
+    void rebuildTable() {
+        uint32_t live = 0;
+        for (const Tile& tile : tiles) {
+            live += tile.live;
+        }
+        uint32_t capacity = 64;
+        while (capacity < live * 2 + 2) {
+            capacity *= 2;
+        }
+        table_keys.assign(capacity, 0);
+        table_slots.assign(capacity, no_tile);
+        for (uint32_t slot = 0; slot < tiles.size(); ++slot) {
+            if (tiles[slot].live) {
+                tableInsert(tileKey(tiles[slot].tx, tiles[slot].ty), slot);
+            }
+        }
+    }
+
+    uint32_t addTile(int32_t tx, int32_t ty) {
+        uint32_t slot;
+        if (free_slots.empty()) {
+            slot = to<uint32_t>(tiles.size());
+            tiles.emplace_back();
+        }
+        else {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+        Tile& tile = tiles[slot];
+        tile = Tile();
+        tile.tx = tx;
+        tile.ty = ty;
+        tile.live = true;
+
+        uint32_t live = to<uint32_t>(tiles.size() - free_slots.size());
+        if (table_keys.size() < live * 2 + 2) {
+            rebuildTable();
+        }
+        else {
+            tableInsert(tileKey(tx, ty), slot);
+        }
+        return slot;
+    }
+
+    // Neighbour links and the ordered and parity lists, after tiles were added or removed
+    void updateTopology() {
+        ordered.clear();
+        for (uint32_t slot = 0; slot < tiles.size(); ++slot) {
+            Tile& tile = tiles[slot];
+            if (!tile.live) {
+                continue;
+            }
+            tile.left = find(tile.tx - 1, tile.ty);
+            tile.right = find(tile.tx + 1, tile.ty);
+            tile.down_left = find(tile.tx - 1, tile.ty + 1);
+            tile.down = find(tile.tx, tile.ty + 1);
+            tile.down_right = find(tile.tx + 1, tile.ty + 1);
+            ordered.push_back(slot);
+        }
+        std::sort(ordered.begin(), ordered.end(), [this](uint32_t a, uint32_t b) {
+            return tiles[a].ty != tiles[b].ty ? tiles[a].ty < tiles[b].ty : tiles[a].tx < tiles[b].tx;
+        });
+        for (std::vector<uint32_t>& list : parity_tiles) {
+            list.clear();
+        }
+        for (uint32_t slot : ordered) {
+            parity_tiles[(tiles[slot].tx & 1) + 2 * (tiles[slot].ty & 1)].push_back(slot);
+        }
+    }
+
+    inline int32_t cellCoord(float pos) const {
+        // Far enough from the int32 limits for the tile and neighbour arithmetic
+        const float c = std::floor(pos / cell_size);
+        return to<int32_t>(std::max(-1.0e9f, std::min(1.0e9f, c)));
+    }
+
+    inline CellSpan span(uint32_t c) const {
+        return { ids.data() + cell_start[c], cell_start[c + 1] - cell_start[c] };
+    }
+
+    // Cell (lx, ly) relative to a tile, lx in [-1, tile_cells], ly in [0, tile_cells]
+    inline uint32_t cellNear(const Tile& tile, uint32_t slot, int32_t lx, int32_t ly) const {
+        if (ly == tile_cells) {
+            slot = lx < 0 ? tile.down_left : (lx == tile_cells ? tile.down_right : tile.down);
+            ly = 0;
+        }
+        else if (lx < 0) {
+            slot = tile.left;
+        }
+        else if (lx == tile_cells) {
+            slot = tile.right;
+        }
+        if (slot == no_tile) {
+            return no_tile;
+        }
+        return slot * tile_area + to<uint32_t>(lx & (tile_cells - 1)) + to<uint32_t>(ly) * tile_cells;
+    }
+
+    // The cell itself first, then left, down left, right, down right and down, the order
+    // of the dense grids
+    uint32_t neighbourhood(uint32_t slot, uint32_t local, CellSpan* spans) const {
+        const uint32_t c = slot * tile_area + local;
+        const int32_t lx = to<int32_t>(local % tile_cells);
+        const int32_t ly = to<int32_t>(local / tile_cells);
+        uint32_t n = 0;
+        spans[n++] = span(c);
+        if (lx > 0 && lx < tile_cells - 1 && ly < tile_cells - 1) {
+            spans[n++] = span(c - 1);
+            spans[n++] = span(c + tile_cells - 1);
+            spans[n++] = span(c + 1);
+            spans[n++] = span(c + tile_cells + 1);
+            spans[n++] = span(c + tile_cells);
+            return n;
+        }
+
+        const Tile& tile = tiles[slot];
+        const int32_t offsets[5][2] = { { -1, 0 }, { -1, 1 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+        for (const auto& offset : offsets) {
+            const uint32_t near = cellNear(tile, slot, lx + offset[0], ly + offset[1]);
+            if (near != no_tile) {
+                spans[n++] = span(near);
+            }
+        }
+        return n;
+    }
+
+    // Span of the cell at cell coordinates (cx, cy), empty when its tile does not exist
+    CellSpan cellSpan(int32_t cx, int32_t cy) const {
+        const uint32_t slot = find(cx >> tile_shift, cy >> tile_shift);
+        if (slot == no_tile) {
+            return { ids.data(), 0 };
+        }
+        return span(slot * tile_area + to<uint32_t>(cx & (tile_cells - 1)) + to<uint32_t>(cy & (tile_cells - 1)) * tile_cells);
+    }
+
+    // Grows the counters to cover cell_count cells, keeping the current ones
+    void reserveCounts(uint32_t cell_count)
+    {
+        if (counts_capacity >= cell_count) {
+            return;
+        }
+        const uint32_t capacity = std::max(cell_count, counts_capacity * 2);
+        std::unique_ptr<std::atomic<uint32_t>[]> grown(new std::atomic<uint32_t>[capacity]);
+        for (uint32_t c = 0; c < counts_capacity; ++c) {
+            grown[c].store(counts[c].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        counts = std::move(grown);
+        counts_capacity = capacity;
+    }
+
+    void build(const float* x, const float* y, uint32_t object_count, float cell, tp::ThreadPool& tp, bool canonical = false)
+    {
+        cell_size = cell;
+        cell_of.resize(object_count);
+        key_of.resize(object_count);
+        ids.resize(object_count);
+        misses.resize(object_count);
+        miss_count.store(0, std::memory_order_relaxed);
+
+        const uint32_t known_cells = to<uint32_t>(tiles.size()) * tile_area;
+        reserveCounts(known_cells);
+        tp.dispatch(known_cells, [this](uint32_t start, uint32_t end) {
+            for (uint32_t c = start; c < end; ++c) {
+                counts[c].store(0u, std::memory_order_relaxed);
+            }
+        });
+
+        // Tiles are only read here, objects of new ones are counted once they are added
+        tp.dispatch(object_count, [this, x, y](uint32_t start, uint32_t end) {
+            uint64_t last_key = ~0ull;
+            uint32_t last_slot = no_tile;
+            for (uint32_t i = start; i < end; ++i) {
+                const int32_t cx = cellCoord(x[i]);
+                const int32_t cy = cellCoord(y[i]);
+                const uint64_t key = tileKey(cx >> tile_shift, cy >> tile_shift);
+                const uint32_t local = to<uint32_t>(cx & (tile_cells - 1)) + to<uint32_t>(cy & (tile_cells - 1)) * tile_cells;
+                // Neighbouring objects mostly share a tile
+                if (key != last_key) {
+                    last_key = key;
+                    last_slot = find(key);
+                }
+                if (last_slot == no_tile) {
+                    cell_of[i] = local;
+                    key_of[i] = key;
+                    misses[miss_count.fetch_add(1, std::memory_order_relaxed)] = i;
+                }
+                else {
+                    cell_of[i] = last_slot * tile_area + local;
+                    counts[cell_of[i]].fetch_add(1u, std::memory_order_relaxed);
+                }
+            }
+        });
+
+        // Reused slots were cleared with the others, new ones are cleared as they are added
+        bool topology_changed = false;
+        const uint32_t missed = miss_count.load(std::memory_order_relaxed);
+        // Slots, and so the order of ids across tiles, follow the first object of each tile
+        if (canonical) {
+            std::sort(misses.data(), misses.data() + missed);
+        }
+        for (uint32_t m = 0; m < missed; ++m) {
+            const uint32_t i = misses[m];
+            uint32_t slot = find(key_of[i]);
+            if (slot == no_tile) {
+                slot = addTile(to<int32_t>(key_of[i] >> 32), to<int32_t>(uint32_t(key_of[i])));
+                topology_changed = true;
+                if ((slot + 1) * tile_area > known_cells) {
+                    reserveCounts((slot + 1) * tile_area);
+                    for (uint32_t c = slot * tile_area; c < (slot + 1) * tile_area; ++c) {
+                        counts[c].store(0u, std::memory_order_relaxed);
+                    }
+                }
+            }
+            cell_of[i] = slot * tile_area + cell_of[i];
+            counts[cell_of[i]].fetch_add(1u, std::memory_order_relaxed);
+        }
+        if (topology_changed) {
+            updateTopology();
+        }
+
+        const uint32_t slot_count = to<uint32_t>(tiles.size());
+        const uint32_t cell_count = slot_count * tile_area;
+        cell_start.resize(cell_count + 1);
+        tile_max.resize(slot_count);
+
+        // Tile totals, then tile offsets in slot order, then cell offsets inside each tile
+        tp.parallelFor(slot_count, 16, [this](uint32_t start, uint32_t end) {
+            for (uint32_t slot = start; slot < end; ++slot) {
+                uint32_t sum = 0;
+                uint32_t max_count = 0;
+                for (uint32_t c = slot * tile_area; c < (slot + 1) * tile_area; ++c) {
+                    const uint32_t count = counts[c].load(std::memory_order_relaxed);
+                    sum += count;
+                    max_count = std::max(max_count, count);
+                }
+                tiles[slot].count = sum;
+                tile_max[slot] = max_count;
+            }
+        });
+        stats = GridStats();
+        uint32_t offset = 0;
+        for (uint32_t slot = 0; slot < slot_count; ++slot) {
+            cell_start[slot * tile_area] = offset;
+            offset += tiles[slot].count;
+            stats.max_occupancy = std::max(stats.max_occupancy, tile_max[slot]);
+        }
+        cell_start[cell_count] = object_count;
+        tp.parallelFor(slot_count, 16, [this](uint32_t start, uint32_t end) {
+            for (uint32_t slot = start; slot < end; ++slot) {
+                uint32_t sum = cell_start[slot * tile_area];
+                for (uint32_t c = slot * tile_area; c < (slot + 1) * tile_area; ++c) {
+                    const uint32_t count = counts[c].load(std::memory_order_relaxed);
+                    cell_start[c] = sum;
+                    counts[c].store(sum, std::memory_order_relaxed);
+                    sum += count;
+                }
+            }
+        });
+
+        tp.dispatch(object_count, [this](uint32_t start, uint32_t end) {
+            for (uint32_t i = start; i < end; ++i) {
+                ids[counts[cell_of[i]].fetch_add(1u, std::memory_order_relaxed)] = i;
+            }
+        });
+        if (canonical) {
+            tp.parallelFor(cell_count, tile_area, [this](uint32_t start, uint32_t end) {
+                for (uint32_t c = start; c < end; ++c) {
+                    std::sort(ids.data() + cell_start[c], ids.data() + cell_start[c + 1]);
+                }
+            });
+        }
+
+        // Nothing is stored in a tile that is released here
+        bool released = false;
+        for (uint32_t slot = 0; slot < slot_count; ++slot) {
+            Tile& tile = tiles[slot];
+            if (!tile.live || tile.count) {
+                tile.empty_builds = 0;
+                continue;
+            }
+            if (++tile.empty_builds > keep_builds) {
+                tile.live = false;
+                free_slots.push_back(slot);
+                released = true;
+            }
+        }
+        if (released) {
+            rebuildTable();
+            updateTopology();
+        }
+    }
+
+    uint32_t liveTiles() const {
+        return to<uint32_t>(ordered.size());
+    }
+};
+
+// One tile seen as a grid of tile_area cells, for the solver's per cell loops
+struct SparseGridTile {
+    const SparseGrid* grid;
+    uint32_t slot;
+
+    inline CellSpan span(unsigned int i) const {
+        return grid->span(slot * SparseGrid::tile_area + i);
+    }
+
+    inline uint32_t neighbourhood(unsigned int i, CellSpan* spans) const {
+        return grid->neighbourhood(slot, i, spans);
+    }
+};
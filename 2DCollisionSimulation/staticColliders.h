@@ -0,0 +1,248 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "utils.h"
+
+// A segment with a thickness, a capsule around [a, b]
+struct StaticSegment {
+    Vec2 a;
+    Vec2 b;
+    float thickness = 0.f;
+};
+
+struct StaticCircle {
+    Vec2 center;
+    float radius = 0.f;
+};
+
+// Scene geometry objects bounce off: segments (polygons are closed chains of them) and
+// circles. The shapes are binned once over their own bounding box, each bin lists the
+// shapes an object of radius up to reach inside it may touch, so an object away from
+// any geometry costs one bin lookup. Only the outline of a polygon collides, objects
+// inside it stay inside.
+struct StaticColliders {
+    std::vector<StaticSegment> segments;
+    std::vector<StaticCircle> circles;
+
+    // A shape as the bins store it, circles are segments of length 0
+    struct BinnedShape {
+        float ax;
+        float ay;
+        float abx;
+        float aby;
+        float inv_length2;
+        float thickness;
+    };
+
+    // Bin contents while building: segment index, or circle index with circle_bit set
+    static constexpr uint32_t circle_bit = 0x80000000u;
+    float bin_size = 1.f;
+    float inv_bin_size = 1.f;
+    Vec2 origin;
+    unsigned int sizeX = 0;
+    unsigned int sizeY = 0;
+    std::vector<uint32_t> bin_start;
+    // Copies of the shapes in bin order, an object reads one contiguous run
+    std::vector<BinnedShape> bin_shapes;
+    // Largest object radius the bins were built for
+    float reach = 0.f;
+    // Bumped by every change to the shapes, the bins and any drawn copy follow it
+    uint32_t version = 1;
+    uint32_t built_version = 0;
+
+    bool empty() const {
+        return segments.empty() && circles.empty();
+    }
+
+    void clear() {
+        segments.clear();
+        circles.clear();
+        ++version;
+    }
+
+    void addSegment(Vec2 a, Vec2 b, float thickness = 0.f) {
+        segments.push_back({ a, b, thickness });
+        ++version;
+    }
+
+    void addCircle(Vec2 center, float radius) {
+        circles.push_back({ center, radius });
+        ++version;
+    }
+
+    // Segments between consecutive points, and back to the first one when closed
+    void addPolygon(const std::vector<Vec2>& points, bool closed = true, float thickness = 0.f) {
+        for (size_t i = 0; i + 1 < points.size(); ++i) {
+            addSegment(points[i], points[i + 1], thickness);
+        }
+        if (closed && points.size() > 2) {
+            addSegment(points.back(), points.front(), thickness);
+        }
+    }
+
+    // The bins are rebuilt when the shapes changed or larger objects appeared
+    bool needsBuild(float object_reach) const {
+        return built_version != version || object_reach > reach;
+    }
+
+    static Vec2 closestPoint(const StaticSegment& s, float px, float py) {
+        const float abx = s.b.x - s.a.x;
+        const float aby = s.b.y - s.a.y;
+        const float length2 = abx * abx + aby * aby;
+        float t = length2 > 0.f ? ((px - s.a.x) * abx + (py - s.a.y) * aby) / length2 : 0.f;
+        t = std::max(0.f, std::min(1.f, t));
+        return { s.a.x + abx * t, s.a.y + aby * t };
+    }
+
+    // bin is the cell size of the bins, object_reach the largest object radius
+    void build(float bin, float object_reach) {
+        bin_size = bin;
+        inv_bin_size = 1.f / bin;
+        reach = object_reach;
+        built_version = version;
+        bin_start.clear();
+        bin_shapes.clear();
+        sizeX = sizeY = 0;
+        if (empty()) {
+            return;
+        }
+
+        float min_x = 1e30f;
+        float min_y = 1e30f;
+        float max_x = -1e30f;
+        float max_y = -1e30f;
+        const auto extend = [&](float x0, float y0, float x1, float y1) {
+            min_x = std::min(min_x, x0);
+            min_y = std::min(min_y, y0);
+            max_x = std::max(max_x, x1);
+            max_y = std::max(max_y, y1);
+        };
+        for (const StaticSegment& s : segments) {
+            extend(std::min(s.a.x, s.b.x) - s.thickness, std::min(s.a.y, s.b.y) - s.thickness,
+                std::max(s.a.x, s.b.x) + s.thickness, std::max(s.a.y, s.b.y) + s.thickness);
+        }
+        for (const StaticCircle& c : circles) {
+            extend(c.center.x - c.radius, c.center.y - c.radius, c.center.x + c.radius, c.center.y + c.radius);
+        }
+        origin = { min_x - reach, min_y - reach };
+        sizeX = to<unsigned int>((max_x + reach - origin.x) / bin_size) + 1;
+        sizeY = to<unsigned int>((max_y + reach - origin.y) / bin_size) + 1;
+
+        // Counting sort of (bin, item) pairs. A bin takes a shape when the shape is within
+        // reach of any point of the bin, tested from the bin center with half its diagonal.
+        const float half_diagonal = bin_size * 0.70710678f;
+        std::vector<uint64_t> pairs;
+        const auto binShape = [&](uint32_t item, float x0, float y0, float x1, float y1, float extent, auto&& distance2) {
+            const unsigned int bx0 = binX(x0 - extent);
+            const unsigned int bx1 = binX(x1 + extent);
+            const unsigned int by0 = binY(y0 - extent);
+            const unsigned int by1 = binY(y1 + extent);
+            const float limit = extent + half_diagonal;
+            for (unsigned int by = by0; by <= by1; ++by) {
+                for (unsigned int bx = bx0; bx <= bx1; ++bx) {
+                    const float cx = origin.x + (to<float>(bx) + 0.5f) * bin_size;
+                    const float cy = origin.y + (to<float>(by) + 0.5f) * bin_size;
+                    if (distance2(cx, cy) <= limit * limit) {
+                        pairs.push_back((uint64_t(bx + by * sizeX) << 32) | item);
+                    }
+                }
+            }
+        };
+        for (uint32_t i = 0; i < to<uint32_t>(segments.size()); ++i) {
+            const StaticSegment& s = segments[i];
+            binShape(i, std::min(s.a.x, s.b.x), std::min(s.a.y, s.b.y), std::max(s.a.x, s.b.x), std::max(s.a.y, s.b.y),
+                s.thickness + reach, [&s](float px, float py) {
+                const Vec2 p = closestPoint(s, px, py);
+                return (px - p.x) * (px - p.x) + (py - p.y) * (py - p.y);
+            });
+        }
+        for (uint32_t i = 0; i < to<uint32_t>(circles.size()); ++i) {
+            const StaticCircle& c = circles[i];
+            binShape(i | circle_bit, c.center.x, c.center.y, c.center.x, c.center.y, c.radius + reach, [&c](float px, float py) {
+                const float dx = px - c.center.x;
+                const float dy = py - c.center.y;
+                return dx * dx + dy * dy;
+            });
+        }
+
+        bin_start.assign(sizeX * sizeY + 1, 0u);
+        for (const uint64_t pair : pairs) {
+            ++bin_start[(pair >> 32) + 1];
+        }
+        for (uint32_t b = 0; b < sizeX * sizeY; ++b) {
+            bin_start[b + 1] += bin_start[b];
+        }
+        // Pairs are added shape by shape, a bin lists its shapes in insertion order
+        bin_shapes.resize(pairs.size());
+        std::vector<uint32_t> cursor(bin_start.begin(), bin_start.end() - 1);
+        for (const uint64_t pair : pairs) {
+            const uint32_t item = uint32_t(pair);
+            BinnedShape& shape = bin_shapes[cursor[pair >> 32]++];
+            if (item & circle_bit) {
+                const StaticCircle& c = circles[item & ~circle_bit];
+                shape = { c.center.x, c.center.y, 0.f, 0.f, 0.f, c.radius };
+            }
+            else {
+                const StaticSegment& s = segments[item];
+                const Vec2 ab = s.b - s.a;
+                const float length2 = ab.x * ab.x + ab.y * ab.y;
+                shape = { s.a.x, s.a.y, ab.x, ab.y, length2 > 0.f ? 1.f / length2 : 0.f, s.thickness };
+            }
+        }
+    }
+
+    inline unsigned int binX(float pos) const {
+        const int x = to<int>(std::floor((pos - origin.x) / bin_size));
+        return x < 0 ? 0 : (to<unsigned int>(x) < sizeX ? to<unsigned int>(x) : sizeX - 1);
+    }
+
+    inline unsigned int binY(float pos) const {
+        const int y = to<int>(std::floor((pos - origin.y) / bin_size));
+        return y < 0 ? 0 : (to<unsigned int>(y) < sizeY ? to<unsigned int>(y) : sizeY - 1);
+    }
+
+    // Pushes an object of radius r at (x, y) out of the shapes of its bin, in bin order.
+    // Returns how many it touched.
+    uint32_t resolve(float& x, float& y, float r) const {
+        const float fx = (x - origin.x) * inv_bin_size;
+        const float fy = (y - origin.y) * inv_bin_size;
+        if (!(fx >= 0.f && fy >= 0.f && fx < to<float>(sizeX) && fy < to<float>(sizeY))) {
+            return 0;
+        }
+        const uint32_t b = to<uint32_t>(fx) + to<uint32_t>(fy) * sizeX;
+        const uint32_t end = bin_start[b + 1];
+        uint32_t touched = 0;
+        for (uint32_t k = bin_start[b]; k < end; ++k) {
+            const BinnedShape& s = bin_shapes[k];
+            float t = ((x - s.ax) * s.abx + (y - s.ay) * s.aby) * s.inv_length2;
+            t = std::max(0.f, std::min(1.f, t));
+            float dx = x - (s.ax + s.abx * t);
+            float dy = y - (s.ay + s.aby * t);
+            const float contact = s.thickness + r;
+            const float dist2 = dx * dx + dy * dy;
+            if (dist2 >= contact * contact) {
+                continue;
+            }
+            ++touched;
+            if (dist2 == 0.f) {
+                // On the center line, leave along the left normal, or upwards from a circle center
+                dx = s.aby;
+                dy = -s.abx;
+                if (dx == 0.f && dy == 0.f) {
+                    dy = -1.f;
+                }
+                const float push = contact / std::sqrt(dx * dx + dy * dy);
+                x += dx * push;
+                y += dy * push;
+                continue;
+            }
+            const float dist = std::sqrt(dist2);
+            const float push = (contact - dist) / dist;
+            x += dx * push;
+            y += dy * push;
+        }
+        return touched;
+    }
+};
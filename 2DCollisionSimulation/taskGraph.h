@@ -0,0 +1,139 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "threadPool.h"
+
+namespace tp
+{
+
+    // Static dependency graph, built once and run many times. A node starts as soon as
+    // every node it depends on has finished, so independent work of consecutive phases
+    // overlaps instead of waiting for a whole phase to drain.
+    struct TaskGraph
+    {
+        static constexpr uint32_t spin_count = 256;
+        static constexpr uint32_t empty_slot = 0xFFFFFFFFu;
+
+        struct Node
+        {
+            std::function<void()> work;
+            std::vector<uint32_t> successors;
+            uint32_t dependency_count = 0;
+        };
+
+        std::vector<Node> m_nodes;
+
+        // Run state, nodes are appended to the ready slots in the order they become ready
+        std::unique_ptr<std::atomic<uint32_t>[]> m_pending;
+        std::unique_ptr<std::atomic<uint32_t>[]> m_ready;
+        uint32_t m_capacity = 0;
+        std::atomic<uint32_t> m_push{ 0 };
+        std::atomic<uint32_t> m_pop{ 0 };
+        uint32_t m_spin_rounds = 0;
+
+        std::atomic<uint32_t> m_sleeping{ 0 };
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+
+        void clear()
+        {
+            m_nodes.clear();
+        }
+
+        template<typename TCallback>
+        uint32_t addNode(TCallback&& work)
+        {
+            m_nodes.emplace_back();
+            m_nodes.back().work = std::forward<TCallback>(work);
+            return static_cast<uint32_t>(m_nodes.size() - 1);
+        }
+
+        // after starts once before has finished
+        void addDependency(uint32_t before, uint32_t after)
+        {
+            m_nodes[before].successors.push_back(after);
+            ++m_nodes[after].dependency_count;
+        }
+
+        void run(ThreadPool& tp)
+        {
+            const uint32_t node_count = static_cast<uint32_t>(m_nodes.size());
+            if (m_capacity < node_count) {
+                m_pending.reset(new std::atomic<uint32_t>[node_count]);
+                m_ready.reset(new std::atomic<uint32_t>[node_count]);
+                m_capacity = node_count;
+            }
+            m_spin_rounds = tp.m_thread_count < std::thread::hardware_concurrency() ? spin_count : 0u;
+            m_push.store(0);
+            m_pop.store(0);
+            for (uint32_t i = 0; i < node_count; ++i) {
+                m_pending[i].store(m_nodes[i].dependency_count);
+                m_ready[i].store(empty_slot);
+            }
+            for (uint32_t i = 0; i < node_count; ++i) {
+                if (!m_nodes[i].dependency_count) {
+                    push(i);
+                }
+            }
+
+            tp.forkJoin([this](uint32_t, uint32_t) {
+                runParticipant();
+            });
+        }
+
+        void push(uint32_t node)
+        {
+            m_ready[m_push.fetch_add(1)].store(node);
+            if (m_sleeping.load()) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_cv.notify_all();
+            }
+        }
+
+        // Claims ready slots in order until every node was claimed. A claimed slot is always
+        // filled eventually: the graph is acyclic and every earlier slot belongs to a running participant.
+        void runParticipant()
+        {
+            const uint32_t node_count = static_cast<uint32_t>(m_nodes.size());
+            for (;;) {
+                const uint32_t slot = m_pop.fetch_add(1);
+                if (slot >= node_count) {
+                    return;
+                }
+                const uint32_t node = waitReady(slot);
+                PROFILE_SCOPE_ARG("node", node);
+                m_nodes[node].work();
+                for (uint32_t successor : m_nodes[node].successors) {
+                    if (m_pending[successor].fetch_sub(1) == 1) {
+                        push(successor);
+                    }
+                }
+            }
+        }
+
+        uint32_t waitReady(uint32_t slot)
+        {
+            PROFILE_IDLE("ready");
+            Backoff backoff;
+            while (backoff.m_count < m_spin_rounds) {
+                const uint32_t node = m_ready[slot].load();
+                if (node != empty_slot) {
+                    return node;
+                }
+                backoff.wait();
+            }
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_sleeping.fetch_add(1);
+            m_cv.wait(lock, [this, slot] { return m_ready[slot].load() != empty_slot; });
+            m_sleeping.fetch_sub(1);
+            return m_ready[slot].load();
+        }
+    };
+
+}
@@ -6,17 +6,31 @@
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
+#include <memory>
+#include <string>
+#include "profiler.h"
+#include "topology.h"
+#include "workStealing.h"
 
 
 namespace tp
 {
 
+    enum class Scheduler {
+        // One mutex guarded std::function queue shared by every worker
+        SharedQueue,
+        // Per worker lock free queues with stealing, inline task storage and
+        // spin then park idle workers, see workStealing.h
+        WorkStealing,
+    };
+
     struct TaskQueue
     {
         std::queue<std::function<void()>> m_tasks;
         std::mutex                        m_mutex;
         std::atomic<uint32_t>             m_remaining_tasks = 0;
         std::condition_variable cv;
+        bool                              m_stopping = false;
 
         template<typename TCallback>
         void addTask(TCallback&& callback)
@@ -43,7 +57,10 @@ namespace tp
         {
             {
                 std::unique_lock<std::mutex> lock(m_mutex);
-                cv.wait(lock, [this] {return m_tasks.size(); });
+                cv.wait(lock, [this] {return m_tasks.size() || m_stopping; });
+                if (m_tasks.empty()) {
+                    return;
+                }
                 target_callback = std::move(m_tasks.front());
                 m_tasks.pop();
             }
@@ -56,6 +73,7 @@ namespace tp
 
         void waitForCompletion() const
         {
+            PROFILE_IDLE("wait");
             while (m_remaining_tasks > 0) {
                 wait();
             }
@@ -65,21 +83,48 @@ namespace tp
         {
             m_remaining_tasks--;
         }
+
+        // Wakes every blocked worker so it can observe its stop flag
+        void stop()
+        {
+            std::lock_guard<std::mutex> lock_guard(m_mutex);
+            m_stopping = true;
+            cv.notify_all();
+        }
     };
 
+    // The pool (by its queue) and index of the worker running on this thread
+    struct WorkerIdentity
+    {
+        const TaskQueue* m_queue = nullptr;
+        uint32_t         m_id = 0;
+    };
+
+    inline WorkerIdentity& currentWorker()
+    {
+        thread_local WorkerIdentity identity;
+        return identity;
+    }
+
     struct Worker
     {
         uint32_t              m_id = 0;
+        // Logical CPU the thread pins itself to, -1 leaves it to the OS
+        int                   m_cpu = -1;
         std::thread           m_thread;
         std::function<void()> m_task = nullptr;
-        bool                  m_running = true;
+        // Written by the destructing pool while the thread reads it
+        std::atomic<bool>     m_running{ true };
         TaskQueue* m_queue = nullptr;
+        StealingScheduler* m_scheduler = nullptr;
 
         Worker() = default;
 
-        Worker(TaskQueue& queue, uint32_t id)
+        Worker(TaskQueue& queue, StealingScheduler* scheduler, uint32_t id, int cpu = -1)
             : m_id{ id }
+            , m_cpu{ cpu }
             , m_queue{ &queue }
+            , m_scheduler{ scheduler }
         {
             m_thread = std::thread([this]() {
                 run();
@@ -88,6 +133,16 @@ namespace tp
 
         void run()
         {
+            Profiler::instance().setThreadName("worker " + std::to_string(m_id));
+            if (m_cpu >= 0) {
+                pinCurrentThread(static_cast<uint32_t>(m_cpu));
+            }
+            currentWorker() = { m_queue, m_id };
+            if (m_scheduler) {
+                m_scheduler->run(m_id);
+                return;
+            }
+
             while (m_running) {
                 //m_queue->getTask(m_task);
                 m_queue->getTaskBlock(m_task);
@@ -95,7 +150,10 @@ namespace tp
                     TaskQueue::wait();
                 }
                 else {
-                    m_task();
+                    {
+                        PROFILE_SCOPE("task");
+                        m_task();
+                    }
                     m_queue->workDone();
                     m_task = nullptr;
                 }
@@ -105,6 +163,10 @@ namespace tp
         void stop()
         {
             m_running = false;
+        }
+
+        void join()
+        {
             m_thread.join();
         }
     };
@@ -113,39 +175,133 @@ namespace tp
     {
         uint32_t            m_thread_count = 0;
         TaskQueue           m_queue;
-        std::vector<Worker> m_workers;
+        std::unique_ptr<StealingScheduler> m_stealing;
+        // Workers hand `this` to their thread and hold an atomic, they are never moved
+        std::vector<std::unique_ptr<Worker>> m_workers;
+        // CPU of each worker when pinned, empty otherwise
+        std::vector<LogicalCpu> m_placement;
+        // forkJoin participants already taken in the current call
+        std::unique_ptr<std::atomic<uint8_t>[]> m_claimed;
 
         explicit
-            ThreadPool(uint32_t thread_count)
+            ThreadPool(uint32_t thread_count, Scheduler scheduler = Scheduler::SharedQueue, Affinity affinity = Affinity::None)
             : m_thread_count{ thread_count }
+            , m_placement{ affinity == Affinity::None ? std::vector<LogicalCpu>() : CpuTopology::discover().placement(thread_count, affinity) }
+            , m_claimed{ new std::atomic<uint8_t>[thread_count ? thread_count : 1] }
         {
+            if (scheduler == Scheduler::WorkStealing) {
+                m_stealing.reset(new StealingScheduler(thread_count));
+            }
             m_workers.reserve(thread_count);
             for (uint32_t i{ thread_count }; i--;) {
-                m_workers.emplace_back(m_queue, static_cast<uint32_t>(m_workers.size()));
+                const uint32_t id = static_cast<uint32_t>(m_workers.size());
+                const int cpu = m_placement.empty() ? -1 : static_cast<int>(m_placement[id].id);
+                m_workers.emplace_back(new Worker(m_queue, m_stealing.get(), id, cpu));
             }
         }
 
+        bool pinned() const
+        {
+            return !m_placement.empty();
+        }
+
         virtual ~ThreadPool()
         {
-            for (Worker& worker : m_workers) {
-                worker.stop();
+            for (std::unique_ptr<Worker>& worker : m_workers) {
+                worker->stop();
+            }
+            if (m_stealing) {
+                m_stealing->stop();
+            }
+            m_queue.stop();
+            for (std::unique_ptr<Worker>& worker : m_workers) {
+                worker->join();
             }
         }
 
         template<typename TCallback>
         void addTask(TCallback&& callback)
         {
+            if (m_stealing) {
+                m_stealing->addTask(std::forward<TCallback>(callback));
+                return;
+            }
             m_queue.addTask(std::forward<TCallback>(callback));
         }
 
-        void waitForCompletion() const
+        void waitForCompletion()
         {
+            if (m_stealing) {
+                m_stealing->waitForCompletion();
+                return;
+            }
             m_queue.waitForCompletion();
         }
 
+        // Runs callback(start, end) over [0, element_count) in slices of at most chunk elements
+        template<typename TCallback>
+        void parallelFor(uint32_t element_count, uint32_t chunk, TCallback&& callback)
+        {
+            if (m_stealing) {
+                m_stealing->parallelFor(element_count, chunk, callback);
+                return;
+            }
+
+            chunk = chunk ? chunk : 1;
+            for (uint32_t start = 0; start < element_count; start += chunk) {
+                const uint32_t end = element_count - start > chunk ? start + chunk : element_count;
+                addTask([start, end, &callback]() { callback(start, end); });
+            }
+            waitForCompletion();
+        }
+
+        // Runs callback(participant, participant_count) once on every worker and once on
+        // the calling thread, all at the same time, so participants may wait on each other
+        // (see barrier.h). The pool must be idle. When pinned, participant p runs on worker
+        // p whenever it can, so the slices a participant owns stay on one CPU across calls.
+        template<typename TCallback>
+        void forkJoin(TCallback&& callback)
+        {
+            const uint32_t participant_count = m_thread_count + 1;
+            for (uint32_t i = 0; i < m_thread_count; ++i) {
+                m_claimed[i].store(0, std::memory_order_relaxed);
+            }
+            for (uint32_t i = 0; i < m_thread_count; ++i) {
+                addTask([this, i, participant_count, &callback]() { callback(claimParticipant(i), participant_count); });
+            }
+            callback(m_thread_count, participant_count);
+            waitForCompletion();
+        }
+
+        // The participant a forkJoin task runs as: its worker's own index when pinned and
+        // still free, else the first free one
+        uint32_t claimParticipant(uint32_t task)
+        {
+            if (!pinned()) {
+                return task;
+            }
+            const WorkerIdentity& self = currentWorker();
+            if (self.m_queue == &m_queue && !m_claimed[self.m_id].exchange(1)) {
+                return self.m_id;
+            }
+            for (uint32_t p = 0; p < m_thread_count; ++p) {
+                if (!m_claimed[p].exchange(1)) {
+                    return p;
+                }
+            }
+            return task;
+        }
+
         template<typename TCallback>
         void dispatch(uint32_t element_count, TCallback&& callback)
         {
+            if (m_stealing) {
+                // A few chunks per participant so stealing can even out the tail
+                const uint32_t chunk = element_count / ((m_thread_count + 1) * 8);
+                m_stealing->parallelFor(element_count, chunk, callback);
+                return;
+            }
+
             const uint32_t batch_size = element_count / m_thread_count;
             for (uint32_t i = 0; i < m_thread_count; ++i) {
                 const uint32_t start = batch_size * i;
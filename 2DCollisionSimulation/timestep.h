@@ -0,0 +1,54 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+
+// Fixed timestep driver: wall time goes into an accumulator and is paid out in steps of
+// dt, so the simulation speed does not depend on the frame rate. At most max_steps are
+// run per frame; beyond that the simulation falls behind wall time (slow motion)
+// instead of spending ever longer frames catching up.
+struct FixedTimestep {
+    double dt;
+    uint32_t max_steps;
+    // Longer frames (a window drag, a breakpoint) count as this much
+    double max_frame_time = 0.25;
+
+    double accumulator = 0.;
+    // Wall time given up under overload, in seconds
+    double dropped_time = 0.;
+    uint32_t last_steps = 0;
+
+    explicit
+        FixedTimestep(double dt, uint32_t max_steps = 8)
+        : dt(dt)
+        , max_steps(max_steps)
+    {
+    }
+
+    // Steps to run for a frame that took elapsed seconds
+    uint32_t advance(double elapsed) {
+        if (elapsed > max_frame_time) {
+            dropped_time += elapsed - max_frame_time;
+            elapsed = max_frame_time;
+        }
+        accumulator += elapsed;
+
+        uint32_t steps = 0;
+        while (accumulator >= dt && steps < max_steps) {
+            accumulator -= dt;
+            ++steps;
+        }
+        if (accumulator >= dt) {
+            // Keep the fraction so interpolation stays smooth
+            const double fraction = std::fmod(accumulator, dt);
+            dropped_time += accumulator - fraction;
+            accumulator = fraction;
+        }
+        last_steps = steps;
+        return steps;
+    }
+
+    // Where the rendered frame lies between the previous step (0) and the last one (1)
+    float alpha() const {
+        return static_cast<float>(accumulator / dt);
+    }
+};
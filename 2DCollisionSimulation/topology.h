@@ -0,0 +1,291 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+namespace tp
+{
+
+    enum class Affinity {
+        // Threads are left to the OS scheduler
+        None,
+        // Workers fill the CPUs of the first NUMA node, one per core before SMT siblings,
+        // before moving to the next node
+        Compact,
+        // Workers are split over the nodes in proportion to their CPUs, so every memory
+        // controller is used. Consecutive workers still share a node.
+        Spread,
+    };
+
+    struct LogicalCpu {
+        // Number the OS pins threads to
+        uint32_t id;
+        // Logical CPUs with the same core are SMT siblings
+        uint32_t core;
+        // NUMA node, numbered densely from 0
+        uint32_t node;
+    };
+
+    // Logical CPUs this process may run on, from sysfs on Linux and
+    // GetLogicalProcessorInformationEx on Windows (first processor group only).
+    // Elsewhere, or when discovery fails, every CPU is its own core on node 0.
+    struct CpuTopology
+    {
+        std::vector<LogicalCpu> cpus;
+        uint32_t node_count = 1;
+
+        static CpuTopology discover()
+        {
+            CpuTopology topology;
+            topology.read();
+            if (topology.cpus.empty()) {
+                const uint32_t count = std::max(1u, std::thread::hardware_concurrency());
+                for (uint32_t i = 0; i < count; ++i) {
+                    topology.cpus.push_back({ i, i, 0 });
+                }
+            }
+            topology.compactNodes();
+            return topology;
+        }
+
+        uint32_t coreCount() const
+        {
+            std::vector<uint32_t> cores;
+            for (const LogicalCpu& cpu : cpus) {
+                cores.push_back(cpu.core);
+            }
+            std::sort(cores.begin(), cores.end());
+            return static_cast<uint32_t>(std::unique(cores.begin(), cores.end()) - cores.begin());
+        }
+
+        // The CPU of each of worker_count workers, empty for Affinity::None. Within a node
+        // the first sibling of every core comes before the second ones, more workers than
+        // CPUs wrap around.
+        std::vector<LogicalCpu> placement(uint32_t worker_count, Affinity affinity) const
+        {
+            std::vector<LogicalCpu> result;
+            if (affinity == Affinity::None || !worker_count) {
+                return result;
+            }
+
+            // CPUs of each node, in sibling rank then core order
+            std::vector<std::vector<LogicalCpu>> nodes(node_count);
+            for (uint32_t n = 0; n < node_count; ++n) {
+                std::vector<std::pair<uint32_t, LogicalCpu>> ranked;
+                std::vector<uint32_t> seen;
+                for (const LogicalCpu& cpu : cpus) {
+                    if (cpu.node == n) {
+                        const uint32_t rank = static_cast<uint32_t>(std::count(seen.begin(), seen.end(), cpu.core));
+                        seen.push_back(cpu.core);
+                        ranked.push_back({ rank, cpu });
+                    }
+                }
+                std::stable_sort(ranked.begin(), ranked.end(), [](const std::pair<uint32_t, LogicalCpu>& a, const std::pair<uint32_t, LogicalCpu>& b) {
+                    return a.first < b.first;
+                });
+                for (const auto& entry : ranked) {
+                    nodes[n].push_back(entry.second);
+                }
+            }
+
+            if (affinity == Affinity::Compact) {
+                for (uint32_t i = 0; i < worker_count; ++i) {
+                    uint32_t k = i % static_cast<uint32_t>(cpus.size());
+                    uint32_t n = 0;
+                    while (k >= nodes[n].size()) {
+                        k -= static_cast<uint32_t>(nodes[n].size());
+                        ++n;
+                    }
+                    result.push_back(nodes[n][k]);
+                }
+                return result;
+            }
+
+            // Spread: node n takes workers [first(n), first(n + 1)) by its share of the CPUs
+            uint64_t before = 0;
+            for (uint32_t n = 0; n < node_count; ++n) {
+                const uint32_t first = static_cast<uint32_t>(before * worker_count / cpus.size());
+                before += nodes[n].size();
+                const uint32_t end = static_cast<uint32_t>(before * worker_count / cpus.size());
+                for (uint32_t i = first; i < end; ++i) {
+                    result.push_back(nodes[n][(i - first) % nodes[n].size()]);
+                }
+            }
+            return result;
+        }
+
+    private:
+        void compactNodes()
+        {
+            std::vector<uint32_t> ids;
+            for (const LogicalCpu& cpu : cpus) {
+                ids.push_back(cpu.node);
+            }
+            std::sort(ids.begin(), ids.end());
+            ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+            for (LogicalCpu& cpu : cpus) {
+                cpu.node = static_cast<uint32_t>(std::lower_bound(ids.begin(), ids.end(), cpu.node) - ids.begin());
+            }
+            node_count = static_cast<uint32_t>(ids.size());
+        }
+
+#if defined(__linux__)
+        static bool readValue(const std::string& path, std::string& value)
+        {
+            std::ifstream file(path);
+            return static_cast<bool>(std::getline(file, value));
+        }
+
+        // "0-3,8,10-11" style lists used by sysfs
+        static std::vector<uint32_t> parseList(const std::string& list)
+        {
+            std::vector<uint32_t> values;
+            size_t pos = 0;
+            while (pos < list.size()) {
+                size_t end = list.find(',', pos);
+                end = end == std::string::npos ? list.size() : end;
+                const std::string range = list.substr(pos, end - pos);
+                const size_t dash = range.find('-');
+                if (!range.empty()) {
+                    const uint32_t first = static_cast<uint32_t>(std::stoul(range));
+                    const uint32_t last = dash == std::string::npos ? first : static_cast<uint32_t>(std::stoul(range.substr(dash + 1)));
+                    for (uint32_t v = first; v <= last; ++v) {
+                        values.push_back(v);
+                    }
+                }
+                pos = end + 1;
+            }
+            return values;
+        }
+
+        void read()
+        {
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+                return;
+            }
+            const std::string root = "/sys/devices/system/";
+            std::vector<uint32_t> node_of(CPU_SETSIZE, 0);
+            std::string list;
+            if (readValue(root + "node/online", list)) {
+                for (const uint32_t node : parseList(list)) {
+                    std::string node_cpus;
+                    if (readValue(root + "node/node" + std::to_string(node) + "/cpulist", node_cpus)) {
+                        for (const uint32_t id : parseList(node_cpus)) {
+                            if (id < CPU_SETSIZE) {
+                                node_of[id] = node;
+                            }
+                        }
+                    }
+                }
+            }
+            for (uint32_t id = 0; id < CPU_SETSIZE; ++id) {
+                if (!CPU_ISSET(id, &allowed)) {
+                    continue;
+                }
+                const std::string topology = root + "cpu/cpu" + std::to_string(id) + "/topology/";
+                std::string package;
+                std::string core;
+                uint32_t core_key = id;
+                if (readValue(topology + "physical_package_id", package) && readValue(topology + "core_id", core)) {
+                    core_key = static_cast<uint32_t>(std::stoul(package) << 16 | std::stoul(core));
+                }
+                cpus.push_back({ id, core_key, node_of[id] });
+            }
+        }
+#elif defined(_WIN32)
+        void read()
+        {
+            DWORD length = 0;
+            GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+            std::vector<char> buffer(length);
+            if (!length || !GetLogicalProcessorInformationEx(RelationAll,
+                reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data()), &length)) {
+                return;
+            }
+            DWORD_PTR process_mask = 0;
+            DWORD_PTR system_mask = 0;
+            if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) {
+                return;
+            }
+
+            // Core and node of each CPU of group 0, the only group SetThreadAffinityMask reaches
+            constexpr uint32_t group_size = sizeof(KAFFINITY) * 8;
+            std::vector<uint32_t> core_of(group_size, UINT32_MAX);
+            std::vector<uint32_t> node_of(group_size, 0);
+            uint32_t core_index = 0;
+            for (DWORD offset = 0; offset < length;) {
+                const auto* info = reinterpret_cast<const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+                if (info->Relationship == RelationProcessorCore) {
+                    for (WORD g = 0; g < info->Processor.GroupCount; ++g) {
+                        const GROUP_AFFINITY& group = info->Processor.GroupMask[g];
+                        for (uint32_t bit = 0; group.Group == 0 && bit < group_size; ++bit) {
+                            if (group.Mask >> bit & 1) {
+                                core_of[bit] = core_index;
+                            }
+                        }
+                    }
+                    ++core_index;
+                }
+                else if (info->Relationship == RelationNumaNode) {
+                    const GROUP_AFFINITY& group = info->NumaNode.GroupMask;
+                    for (uint32_t bit = 0; group.Group == 0 && bit < group_size; ++bit) {
+                        if (group.Mask >> bit & 1) {
+                            node_of[bit] = info->NumaNode.NodeNumber;
+                        }
+                    }
+                }
+                offset += info->Size;
+            }
+            for (uint32_t id = 0; id < group_size; ++id) {
+                if (process_mask >> id & 1 && core_of[id] != UINT32_MAX) {
+                    cpus.push_back({ id, core_of[id], node_of[id] });
+                }
+            }
+        }
+#else
+        void read()
+        {
+        }
+#endif
+    };
+
+    // Restricts the calling thread to one logical CPU, false when that is not possible
+    inline bool pinCurrentThread(uint32_t cpu)
+    {
+#if defined(__linux__)
+        if (cpu >= CPU_SETSIZE) {
+            return false;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+        if (cpu >= sizeof(DWORD_PTR) * 8) {
+            return false;
+        }
+        return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#else
+        (void)cpu;
+        return false;
+#endif
+    }
+
+}
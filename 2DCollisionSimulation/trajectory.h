@@ -0,0 +1,546 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "physics.h"
+#include "snapshot.h"
+
+// Streaming record of every object position over a run.
+//
+// Layout, little endian: TrajectoryHeader, then chunks of up to keyframe_interval frames,
+// then the chunk index and a TrajectoryFooter. Objects are written by track id, the order
+// they were created in, so reorderObjects does not show up as motion. Positions are uint16
+// over the world size (see quantizePosition), open worlds cannot be recorded. Each frame
+// is a TrajectoryFrame followed by
+//   keyframe  x then y of every track
+//   delta     for the tracks of the previous frame, delta_bytes of
+//               varint unchanged tracks before the next moved one, then its move:
+//               zigzag dx, dy below 8 as one varint (dx | dy << 3) << 1, or
+//               varint zigzag dx << 1 | 1 and varint zigzag dy
+//             then x, y of the new tracks
+// The first frame of a chunk is a keyframe, so a reader can start decoding at any chunk.
+
+constexpr uint32_t trajectory_version = 1;
+
+struct TrajectoryHeader {
+    char magic[4] = { 'C', 'T', 'R', 'J' };
+    uint32_t version = trajectory_version;
+    float world_x = 0.f;
+    float world_y = 0.f;
+    float radius = 0.f;
+    // Simulated time between two update calls
+    float dt = 0.f;
+    uint32_t keyframe_interval = 0;
+    uint32_t reserved[9] = {};
+};
+static_assert(sizeof(TrajectoryHeader) == 64, "trajectory header layout changed");
+
+struct TrajectoryChunk {
+    char magic[4] = { 'C', 'H', 'N', 'K' };
+    uint32_t first_frame = 0;
+    uint32_t frame_count = 0;
+    // Bytes of frames after this header
+    uint32_t bytes = 0;
+};
+
+struct TrajectoryFrame {
+    // Update call the frame was taken after, frames the recorder dropped leave gaps
+    uint32_t step = 0;
+    uint32_t object_count = 0;
+    uint32_t delta_bytes = 0;
+    uint32_t keyframe = 0;
+};
+
+struct TrajectoryIndexEntry {
+    uint32_t first_frame = 0;
+    uint32_t reserved = 0;
+    uint64_t offset = 0;
+};
+
+struct TrajectoryFooter {
+    char magic[4] = { 'C', 'I', 'D', 'X' };
+    uint32_t chunk_count = 0;
+    uint64_t index_offset = 0;
+};
+
+inline void writeVarint(std::vector<uint8_t>& out, uint32_t v) {
+    while (v >= 0x80) {
+        out.push_back(to<uint8_t>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(to<uint8_t>(v));
+}
+
+inline uint32_t readVarint(const uint8_t*& p) {
+    uint32_t v = 0;
+    for (uint32_t shift = 0;; shift += 7) {
+        const uint8_t b = *p++;
+        v |= to<uint32_t>(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+}
+
+inline uint32_t zigzag(int32_t v) {
+    return (to<uint32_t>(v) << 1) ^ to<uint32_t>(v >> 31);
+}
+
+inline int32_t unzigzag(uint32_t v) {
+    return to<int32_t>(v >> 1) ^ -to<int32_t>(v & 1);
+}
+
+// Encodes on its own thread. record copies the positions into one of buffer_frames
+// buffers and returns; when the encoder is behind and every buffer is queued the frame
+// is dropped instead of waiting, see dropped_frames.
+struct TrajectoryRecorder {
+    struct Buffer {
+        uint32_t step = 0;
+        std::vector<float> x;
+        std::vector<float> y;
+        // Track id of every object, only sent after a reorder
+        bool has_tracks = false;
+        std::vector<uint32_t> tracks;
+    };
+
+    std::ofstream file;
+    TrajectoryHeader header;
+    std::vector<Buffer> buffers;
+    std::deque<uint32_t> free_buffers;
+    std::deque<uint32_t> queued_buffers;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread encoder;
+    bool stopping = false;
+
+    // Recording thread
+    std::vector<uint32_t> tracks;
+    uint32_t seen_reorder = 0;
+    bool tracks_pending = false;
+    uint32_t recorded_frames = 0;
+    uint32_t dropped_frames = 0;
+
+    // Encoder thread
+    std::vector<uint32_t> encoder_tracks;
+    std::vector<uint16_t> prev_x, prev_y, cur_x, cur_y;
+    uint32_t prev_count = 0;
+    std::vector<uint8_t> chunk;
+    TrajectoryChunk chunk_header;
+    std::vector<TrajectoryIndexEntry> index;
+    uint32_t encoded_frames = 0;
+    uint64_t written_bytes = 0;
+
+    TrajectoryRecorder() = default;
+    TrajectoryRecorder(const TrajectoryRecorder&) = delete;
+    TrajectoryRecorder& operator=(const TrajectoryRecorder&) = delete;
+
+    ~TrajectoryRecorder() {
+        close();
+    }
+
+    bool isOpen() const {
+        return encoder.joinable();
+    }
+
+    bool open(const char* path, const PhysicSolver& solver, float dt, uint32_t keyframe_interval = 64, uint32_t buffer_frames = 8) {
+        close();
+        if (!solver.bounded) {
+            return false;
+        }
+        file.open(path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        header = TrajectoryHeader();
+        header.world_x = solver.world_size.x;
+        header.world_y = solver.world_size.y;
+        header.radius = solver.radius;
+        header.dt = dt;
+        header.keyframe_interval = keyframe_interval ? keyframe_interval : 1;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        written_bytes = sizeof(header);
+
+        buffers.assign(buffer_frames ? buffer_frames : 1, Buffer());
+        free_buffers.clear();
+        queued_buffers.clear();
+        for (uint32_t i = 0; i < to<uint32_t>(buffers.size()); ++i) {
+            free_buffers.push_back(i);
+        }
+        tracks.clear();
+        seen_reorder = solver.reorder_count;
+        tracks_pending = false;
+        recorded_frames = 0;
+        dropped_frames = 0;
+        encoder_tracks.clear();
+        prev_count = 0;
+        chunk.clear();
+        chunk_header = TrajectoryChunk();
+        index.clear();
+        encoded_frames = 0;
+        stopping = false;
+        encoder = std::thread([this]() { encode(); });
+        return true;
+    }
+
+    // Call after every PhysicSolver::update, also when frames are not wanted, or object
+    // identity is lost across reorders. step is the update call count.
+    bool record(const PhysicSolver& solver, uint32_t step) {
+        const uint32_t count = to<uint32_t>(solver.objects.size());
+        // Keep the track ids in sync even for dropped frames, new objects get the next ids
+        if (solver.reorder_count != seen_reorder) {
+            seen_reorder = solver.reorder_count;
+            std::vector<uint32_t> reordered(solver.reorder_order.size());
+            for (size_t i = 0; i < reordered.size(); ++i) {
+                const uint32_t old_id = solver.reorder_order[i];
+                reordered[i] = old_id < tracks.size() ? tracks[old_id] : old_id;
+            }
+            tracks.swap(reordered);
+            tracks_pending = true;
+        }
+        if (!tracks.empty()) {
+            for (uint32_t i = to<uint32_t>(tracks.size()); i < count; ++i) {
+                tracks.push_back(i);
+            }
+        }
+
+        uint32_t slot;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (free_buffers.empty()) {
+                ++dropped_frames;
+                return false;
+            }
+            slot = free_buffers.front();
+            free_buffers.pop_front();
+        }
+
+        Buffer& buffer = buffers[slot];
+        buffer.step = step;
+        buffer.x.assign(solver.objects.x.begin(), solver.objects.x.end());
+        buffer.y.assign(solver.objects.y.begin(), solver.objects.y.end());
+        buffer.has_tracks = tracks_pending;
+        if (tracks_pending) {
+            buffer.tracks = tracks;
+            tracks_pending = false;
+        }
+        ++recorded_frames;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queued_buffers.push_back(slot);
+        }
+        cv.notify_one();
+        return true;
+    }
+
+    // Encodes what is queued, then writes the last chunk and the index
+    void close() {
+        if (!encoder.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        encoder.join();
+
+        flushChunk();
+        TrajectoryFooter footer;
+        footer.chunk_count = to<uint32_t>(index.size());
+        footer.index_offset = written_bytes;
+        file.write(reinterpret_cast<const char*>(index.data()), to<std::streamsize>(index.size() * sizeof(TrajectoryIndexEntry)));
+        file.write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+        written_bytes += index.size() * sizeof(TrajectoryIndexEntry) + sizeof(footer);
+        file.close();
+    }
+
+    void encode() {
+        for (;;) {
+            uint32_t slot;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return !queued_buffers.empty() || stopping; });
+                if (queued_buffers.empty()) {
+                    return;
+                }
+                slot = queued_buffers.front();
+                queued_buffers.pop_front();
+            }
+            encodeFrame(buffers[slot]);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                free_buffers.push_back(slot);
+            }
+        }
+    }
+
+    void encodeFrame(Buffer& buffer) {
+        if (buffer.has_tracks) {
+            encoder_tracks.swap(buffer.tracks);
+        }
+        const uint32_t count = to<uint32_t>(buffer.x.size());
+        cur_x.resize(count);
+        cur_y.resize(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            const uint32_t track = i < encoder_tracks.size() ? encoder_tracks[i] : i;
+            cur_x[track] = quantizePosition(buffer.x[i], header.world_x);
+            cur_y[track] = quantizePosition(buffer.y[i], header.world_y);
+        }
+
+        if (chunk_header.frame_count == header.keyframe_interval) {
+            flushChunk();
+        }
+        if (!chunk_header.frame_count) {
+            chunk_header.first_frame = encoded_frames;
+        }
+
+        TrajectoryFrame frame;
+        frame.step = buffer.step;
+        frame.object_count = count;
+        frame.keyframe = chunk_header.frame_count == 0;
+        const size_t frame_at = chunk.size();
+        chunk.resize(frame_at + sizeof(frame));
+
+        uint32_t first_new = 0;
+        if (!frame.keyframe) {
+            first_new = prev_count < count ? prev_count : count;
+            uint32_t unchanged = 0;
+            for (uint32_t t = 0; t < first_new; ++t) {
+                const int32_t dx = to<int32_t>(cur_x[t]) - to<int32_t>(prev_x[t]);
+                const int32_t dy = to<int32_t>(cur_y[t]) - to<int32_t>(prev_y[t]);
+                if (!dx && !dy) {
+                    ++unchanged;
+                    continue;
+                }
+                writeVarint(chunk, unchanged);
+                const uint32_t zx = zigzag(dx);
+                const uint32_t zy = zigzag(dy);
+                if (zx < 8 && zy < 8) {
+                    writeVarint(chunk, (zx | zy << 3) << 1);
+                }
+                else {
+                    writeVarint(chunk, zx << 1 | 1);
+                    writeVarint(chunk, zy);
+                }
+                unchanged = 0;
+            }
+            frame.delta_bytes = to<uint32_t>(chunk.size() - frame_at - sizeof(frame));
+        }
+        appendRaw(cur_x.data() + first_new, count - first_new);
+        appendRaw(cur_y.data() + first_new, count - first_new);
+        std::memcpy(chunk.data() + frame_at, &frame, sizeof(frame));
+
+        ++chunk_header.frame_count;
+        ++encoded_frames;
+        prev_x.swap(cur_x);
+        prev_y.swap(cur_y);
+        prev_count = count;
+    }
+
+    void appendRaw(const uint16_t* data, uint32_t count) {
+        const size_t at = chunk.size();
+        chunk.resize(at + count * sizeof(uint16_t));
+        std::memcpy(chunk.data() + at, data, count * sizeof(uint16_t));
+    }
+
+    void flushChunk() {
+        if (!chunk_header.frame_count) {
+            return;
+        }
+        TrajectoryIndexEntry entry;
+        entry.first_frame = chunk_header.first_frame;
+        entry.offset = written_bytes;
+        index.push_back(entry);
+
+        chunk_header.bytes = to<uint32_t>(chunk.size());
+        file.write(reinterpret_cast<const char*>(&chunk_header), sizeof(chunk_header));
+        file.write(reinterpret_cast<const char*>(chunk.data()), to<std::streamsize>(chunk.size()));
+        written_bytes += sizeof(chunk_header) + chunk.size();
+        chunk.clear();
+        chunk_header = TrajectoryChunk();
+    }
+};
+
+// Decodes a trajectory file. seek decodes from the keyframe of the chunk holding the
+// frame, next continues from the current frame. A file without index (the recorder did
+// not close) is indexed by walking its chunks.
+struct TrajectoryReader {
+    std::ifstream file;
+    TrajectoryHeader header;
+    std::vector<TrajectoryIndexEntry> index;
+    uint32_t frame_count = 0;
+
+    std::vector<uint8_t> chunk;
+    TrajectoryChunk chunk_header;
+    uint32_t chunk_id = 0xFFFFFFFFu;
+    size_t chunk_pos = 0;
+
+    // Decoded frame, by track id
+    uint32_t frame = 0xFFFFFFFFu;
+    TrajectoryFrame frame_header;
+    std::vector<uint16_t> qx;
+    std::vector<uint16_t> qy;
+
+    bool open(const char* path) {
+        file.open(path, std::ios::binary);
+        if (!file || !file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+            return false;
+        }
+        if (std::memcmp(header.magic, TrajectoryHeader().magic, 4) || header.version != trajectory_version) {
+            return false;
+        }
+
+        TrajectoryFooter footer;
+        file.seekg(-to<std::streamoff>(sizeof(footer)), std::ios::end);
+        if (file.read(reinterpret_cast<char*>(&footer), sizeof(footer)) && !std::memcmp(footer.magic, TrajectoryFooter().magic, 4)) {
+            index.resize(footer.chunk_count);
+            file.seekg(to<std::streamoff>(footer.index_offset));
+            file.read(reinterpret_cast<char*>(index.data()), to<std::streamsize>(index.size() * sizeof(TrajectoryIndexEntry)));
+        }
+        else {
+            file.clear();
+            scanChunks();
+        }
+
+        if (!index.empty()) {
+            TrajectoryChunk last;
+            file.seekg(to<std::streamoff>(index.back().offset));
+            file.read(reinterpret_cast<char*>(&last), sizeof(last));
+            frame_count = last.first_frame + last.frame_count;
+        }
+        file.clear();
+        return true;
+    }
+
+    void scanChunks() {
+        file.seekg(0, std::ios::end);
+        const uint64_t file_size = to<uint64_t>(file.tellg());
+        uint64_t offset = sizeof(header);
+        TrajectoryChunk chunk_at;
+        while (offset + sizeof(chunk_at) <= file_size) {
+            file.seekg(to<std::streamoff>(offset));
+            if (!file.read(reinterpret_cast<char*>(&chunk_at), sizeof(chunk_at)) || std::memcmp(chunk_at.magic, TrajectoryChunk().magic, 4)) {
+                return;
+            }
+            // A chunk cut short by a crash is left out
+            if (offset + sizeof(chunk_at) + chunk_at.bytes > file_size) {
+                return;
+            }
+            TrajectoryIndexEntry entry;
+            entry.first_frame = chunk_at.first_frame;
+            entry.offset = offset;
+            index.push_back(entry);
+            offset += sizeof(chunk_at) + chunk_at.bytes;
+        }
+    }
+
+    uint32_t objectCount() const {
+        return frame_header.object_count;
+    }
+
+    uint32_t step() const {
+        return frame_header.step;
+    }
+
+    float x(uint32_t track) const {
+        return dequantizePosition(qx[track], header.world_x);
+    }
+
+    float y(uint32_t track) const {
+        return dequantizePosition(qy[track], header.world_y);
+    }
+
+    bool seek(uint32_t target) {
+        if (target >= frame_count) {
+            return false;
+        }
+        if (target == frame) {
+            return true;
+        }
+        const auto it = std::upper_bound(index.begin(), index.end(), target,
+            [](uint32_t f, const TrajectoryIndexEntry& e) { return f < e.first_frame; });
+        const uint32_t target_chunk = to<uint32_t>(it - index.begin()) - 1;
+        if (target_chunk != chunk_id || target < frame || frame == 0xFFFFFFFFu) {
+            if (!loadChunk(target_chunk)) {
+                return false;
+            }
+        }
+        while (frame != target) {
+            if (!decodeFrame()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool next() {
+        return seek(frame == 0xFFFFFFFFu ? 0 : frame + 1);
+    }
+
+    bool loadChunk(uint32_t id) {
+        file.seekg(to<std::streamoff>(index[id].offset));
+        if (!file.read(reinterpret_cast<char*>(&chunk_header), sizeof(chunk_header))) {
+            return false;
+        }
+        chunk.resize(chunk_header.bytes);
+        if (!file.read(reinterpret_cast<char*>(chunk.data()), to<std::streamsize>(chunk.size()))) {
+            return false;
+        }
+        chunk_id = id;
+        chunk_pos = 0;
+        frame = chunk_header.first_frame - 1;
+        return true;
+    }
+
+    bool decodeFrame() {
+        if (frame + 1 >= chunk_header.first_frame + chunk_header.frame_count) {
+            if (!loadChunk(chunk_id + 1)) {
+                return false;
+            }
+        }
+        std::memcpy(&frame_header, chunk.data() + chunk_pos, sizeof(frame_header));
+        chunk_pos += sizeof(frame_header);
+
+        const uint32_t count = frame_header.object_count;
+        uint32_t first_new = 0;
+        if (!frame_header.keyframe) {
+            first_new = to<uint32_t>(qx.size()) < count ? to<uint32_t>(qx.size()) : count;
+            const uint8_t* p = chunk.data() + chunk_pos;
+            const uint8_t* end = p + frame_header.delta_bytes;
+            uint32_t t = 0;
+            while (p < end) {
+                t += readVarint(p);
+                const uint32_t move = readVarint(p);
+                uint32_t zx = move >> 1;
+                uint32_t zy;
+                if (move & 1) {
+                    zy = readVarint(p);
+                }
+                else {
+                    zy = zx >> 3;
+                    zx &= 7;
+                }
+                qx[t] = to<uint16_t>(to<int32_t>(qx[t]) + unzigzag(zx));
+                qy[t] = to<uint16_t>(to<int32_t>(qy[t]) + unzigzag(zy));
+                ++t;
+            }
+            chunk_pos += frame_header.delta_bytes;
+        }
+        qx.resize(count);
+        qy.resize(count);
+        const uint32_t new_count = count - first_new;
+        std::memcpy(qx.data() + first_new, chunk.data() + chunk_pos, new_count * sizeof(uint16_t));
+        chunk_pos += new_count * sizeof(uint16_t);
+        std::memcpy(qy.data() + first_new, chunk.data() + chunk_pos, new_count * sizeof(uint16_t));
+        chunk_pos += new_count * sizeof(uint16_t);
+        ++frame;
+        return true;
+    }
+};
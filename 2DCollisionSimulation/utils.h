@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+#include <type_traits>
 #include "math.h"
 
 using Vec2 = sf::Vector2f;
@@ -10,21 +12,48 @@ U to(const T& v) {
 	return static_cast<U>(v);
 }
 
+// sf::Color layout with inline constructors only: the solver and the headless benchmark
+// do not link sfml-graphics, and particle storage stays trivially default constructible
+struct ParticleColor
+{
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+    uint8_t a;
+
+    ParticleColor() = default;
+
+    ParticleColor(uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha = 255)
+        : r(red), g(green), b(blue), a(alpha)
+    {}
+
+    ParticleColor(const sf::Color& color)
+        : r(color.r), g(color.g), b(color.b), a(color.a)
+    {}
+
+    operator sf::Color() const
+    {
+        return sf::Color(r, g, b, a);
+    }
+};
+static_assert(std::is_trivially_default_constructible<ParticleColor>::value && sizeof(ParticleColor) == 4,
+    "particle colors must be left unwritten by resize()");
+
 struct ColorUtils
 {
     template<typename T>
-    static sf::Color createColor(T r, T g, T b)
+    static ParticleColor createColor(T r, T g, T b)
     {
         return { to<uint8_t>(r), to<uint8_t>(g), to<uint8_t>(b) };
     }
 
     template<typename TVec3>
-    static sf::Color createColor(TVec3 vec)
+    static ParticleColor createColor(TVec3 vec)
     {
         return { to<uint8_t>(vec.x), to<uint8_t>(vec.y), to<uint8_t>(vec.z) };
     }
 
-    static sf::Color interpolate(sf::Color color_1, sf::Color color_2, float ratio)
+    static ParticleColor interpolate(ParticleColor color_1, ParticleColor color_2, float ratio)
     {
         return ColorUtils::createColor(
             to<float>(color_1.r) + ratio * to<float>(color_2.r - color_1.r),
@@ -33,7 +62,7 @@ struct ColorUtils
         );
     }
 
-    static sf::Color getRainbow(float t)
+    static ParticleColor getRainbow(float t)
     {
         const float r = sin(t);
         const float g = sin(t + 0.33f * 2.0f * Math::PI);
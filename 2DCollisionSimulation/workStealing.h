@@ -0,0 +1,440 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include "profiler.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace tp
+{
+
+    inline void cpuRelax()
+    {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    // Pauses for a while then starts yielding, so a waiter does not starve the thread
+    // it waits for when there are more threads than cores
+    struct Backoff
+    {
+        static constexpr uint32_t pause_limit = 64;
+        uint32_t m_count = 0;
+
+        void wait()
+        {
+            if (m_count < pause_limit) {
+                cpuRelax();
+            }
+            else {
+                std::this_thread::yield();
+            }
+            ++m_count;
+        }
+    };
+
+    // Type erased callable stored inline, submitting a task never allocates.
+    // Captures must fit the storage and be trivially destructible (ints, pointers, references).
+    struct InlineTask
+    {
+        static constexpr size_t storage_size = 56;
+
+        void (*m_invoke)(void*) = nullptr;
+        alignas(8) unsigned char m_storage[storage_size];
+
+        template<typename TCallback>
+        void set(TCallback&& callback)
+        {
+            using T = typename std::decay<TCallback>::type;
+            static_assert(sizeof(T) <= storage_size, "task captures do not fit InlineTask");
+            static_assert(alignof(T) <= 8, "task captures are over aligned");
+            static_assert(std::is_trivially_destructible<T>::value, "task captures must be trivially destructible");
+            new (m_storage) T(std::forward<TCallback>(callback));
+            m_invoke = [](void* storage) { (*static_cast<T*>(storage))(); };
+        }
+
+        void run()
+        {
+            m_invoke(m_storage);
+        }
+    };
+
+    // Bounded lock free queue of task indices, one producer (the submitting thread)
+    // and any number of consumers: its worker first, then thieves once they run dry.
+    struct alignas(64) WorkQueue
+    {
+        static constexpr uint32_t capacity = 1024;
+
+        std::atomic<uint32_t> m_top{ 0 };
+        alignas(64) std::atomic<uint32_t> m_bottom{ 0 };
+        std::atomic<uint32_t> m_slots[capacity];
+
+        bool push(uint32_t task)
+        {
+            const uint32_t bottom = m_bottom.load(std::memory_order_relaxed);
+            if (bottom - m_top.load(std::memory_order_acquire) >= capacity) {
+                return false;
+            }
+            m_slots[bottom % capacity].store(task, std::memory_order_relaxed);
+            m_bottom.store(bottom + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(uint32_t& task)
+        {
+            uint32_t top = m_top.load(std::memory_order_acquire);
+            for (;;) {
+                const uint32_t bottom = m_bottom.load(std::memory_order_acquire);
+                if (static_cast<int32_t>(bottom - top) <= 0) {
+                    return false;
+                }
+                // A slot is only rewritten once top moved past it, so a stale read fails the CAS
+                task = m_slots[top % capacity].load(std::memory_order_relaxed);
+                if (m_top.compare_exchange_weak(top, top + 1, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                    return true;
+                }
+            }
+        }
+    };
+
+    // Range [begin, end) packed in one atomic so the owner and thieves can both claim from it
+    struct alignas(64) WorkRange
+    {
+        std::atomic<uint64_t> m_range{ 0 };
+
+        static uint64_t pack(uint32_t begin, uint32_t end)
+        {
+            return (uint64_t(end) << 32) | begin;
+        }
+
+        // Owner side, takes up to chunk elements from the front
+        bool take(uint32_t chunk, uint32_t& start, uint32_t& end)
+        {
+            uint64_t range = m_range.load(std::memory_order_acquire);
+            for (;;) {
+                const uint32_t begin = uint32_t(range);
+                const uint32_t last = uint32_t(range >> 32);
+                if (begin >= last) {
+                    return false;
+                }
+                const uint32_t next = last - begin > chunk ? begin + chunk : last;
+                if (m_range.compare_exchange_weak(range, pack(next, last), std::memory_order_acq_rel, std::memory_order_acquire)) {
+                    start = begin;
+                    end = next;
+                    return true;
+                }
+            }
+        }
+
+        // Thief side, takes the back half (at least chunk elements when there are that many)
+        bool steal(uint32_t chunk, uint32_t& start, uint32_t& end)
+        {
+            uint64_t range = m_range.load(std::memory_order_acquire);
+            for (;;) {
+                const uint32_t begin = uint32_t(range);
+                const uint32_t last = uint32_t(range >> 32);
+                if (begin >= last) {
+                    return false;
+                }
+                uint32_t half = (last - begin) / 2;
+                if (half < chunk) {
+                    half = last - begin < chunk ? last - begin : chunk;
+                }
+                const uint32_t split = last - half;
+                if (m_range.compare_exchange_weak(range, pack(begin, split), std::memory_order_acq_rel, std::memory_order_acquire)) {
+                    start = split;
+                    end = last;
+                    return true;
+                }
+            }
+        }
+    };
+
+    // Scheduler behind ThreadPool in Scheduler::WorkStealing mode.
+    // Tasks and parallel-for jobs must be submitted from a single thread, the one that
+    // also waits for them; it helps running work while waiting.
+    struct StealingScheduler
+    {
+        static constexpr uint32_t task_capacity = 16384;
+        // Idle Backoff rounds before a worker parks
+        static constexpr uint32_t spin_count = 256;
+
+        uint32_t m_worker_count;
+        // Spinning only pays off while every worker has a core, otherwise park right away
+        uint32_t m_spin_rounds;
+        std::unique_ptr<WorkQueue[]> m_queues;
+        std::unique_ptr<InlineTask[]> m_tasks;
+        uint32_t m_submitted = 0;
+        uint32_t m_next_queue = 0;
+        std::atomic<uint32_t> m_remaining_tasks{ 0 };
+
+        // Current parallel-for job, one range per worker plus one for the submitting thread
+        std::unique_ptr<WorkRange[]> m_ranges;
+        void (*m_job_invoke)(void*, uint32_t, uint32_t) = nullptr;
+        void* m_job_context = nullptr;
+        uint32_t m_job_chunk = 1;
+        std::atomic<uint32_t> m_job_remaining{ 0 };
+        std::atomic<bool> m_job_active{ false };
+        std::atomic<uint32_t> m_job_workers{ 0 };
+
+        // Spin then park
+        std::atomic<uint32_t> m_epoch{ 0 };
+        std::atomic<uint32_t> m_sleeping{ 0 };
+        std::atomic<bool> m_stopping{ false };
+        std::mutex m_park_mutex;
+        std::condition_variable m_park_cv;
+
+        // The submitting thread blocks here once it has nothing left to help with
+        std::atomic<bool> m_waiting{ false };
+        std::mutex m_done_mutex;
+        std::condition_variable m_done_cv;
+
+        explicit
+            StealingScheduler(uint32_t worker_count)
+            : m_worker_count{ worker_count }
+            , m_spin_rounds{ worker_count < std::thread::hardware_concurrency() ? spin_count : 0u }
+            , m_queues{ new WorkQueue[worker_count ? worker_count : 1] }
+            , m_tasks{ new InlineTask[task_capacity] }
+            , m_ranges{ new WorkRange[worker_count + 1] }
+        {
+        }
+
+        void wake(bool all)
+        {
+            m_epoch.fetch_add(1);
+            if (m_sleeping.load()) {
+                std::lock_guard<std::mutex> lock(m_park_mutex);
+                if (all) {
+                    m_park_cv.notify_all();
+                }
+                else {
+                    m_park_cv.notify_one();
+                }
+            }
+        }
+
+        void notifyDone()
+        {
+            if (m_waiting.load()) {
+                std::lock_guard<std::mutex> lock(m_done_mutex);
+                m_done_cv.notify_one();
+            }
+        }
+
+        // Spins a little then blocks: a preempted worker may need the core to finish
+        template<typename TPredicate>
+        void waitUntil(TPredicate done)
+        {
+            const uint32_t spin_rounds = m_spin_rounds > Backoff::pause_limit ? m_spin_rounds : Backoff::pause_limit;
+            Backoff backoff;
+            while (backoff.m_count < spin_rounds) {
+                if (done()) {
+                    return;
+                }
+                backoff.wait();
+            }
+            std::unique_lock<std::mutex> lock(m_done_mutex);
+            m_waiting.store(true);
+            m_done_cv.wait(lock, done);
+            m_waiting.store(false);
+        }
+
+        template<typename TCallback>
+        void addTask(TCallback&& callback)
+        {
+            if (m_submitted == task_capacity) {
+                waitForCompletion();
+            }
+            const uint32_t index = m_submitted++;
+            m_tasks[index].set(std::forward<TCallback>(callback));
+            m_remaining_tasks.fetch_add(1);
+
+            const uint32_t queue = m_next_queue;
+            m_next_queue = (m_next_queue + 1) % m_worker_count;
+            if (!m_queues[queue].push(index)) {
+                // Queue full, run it here rather than block
+                m_tasks[index].run();
+                m_remaining_tasks.fetch_sub(1);
+                return;
+            }
+            wake(false);
+        }
+
+        bool runOneTask(uint32_t first_queue)
+        {
+            uint32_t index;
+            for (uint32_t i = 0; i < m_worker_count; ++i) {
+                if (m_queues[(first_queue + i) % m_worker_count].pop(index)) {
+                    {
+                        PROFILE_SCOPE("task");
+                        m_tasks[index].run();
+                    }
+                    if (m_remaining_tasks.fetch_sub(1) == 1) {
+                        notifyDone();
+                    }
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void waitForCompletion()
+        {
+            while (runOneTask(0)) {
+            }
+            // Only this thread submits, what is left is already running on workers
+            PROFILE_IDLE("wait");
+            waitUntil([this] { return m_remaining_tasks.load() == 0; });
+            // Every slot was consumed, reuse the storage from the start
+            m_submitted = 0;
+        }
+
+        void completeChunk(uint32_t count)
+        {
+            if (m_job_remaining.fetch_sub(count) == count) {
+                notifyDone();
+            }
+        }
+
+        // Processes chunks of the current job from its own range, then steals from the others
+        void runJob(uint32_t self)
+        {
+            const uint32_t chunk = m_job_chunk;
+            const uint32_t range_count = m_worker_count + 1;
+            uint32_t start;
+            uint32_t end;
+            for (;;) {
+                if (m_ranges[self].take(chunk, start, end)) {
+                    {
+                        PROFILE_SCOPE_ARG("chunk", start);
+                        m_job_invoke(m_job_context, start, end);
+                    }
+                    completeChunk(end - start);
+                    continue;
+                }
+
+                bool stolen = false;
+                for (uint32_t i = 1; i < range_count && !stolen; ++i) {
+                    stolen = m_ranges[(self + i) % range_count].steal(chunk, start, end);
+                }
+                if (!stolen) {
+                    return;
+                }
+                // Run the first chunk now and leave the rest in our range for others to steal back
+                const uint32_t first_end = end - start > chunk ? start + chunk : end;
+                m_ranges[self].m_range.store(WorkRange::pack(first_end, end), std::memory_order_release);
+                {
+                    PROFILE_SCOPE_ARG("chunk", start);
+                    m_job_invoke(m_job_context, start, first_end);
+                }
+                completeChunk(first_end - start);
+            }
+        }
+
+        bool joinJob(uint32_t self)
+        {
+            if (!m_job_active.load()) {
+                return false;
+            }
+            m_job_workers.fetch_add(1);
+            // Re-check after registering, the submitter waits for registered workers before reusing the job
+            const bool active = m_job_active.load();
+            if (active) {
+                runJob(self);
+            }
+            if (m_job_workers.fetch_sub(1) == 1) {
+                notifyDone();
+            }
+            return active;
+        }
+
+        // Splits [0, count) into one contiguous range per participant, chunks are claimed
+        // from the front of the own range and idle participants steal the back half of another
+        template<typename TCallback>
+        void parallelFor(uint32_t count, uint32_t chunk, TCallback& callback)
+        {
+            if (!count) {
+                return;
+            }
+            const uint32_t range_count = m_worker_count + 1;
+            for (uint32_t i = 0; i < range_count; ++i) {
+                const uint32_t begin = uint32_t(uint64_t(count) * i / range_count);
+                const uint32_t end = uint32_t(uint64_t(count) * (i + 1) / range_count);
+                m_ranges[i].m_range.store(WorkRange::pack(begin, end), std::memory_order_relaxed);
+            }
+            m_job_invoke = [](void* context, uint32_t start, uint32_t end) {
+                (*static_cast<TCallback*>(context))(start, end);
+            };
+            m_job_context = &callback;
+            m_job_chunk = chunk ? chunk : 1;
+            m_job_remaining.store(count);
+            m_job_active.store(true);
+            wake(true);
+
+            runJob(m_worker_count);
+            PROFILE_IDLE("wait");
+            waitUntil([this] { return m_job_remaining.load() == 0; });
+
+            m_job_active.store(false);
+            waitUntil([this] { return m_job_workers.load() == 0; });
+        }
+
+        bool hasWork(uint32_t self)
+        {
+            if (m_job_active.load(std::memory_order_relaxed)) {
+                return true;
+            }
+            for (uint32_t i = 0; i < m_worker_count; ++i) {
+                const WorkQueue& queue = m_queues[(self + i) % m_worker_count];
+                if (queue.m_bottom.load(std::memory_order_relaxed) != queue.m_top.load(std::memory_order_relaxed)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void run(uint32_t self)
+        {
+            while (!m_stopping.load(std::memory_order_relaxed)) {
+                const uint32_t epoch = m_epoch.load();
+                if (joinJob(self) || runOneTask(self)) {
+                    continue;
+                }
+
+                Backoff backoff;
+                while (backoff.m_count < m_spin_rounds && !hasWork(self) && !m_stopping.load(std::memory_order_relaxed)) {
+                    backoff.wait();
+                }
+                if (backoff.m_count < m_spin_rounds) {
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(m_park_mutex);
+                m_sleeping.fetch_add(1);
+                m_park_cv.wait(lock, [this, epoch] { return m_epoch.load() != epoch || m_stopping.load(); });
+                m_sleeping.fetch_sub(1);
+            }
+        }
+
+        void stop()
+        {
+            m_stopping.store(true);
+            std::lock_guard<std::mutex> lock(m_park_mutex);
+            m_park_cv.notify_all();
+        }
+    };
+
+}
@@ -0,0 +1,897 @@
+// Headless benchmark: drives PhysicSolver and Emiter without a window and reports
+// the object count reached before a step exceeds the time budget (README metric:
+// "emit until FPS < 75"), plus per-phase timings, as JSON.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "physics.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "softwareRenderer.h"
+#include "trajectory.h"
+#include "threadPool.h"
+
+struct BenchConfig {
+    float world_size = 1600.f;
+    float radius = 1.2f;
+    float gravity = 40.f;
+    float friction = 40.f;
+    float response_coef = 0.6f;
+    unsigned int sub_steps = 1;
+    float dt = 1 / 280.0f;
+
+    float speed = 180.f;
+    float interval = 1.2f;
+    unsigned int emit_num = 50;
+
+    uint32_t threads = 15;
+    // Per step budget, 75 FPS by default
+    double budget_ms = 1000.0 / 75.0;
+    // Steps of the rolling average compared against the budget
+    uint32_t window = 60;
+    uint32_t max_objects = 600000;
+    uint32_t max_steps = 1000000;
+    // Objects packed at the bottom of the world before the run starts
+    uint32_t prefill = 0;
+    bool shuffle = false;
+    ContactKernelType kernel = ContactKernelType::Pairwise;
+    bool fast_rsqrt = false;
+    GridMode grid_mode = GridMode::Cells;
+    unsigned int reorder = 0;
+    tp::Scheduler scheduler = tp::Scheduler::SharedQueue;
+    // Worker pinning, and whether cells and objects are first touched by their owners
+    tp::Affinity affinity = tp::Affinity::None;
+    bool first_touch = false;
+    // Steps of each run of the placement comparison, 0 runs the normal benchmark
+    uint32_t compare_placement = 0;
+    StepMode step_mode = StepMode::Dispatch;
+    unsigned int stripe_rows = 1;
+    unsigned int balanced_stripes = 0;
+    // Every big_every-th object gets big_radius, 0 keeps every radius equal
+    uint32_t big_every = 0;
+    float big_radius = 4.f;
+    bool sleeping = false;
+    float sleep_speed = 5.f;
+    // No world borders, needs the sparse grid
+    bool open = false;
+    // Static geometry added at the start, see addScene
+    std::string scene = "none";
+    // A cloth of cloth x cloth linked objects hung from its top row, see addCloth
+    uint32_t cloth = 0;
+    unsigned int constraint_iterations = 1;
+    // Start from this snapshot instead of an empty world (its world size, radius and
+    // physics parameters win), and write one at the end
+    std::string snapshot_in;
+    std::string snapshot_out;
+    bool snapshot_quantized = false;
+    // Record every step to this trajectory file, its time counts as part of the step
+    std::string record;
+    uint32_t keyframe_interval = 64;
+    bool deterministic = false;
+    // Per step state checksums, written to checksums_out and compared against verify_in
+    std::string checksums_out;
+    std::string verify_in;
+    // Headless frames from the software rasterizer, every frame_every steps, outside the
+    // timed range: a raw rgba stream and/or numbered PNG files
+    std::string frames_raw;
+    std::string frames_png;
+    uint32_t frame_every = 1;
+    uint32_t frame_width = 0;
+    // Chrome trace of the scoped timers, the last events of every thread
+    std::string trace_out;
+    // Per step solver statistics as CSV, their passes are not counted in the step time
+    std::string stats_out;
+    std::string out;
+};
+
+struct BenchWindow {
+    double step = 0.;
+    double emit = 0.;
+    PhaseTimings phases;
+    GridStats grid;
+    uint32_t steps = 0;
+
+    void reset() {
+        step = 0.;
+        emit = 0.;
+        phases.reset();
+        grid = GridStats();
+        steps = 0;
+    }
+};
+
+static bool parseKernel(const char* value, ContactKernelType& kernel)
+{
+    for (ContactKernelType type : { ContactKernelType::Pairwise, ContactKernelType::Scalar, ContactKernelType::SSE, ContactKernelType::AVX2 }) {
+        if (!strcmp(value, ContactKernel::name(type))) {
+            kernel = type;
+            return true;
+        }
+    }
+    if (!strcmp(value, "auto")) {
+        kernel = ContactKernel::best();
+        return true;
+    }
+    fprintf(stderr, "unknown kernel %s\n", value);
+    return false;
+}
+
+static bool parseArgs(int argc, char** argv, BenchConfig& cfg)
+{
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (!strcmp(arg, "--help") || !strcmp(arg, "-h")) {
+            return false;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "missing value for %s\n", arg);
+            return false;
+        }
+        const char* value = argv[++i];
+
+        if (!strcmp(arg, "--threads"))            cfg.threads = to<uint32_t>(atoi(value));
+        else if (!strcmp(arg, "--budget-ms"))     cfg.budget_ms = atof(value);
+        else if (!strcmp(arg, "--window"))        cfg.window = to<uint32_t>(atoi(value));
+        else if (!strcmp(arg, "--max-objects"))   cfg.max_objects = to<uint32_t>(atoi(value));
+        else if (!strcmp(arg, "--max-steps"))     cfg.max_steps = to<uint32_t>(atoi(value));
+        else if (!strcmp(arg, "--prefill"))       cfg.prefill = to<uint32_t>(atoi(value));
+        else if (!strcmp(arg, "--shuffle"))       cfg.shuffle = atoi(value) != 0;
+        else if (!strcmp(arg, "--sub-steps"))     cfg.sub_steps = to<unsigned int>(atoi(value));
+        else if (!strcmp(arg, "--radius"))        cfg.radius = to<float>(atof(value));
+        else if (!strcmp(arg, "--world"))         cfg.world_size = to<float>(atof(value));
+        else if (!strcmp(arg, "--emit-num"))      cfg.emit_num = to<unsigned int>(atoi(value));
+        else if (!strcmp(arg, "--kernel")) {
+            if (!parseKernel(value, cfg.kernel)) {
+                return false;
+            }
+        }
+        else if (!strcmp(arg, "--grid")) {
+            if (!strcmp(value, "cells"))          cfg.grid_mode = GridMode::Cells;
+            else if (!strcmp(value, "sorted"))    cfg.grid_mode = GridMode::Sorted;
+            else if (!strcmp(value, "sparse"))    cfg.grid_mode = GridMode::Sparse;
+            else {
+                fprintf(stderr, "unknown grid %s\n", value);
+                return false;
+            }
+        }
+        else if (!strcmp(arg, "--scene")) {
+            if (strcmp(value, "none") && strcmp(value, "hopper") && strcmp(value, "pegs") && strcmp(value, "walls")) {
+                fprintf(stderr, "unknown scene %s\n", value);
+                return false;
+            }
+            cfg.scene = value;
+        }
+        else if (!strcmp(arg, "--cloth"))         cfg.cloth = to<uint32_t>(atoi(value));
+        else if (!strcmp(arg, "--constraint-iterations")) cfg.constraint_iterations = to<unsigned int>(atoi(value));
+        else if (!strcmp(arg, "--scheduler")) {
+            if (!strcmp(value, "shared"))         cfg.scheduler = tp::Scheduler::SharedQueue;
+            else if (!strcmp(value, "stealing"))  cfg.scheduler = tp::Scheduler::WorkStealing;
+            else {
+                fprintf(stderr, "unknown scheduler %s\n", value);
+                return false;
+            }
+        }
+        else if (!strcmp(arg, "--affinity")) {
+            if (!strcmp(value, "none"))           cfg.affinity = tp::Affinity::None;
+            else if (!strcmp(value, "compact"))   cfg.affinity = tp::Affinity::Compact;
+            else if (!strcmp(value, "spread"))    cfg.affinity = tp::Affinity::Spread;
+            else {
+                fprintf(stderr, "unknown affinity %s\n", value);
+                return false;
+            }
+        }
+        else if (!strcmp(arg, "--first-touch"))   cfg.first_touch = atoi(value) != 0;
+        else if (!strcmp(arg, "--compare-placement")) cfg.compare_placement = to<uint32_t>(atoi(value));
+        else if (!strcmp(arg, "--step-mode")) {
+            if (!strcmp(value, "dispatch"))        cfg.step_mode = StepMode::Dispatch;
+            else if (!strcmp(value, "persistent")) cfg.step_mode = StepMode::Persistent;
+            else if (!strcmp(value, "graph"))      cfg.step_mode = StepMode::Graph;
+            else {
+                fprintf(stderr, "unknown step mode %s\n", value);
+                return false;
+            }
+        }
+        else if (!strcmp(arg, "--big-every"))     cfg.big_every = to<uint32_t>(atoi(value));
+        else if (!strcmp(arg, "--big-radius"))    cfg.big_radius = to<float>(atof(value));
+        else if (!strcmp(arg, "--sleep"))         cfg.sleeping = atoi(value) != 0;
+        else if (!strcmp(arg, "--open"))          cfg.open = atoi(value) != 0;
+        else if (!strcmp(arg, "--sleep-speed"))   cfg.sleep_speed = to<float>(atof(value));
+        else if (!strcmp(arg, "--snapshot-in"))   cfg.snapshot_in = value;
+        else if (!strcmp(arg, "--snapshot-out"))  cfg.snapshot_out = value;
+        else if (!strcmp(arg, "--quantize"))      cfg.snapshot_quantized = atoi(value) != 0;
+        else if (!strcmp(arg, "--record"))        cfg.record = value;
+        else if (!strcmp(arg, "--keyframe"))      cfg.keyframe_interval = to<uint32_t>(atoi(value));
+        else if (!strcmp(arg, "--deterministic")) cfg.deterministic = atoi(value) != 0;
+        else if (!strcmp(arg, "--checksums"))     cfg.checksums_out = value;
+        else if (!strcmp(arg, "--verify"))        cfg.verify_in = value;
+        else if (!strcmp(arg, "--frames-raw"))    cfg.frames_raw = value;
+        else if (!strcmp(arg, "--frames-png"))    cfg.frames_png = value;
+        else if (!strcmp(arg, "--frame-every"))   cfg.frame_every = to<uint32_t>(atoi(value));
+        else if (!strcmp(arg, "--frame-width"))   cfg.frame_width = to<uint32_t>(atoi(value));
+        else if (!strcmp(arg, "--trace"))         cfg.trace_out = value;
+        else if (!strcmp(arg, "--stats"))         cfg.stats_out = value;
+        else if (!strcmp(arg, "--stripe-rows"))   cfg.stripe_rows = to<unsigned int>(atoi(value));
+        else if (!strcmp(arg, "--balanced-stripes")) cfg.balanced_stripes = to<unsigned int>(atoi(value));
+        else if (!strcmp(arg, "--reorder"))       cfg.reorder = to<unsigned int>(atoi(value));
+        else if (!strcmp(arg, "--fast-rsqrt"))    cfg.fast_rsqrt = atoi(value) != 0;
+        else if (!strcmp(arg, "--out"))           cfg.out = value;
+        else {
+            fprintf(stderr, "unknown option %s\n", arg);
+            return false;
+        }
+    }
+    if (cfg.grid_mode == GridMode::Sparse && cfg.sleeping) {
+        fprintf(stderr, "--sleep is not supported with the sparse grid\n");
+        return false;
+    }
+    if (cfg.open && cfg.grid_mode != GridMode::Sparse) {
+        fprintf(stderr, "--open 1 needs --grid sparse\n");
+        return false;
+    }
+    if (cfg.first_touch && cfg.step_mode != StepMode::Persistent) {
+        fprintf(stderr, "--first-touch 1 needs --step-mode persistent\n");
+        return false;
+    }
+    if (cfg.open && (cfg.snapshot_quantized || !cfg.record.empty())) {
+        fprintf(stderr, "quantized snapshots and trajectories cover the world box, not with --open 1\n");
+        return false;
+    }
+    return cfg.threads > 0 && cfg.window > 0 && cfg.sub_steps > 0;
+}
+
+static void printUsage()
+{
+    fprintf(stderr,
+        "usage: Benchmark [options]\n"
+        "  --threads N       worker threads (15)\n"
+        "  --budget-ms X     per step time budget (13.333, i.e. 75 FPS)\n"
+        "  --window N        steps averaged against the budget (60)\n"
+        "  --max-objects N   stop emitting at N objects (600000)\n"
+        "  --max-steps N     hard step limit (1000000)\n"
+        "  --prefill N       start with N objects packed at the bottom (0)\n"
+        "  --shuffle 0|1     scatter prefilled ids over the lattice (0)\n"
+        "  --sub-steps N     solver sub steps (1)\n"
+        "  --radius X        object radius (1.2)\n"
+        "  --world X         world width and height (1600)\n"
+        "  --emit-num N      objects per emitter burst (50)\n"
+        "  --kernel NAME     contact kernel: pairwise, scalar, sse, avx2 or auto (pairwise)\n"
+        "  --fast-rsqrt 0|1  approximate reciprocal square root in the contact kernel (0)\n"
+        "  --grid NAME       grid build: cells, sorted or sparse (cells)\n"
+        "  --reorder N       store objects in cell order every N steps, 0 disables (0)\n"
+        "  --scheduler NAME  thread pool scheduler: shared or stealing (shared)\n"
+        "  --step-mode NAME  sub-step phases: dispatch, persistent or graph (dispatch)\n"
+        "  --affinity NAME   worker pinning: none, compact (node by node) or spread (over every node) (none)\n"
+        "  --first-touch 0|1 allocate cells and the cloth and prefilled objects from the workers that\n"
+        "                    own them, needs --step-mode persistent, emitted or loaded objects are not (0)\n"
+        "  --compare-placement N  run N steps on the prefilled world unpinned, then pinned (spread\n"
+        "                    unless --affinity is set) with first touch, and report both\n"
+        "  --stripe-rows N   grid rows per collision stripe (1)\n"
+        "  --balanced-stripes N  N collision stripes cut by row occupancy, 0 uses --stripe-rows (0)\n"
+        "  --big-every N     give every Nth object the big radius, 0 disables (0)\n"
+        "  --big-radius X    radius of big objects (4)\n"
+        "  --sleep 0|1       freeze settled regions, not with the sparse grid (0)\n"
+        "  --sleep-speed X   speed below which a region may fall asleep (5)\n"
+        "  --open 0|1        no world borders, needs the sparse grid (0)\n"
+        "  --scene NAME      static geometry: none, hopper (funnel and pegs), pegs (thousands of triangles)\n"
+        "                    or walls (circles cutting into every border) (none)\n"
+        "  --cloth N         N x N objects linked into a cloth, pinned along its top row (0)\n"
+        "  --constraint-iterations N  link solver passes per sub-step (1)\n"
+        "  --snapshot-in F   start from snapshot F, keeps its world, borders, radius and physics\n"
+        "  --snapshot-out F  save a snapshot to F at the end\n"
+        "  --quantize 0|1    quantized positions in the saved snapshot (0)\n"
+        "  --record F        record every step to trajectory file F\n"
+        "  --keyframe N      frames per trajectory chunk, each starts with a keyframe (64)\n"
+        "  --deterministic 0|1  same results for any thread count and timing (0)\n"
+        "  --checksums F     write the state checksum of every step to F\n"
+        "  --verify F        compare every step against the checksums in F\n"
+        "  --frames-raw F    append software rendered rgba frames to F\n"
+        "  --frames-png P    write software rendered frames to P00000.png, P00001.png, ...\n"
+        "  --frame-every N   render a frame every N steps (1)\n"
+        "  --frame-width W   frame width and height in pixels, 0 for the world size (0)\n"
+        "  --trace F         record scoped timers and write them to F as a chrome trace\n"
+        "  --stats F         write contacts, penetration, energy and occupancy of every step to F (csv)\n"
+        "  --out FILE        write the JSON report to FILE instead of stdout\n");
+}
+
+// Packs objects row by row from the floor up, touching but not overlapping.
+// When shuffled, ids are scattered over the lattice so memory order no longer
+// follows space, like a pile that has been mixed by motion.
+static uint32_t prefillCount(const PhysicSolver& solver, uint32_t count)
+{
+    const float margin = solver.diameter;
+    const float step = solver.diameter;
+    const uint32_t per_row = to<uint32_t>((solver.world_size.x - 2.f * margin) / step);
+    const uint32_t rows = to<uint32_t>((solver.world_size.y - 2.f * margin) / step);
+    return std::min(count, per_row * rows);
+}
+
+static void prefill(PhysicSolver& solver, uint32_t count, bool shuffle)
+{
+    const float margin = solver.diameter;
+    const float step = solver.diameter;
+    const uint32_t per_row = to<uint32_t>((solver.world_size.x - 2.f * margin) / step);
+    count = prefillCount(solver, count);
+
+    solver.objects.reserve(count);
+    for (uint32_t k = 0; k < count; ++k) {
+        const uint32_t i = shuffle ? to<uint32_t>((k * 2654435761ull) % count) : k;
+        const float x = margin + step * 0.5f + step * (i % per_row);
+        const float y = solver.world_size.y - margin - step * 0.5f - step * (i / per_row);
+        auto id = solver.createObject(Vec2(x, y));
+        solver.objects[id].color = ColorUtils::getRainbow(i * 0.00001f);
+    }
+}
+
+// Static colliders scaled to the world. hopper is a funnel over a row of circles, pegs a
+// lattice of small triangles, about 7000 segments in the default world, walls circles
+// centered just inside every border, which push objects against it.
+static void addScene(PhysicSolver& solver, const std::string& scene)
+{
+    const float w = solver.world_size.x;
+    const float h = solver.world_size.y;
+    if (scene == "hopper") {
+        const float thickness = solver.radius;
+        solver.colliders.addSegment({ 0.1f * w, 0.3f * h }, { 0.46f * w, 0.55f * h }, thickness);
+        solver.colliders.addSegment({ 0.9f * w, 0.3f * h }, { 0.54f * w, 0.55f * h }, thickness);
+        for (uint32_t i = 0; i < 20; ++i) {
+            solver.colliders.addCircle({ (to<float>(i) + 0.5f) * w / 20.f, 0.75f * h }, 4.f * solver.diameter);
+        }
+    }
+    else if (scene == "pegs") {
+        const float spacing = 10.f * solver.diameter;
+        const float size = 2.5f * solver.diameter;
+        for (float y = 0.3f * h; y < 0.9f * h; y += spacing) {
+            for (float x = 0.05f * w; x < 0.95f * w; x += spacing) {
+                solver.colliders.addPolygon({ { x, y - size }, { x + size, y + size }, { x - size, y + size } });
+            }
+        }
+    }
+    else if (scene == "walls") {
+        const float r = 4.f * solver.diameter;
+        const float spacing = 4.f * r;
+        for (float x = 0.5f * r; x < w; x += spacing) {
+            solver.colliders.addCircle({ x, 0.5f * r }, r);
+            solver.colliders.addCircle({ x, h - 0.5f * r }, r);
+        }
+        for (float y = 0.5f * r + 0.5f * spacing; y < h; y += spacing) {
+            solver.colliders.addCircle({ 0.5f * r, y }, r);
+            solver.colliders.addCircle({ w - 0.5f * r, y }, r);
+        }
+    }
+}
+
+// A square of touching objects linked to their right and lower neighbours, centered
+// at the top of the world, every 16th object of the top row pinned
+static void addCloth(PhysicSolver& solver, uint32_t size)
+{
+    const float step = solver.diameter;
+    const float left = 0.5f * (solver.world_size.x - step * to<float>(size - 1));
+    const float top = 4.f * step;
+    const uint32_t first = to<uint32_t>(solver.objects.size());
+    for (uint32_t row = 0; row < size; ++row) {
+        for (uint32_t col = 0; col < size; ++col) {
+            const uint32_t id = to<uint32_t>(solver.createObject({ left + step * to<float>(col), top + step * to<float>(row) }));
+            solver.objects[id].color = ColorUtils::getRainbow(to<float>(row) * 0.02f);
+        }
+    }
+    for (uint32_t row = 0; row < size; ++row) {
+        for (uint32_t col = 0; col < size; ++col) {
+            const uint32_t id = first + row * size + col;
+            if (col + 1 < size) {
+                solver.addLink(id, id + 1);
+            }
+            if (row + 1 < size) {
+                solver.addLink(id, id + size);
+            }
+        }
+    }
+    for (uint32_t col = 0; col < size; col += 16) {
+        solver.addPin(first + col, { solver.objects.x[first + col], solver.objects.y[first + col] });
+    }
+}
+
+static void applyBigRadius(PhysicSolver& solver, const BenchConfig& cfg, uint32_t first)
+{
+    if (!cfg.big_every) {
+        return;
+    }
+    for (uint32_t id = first; id < to<uint32_t>(solver.objects.size()); ++id) {
+        if (id % cfg.big_every == 0) {
+            solver.setObjectRadius(id, cfg.big_radius);
+        }
+    }
+}
+
+static const char* stepModeName(StepMode mode)
+{
+    switch (mode) {
+    case StepMode::Persistent: return "persistent";
+    case StepMode::Graph:      return "graph";
+    default:                   return "dispatch";
+    }
+}
+
+static const char* gridModeName(GridMode mode)
+{
+    switch (mode) {
+    case GridMode::Sorted: return "sorted";
+    case GridMode::Sparse: return "sparse";
+    default:               return "cells";
+    }
+}
+
+// One "step checksum" line per step, as written by --checksums
+static bool readChecksums(const std::string& path, std::vector<uint64_t>& checksums)
+{
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        char* step_end;
+        char* checksum_end;
+        const unsigned long step = strtoul(line.c_str(), &step_end, 10);
+        const unsigned long long checksum = strtoull(step_end, &checksum_end, 16);
+        if (checksum_end != step_end && step == checksums.size()) {
+            checksums.push_back(checksum);
+        }
+    }
+    return true;
+}
+
+static const char* affinityName(tp::Affinity affinity)
+{
+    switch (affinity) {
+    case tp::Affinity::Compact: return "compact";
+    case tp::Affinity::Spread:  return "spread";
+    default:                    return "none";
+    }
+}
+
+static double toMs(double total, uint32_t steps)
+{
+    return steps ? total * 1000.0 / steps : 0.0;
+}
+
+static void applyExecutionOptions(PhysicSolver& solver, const BenchConfig& cfg)
+{
+    solver.contact_kernel = cfg.kernel;
+    solver.fast_rsqrt = cfg.fast_rsqrt;
+    solver.grid_mode = cfg.grid_mode;
+    solver.reorder_interval = cfg.reorder;
+    solver.step_mode = cfg.step_mode;
+    solver.stripe_rows = cfg.stripe_rows;
+    solver.balanced_stripes = cfg.balanced_stripes;
+    solver.sleeping = cfg.sleeping;
+    solver.sleep_speed = cfg.sleep_speed;
+    solver.deterministic = cfg.deterministic;
+}
+
+struct PlacementRun {
+    double step = 0.;
+    PhaseTimings phases;
+};
+
+// cfg.compare_placement steps on cfg.prefill objects with a fresh solver and pool
+static PlacementRun runPlacement(const BenchConfig& cfg, tp::Affinity affinity, bool first_touch)
+{
+    using clock = std::chrono::high_resolution_clock;
+    PhysicSolver solver({ cfg.world_size, cfg.world_size }, cfg.radius);
+    tp::ThreadPool threadPool(cfg.threads, cfg.scheduler, affinity);
+    solver.gravity.y = cfg.gravity;
+    solver.friction = cfg.friction;
+    solver.sub_steps = cfg.sub_steps;
+    solver.response_coef = cfg.response_coef;
+    solver.bounded = !cfg.open;
+    applyExecutionOptions(solver, cfg);
+    if (first_touch) {
+        solver.placeMemory(threadPool, prefillCount(solver, cfg.prefill));
+    }
+    prefill(solver, cfg.prefill, cfg.shuffle);
+    applyBigRadius(solver, cfg, 0);
+
+    // One untimed step allocates what the first grid build needs
+    solver.update(cfg.dt, threadPool);
+    PlacementRun run;
+    for (uint32_t step = 0; step < cfg.compare_placement; ++step) {
+        const auto t0 = clock::now();
+        solver.timings.reset();
+        solver.update(cfg.dt, threadPool);
+        run.step += std::chrono::duration<double>(clock::now() - t0).count();
+        run.phases.grid += solver.timings.grid;
+        run.phases.collision += solver.timings.collision;
+        run.phases.integration += solver.timings.integration;
+    }
+    return run;
+}
+
+// Same world unpinned with memory touched by the main thread, then pinned with first
+// touch. The gain needs a multi socket host and StepMode::Persistent, the only mode in
+// which a worker keeps the slices it placed.
+static int comparePlacement(const BenchConfig& cfg)
+{
+    const tp::Affinity affinity = cfg.affinity == tp::Affinity::None ? tp::Affinity::Spread : cfg.affinity;
+    const tp::CpuTopology topology = tp::CpuTopology::discover();
+    const PlacementRun base = runPlacement(cfg, tp::Affinity::None, false);
+    const PlacementRun placed = runPlacement(cfg, affinity, true);
+    const uint32_t steps = cfg.compare_placement;
+
+    printf("{\n");
+    printf("  \"config\": {\"threads\": %u, \"prefill\": %u, \"steps\": %u, \"sub_steps\": %u, \"grid\": \"%s\", \"step_mode\": \"%s\", \"affinity\": \"%s\"},\n",
+        cfg.threads, cfg.prefill, steps, cfg.sub_steps, gridModeName(cfg.grid_mode), stepModeName(cfg.step_mode), affinityName(affinity));
+    printf("  \"topology\": {\"cpus\": %u, \"cores\": %u, \"nodes\": %u, \"placement\": [",
+        to<uint32_t>(topology.cpus.size()), topology.coreCount(), topology.node_count);
+    const std::vector<tp::LogicalCpu> cpus = topology.placement(cfg.threads, affinity);
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        printf("%s[%u, %u]", i ? ", " : "", cpus[i].id, cpus[i].node);
+    }
+    printf("]},\n");
+    for (const PlacementRun* run : { &base, &placed }) {
+        printf("  \"%s_ms\": {\"step\": %.4f, \"grid\": %.4f, \"collision\": %.4f, \"integration\": %.4f},\n",
+            run == &base ? "unpinned" : "placed", toMs(run->step, steps), toMs(run->phases.grid, steps),
+            toMs(run->phases.collision, steps), toMs(run->phases.integration, steps));
+    }
+    printf("  \"speedup\": %.4f\n}\n", placed.step > 0. ? base.step / placed.step : 0.);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    BenchConfig cfg;
+    if (!parseArgs(argc, argv, cfg)) {
+        printUsage();
+        return 1;
+    }
+    if (cfg.compare_placement) {
+        return comparePlacement(cfg);
+    }
+
+    using clock = std::chrono::high_resolution_clock;
+
+    Vec2 worldSize{ cfg.world_size, cfg.world_size };
+    SnapshotHeader snapshot;
+    if (!cfg.snapshot_in.empty()) {
+        if (!peekSnapshot(cfg.snapshot_in.c_str(), snapshot)) {
+            fprintf(stderr, "cannot read snapshot %s\n", cfg.snapshot_in.c_str());
+            return 1;
+        }
+        worldSize = { snapshot.world_x, snapshot.world_y };
+        cfg.world_size = snapshot.world_x;
+        cfg.radius = snapshot.radius;
+    }
+    PhysicSolver solver(worldSize, cfg.radius);
+    tp::ThreadPool threadPool(cfg.threads, cfg.scheduler, cfg.affinity);
+
+    solver.gravity.y = cfg.gravity;
+    solver.friction = cfg.friction;
+    solver.sub_steps = cfg.sub_steps;
+    solver.response_coef = cfg.response_coef;
+    solver.bounded = !cfg.open;
+
+    Emiter emiter;
+    emiter.Position = Vec2(30.f, 30.f);
+    emiter.Speed.x = cfg.speed;
+    emiter.emitNum = cfg.emit_num;
+    emiter.intervel = cfg.interval;
+
+    if (!cfg.snapshot_in.empty()) {
+        const auto t0 = clock::now();
+        if (!loadSnapshot(cfg.snapshot_in.c_str(), solver, &emiter, 1)) {
+            fprintf(stderr, "cannot load snapshot %s\n", cfg.snapshot_in.c_str());
+            return 1;
+        }
+        fprintf(stderr, "loaded %u objects in %.1f ms\n", to<uint32_t>(solver.objects.size()),
+            std::chrono::duration<double>(clock::now() - t0).count() * 1000.0);
+        cfg.sub_steps = solver.sub_steps;
+        // Whether the world has borders is part of the saved state
+        cfg.open = !solver.bounded;
+        if (cfg.open && cfg.grid_mode != GridMode::Sparse) {
+            fprintf(stderr, "snapshot %s is an open world, it needs --grid sparse\n", cfg.snapshot_in.c_str());
+            return 1;
+        }
+    }
+
+    // Execution options always come from the command line
+    applyExecutionOptions(solver, cfg);
+    if (cfg.first_touch) {
+        // The starting objects only: persistent slices follow the object count, emitted
+        // objects keep growing it past the placed slices
+        solver.placeMemory(threadPool, to<uint32_t>(solver.objects.size()) + cfg.cloth * cfg.cloth + prefillCount(solver, cfg.prefill));
+    }
+
+    addScene(solver, cfg.scene);
+    solver.constraint_iterations = cfg.constraint_iterations;
+    if (cfg.cloth) {
+        addCloth(solver, cfg.cloth);
+    }
+    prefill(solver, cfg.prefill, cfg.shuffle);
+    applyBigRadius(solver, cfg, 0);
+
+    TrajectoryRecorder recorder;
+    if (!cfg.record.empty() && !recorder.open(cfg.record.c_str(), solver, cfg.dt, cfg.keyframe_interval)) {
+        fprintf(stderr, "cannot write trajectory %s\n", cfg.record.c_str());
+        return 1;
+    }
+
+    std::ofstream checksums_out;
+    if (!cfg.checksums_out.empty()) {
+        checksums_out.open(cfg.checksums_out);
+        if (!checksums_out) {
+            fprintf(stderr, "cannot write checksums %s\n", cfg.checksums_out.c_str());
+            return 1;
+        }
+    }
+    std::vector<uint64_t> expected;
+    if (!cfg.verify_in.empty() && !readChecksums(cfg.verify_in, expected)) {
+        fprintf(stderr, "cannot read checksums %s\n", cfg.verify_in.c_str());
+        return 1;
+    }
+    uint32_t verified_steps = 0;
+    int64_t first_mismatch = -1;
+
+    const bool frames = !cfg.frames_raw.empty() || !cfg.frames_png.empty();
+    const uint32_t frame_width = cfg.frame_width ? cfg.frame_width : to<uint32_t>(worldSize.x);
+    std::unique_ptr<SoftwareRenderer> rasterizer;
+    RenderSnapshot frame_snapshot;
+    std::ofstream frames_raw;
+
+    std::ofstream stats_out;
+    SolverStats run_stats;
+    double stats_time = 0.;
+    if (!cfg.stats_out.empty()) {
+        stats_out.open(cfg.stats_out);
+        if (!stats_out) {
+            fprintf(stderr, "cannot write stats %s\n", cfg.stats_out.c_str());
+            return 1;
+        }
+        solver.collect_stats = true;
+        // Occupancy columns are cells per grid build
+        stats_out << "step,objects,pairs_tested,contacts,mean_penetration,max_penetration,kinetic_energy";
+        for (uint32_t i = 0; i < SolverStats::occupancy_buckets; ++i) {
+            stats_out << ",cells_" << i << (i + 1 == SolverStats::occupancy_buckets ? "+" : "");
+        }
+        stats_out << "\n";
+    }
+    uint32_t frame_count = 0;
+    double raster_time = 0.;
+    double frame_write_time = 0.;
+    if (frames) {
+        rasterizer.reset(new SoftwareRenderer(frame_width, to<uint32_t>(frame_width * worldSize.y / worldSize.x)));
+        if (!cfg.frames_raw.empty()) {
+            frames_raw.open(cfg.frames_raw, std::ios::binary | std::ios::trunc);
+            if (!frames_raw) {
+                fprintf(stderr, "cannot write frames %s\n", cfg.frames_raw.c_str());
+                return 1;
+            }
+        }
+    }
+
+    BenchWindow window;
+    BenchWindow total;
+    double last_window_step_ms = 0.;
+    uint32_t max_objects = 0;
+    uint32_t steps_at_cap = 0;
+    uint32_t step = 0;
+    const char* stop_reason = "max_steps";
+
+    Profiler& profiler = Profiler::instance();
+    if (!cfg.trace_out.empty()) {
+        profiler.setThreadName("main");
+        profiler.enabled = true;
+    }
+
+    for (; step < cfg.max_steps; ++step) {
+        const auto t0 = clock::now();
+        if (solver.objects.size() < cfg.max_objects) {
+            const uint32_t first = to<uint32_t>(solver.objects.size());
+            emiter.Emit(solver, cfg.dt);
+            applyBigRadius(solver, cfg, first);
+        }
+        const auto t1 = clock::now();
+        solver.timings.reset();
+        solver.update(cfg.dt, threadPool);
+        if (recorder.isOpen()) {
+            recorder.record(solver, step);
+        }
+        const auto t2 = clock::now();
+
+        // Outside the timed range, hashing every object is not part of a step
+        if (checksums_out.is_open() || step < expected.size()) {
+            const uint64_t checksum = solver.checksum();
+            if (checksums_out.is_open()) {
+                char line[32];
+                snprintf(line, sizeof(line), "%u %016llx\n", step, static_cast<unsigned long long>(checksum));
+                checksums_out << line;
+            }
+            if (step < expected.size()) {
+                ++verified_steps;
+                if (first_mismatch < 0 && checksum != expected[step]) {
+                    first_mismatch = step;
+                    fprintf(stderr, "step %u: checksum %016llx, expected %016llx\n", step,
+                        static_cast<unsigned long long>(checksum), static_cast<unsigned long long>(expected[step]));
+                }
+            }
+        }
+
+        if (stats_out.is_open()) {
+            const SolverStats& s = solver.stats;
+            const double builds = s.grid_builds ? to<double>(s.grid_builds) : 1.;
+            char line[160];
+            snprintf(line, sizeof(line), "%u,%u,%llu,%llu,%.6g,%.6g,%.6g", step, to<uint32_t>(solver.objects.size()),
+                static_cast<unsigned long long>(s.pairs_tested), static_cast<unsigned long long>(s.contacts),
+                s.meanPenetration(), s.max_penetration, s.kinetic_energy);
+            stats_out << line;
+            for (uint32_t i = 0; i < SolverStats::occupancy_buckets; ++i) {
+                snprintf(line, sizeof(line), ",%.1f", to<double>(s.occupancy[i]) / builds);
+                stats_out << line;
+            }
+            stats_out << "\n";
+            run_stats.merge(s);
+            stats_time += solver.timings.stats;
+        }
+
+        if (frames && step % (cfg.frame_every ? cfg.frame_every : 1) == 0) {
+            const auto f0 = clock::now();
+            frame_snapshot.extract(solver, threadPool);
+            rasterizer->render(frame_snapshot, worldSize, threadPool);
+            rasterizer->drawColliders(solver.colliders, worldSize);
+            const auto f1 = clock::now();
+            if (frames_raw.is_open()) {
+                rasterizer->writeRaw(frames_raw);
+            }
+            if (!cfg.frames_png.empty()) {
+                char path[64];
+                snprintf(path, sizeof(path), "%05u.png", frame_count);
+                rasterizer->writePNG((cfg.frames_png + path).c_str());
+            }
+            raster_time += std::chrono::duration<double>(f1 - f0).count();
+            frame_write_time += std::chrono::duration<double>(clock::now() - f1).count();
+            ++frame_count;
+        }
+
+        const double emit = std::chrono::duration<double>(t1 - t0).count();
+        const double step_time = std::chrono::duration<double>(t2 - t0).count() - solver.timings.stats;
+        for (BenchWindow* w : { &window, &total }) {
+            w->step += step_time;
+            w->emit += emit;
+            w->phases.grid += solver.timings.grid;
+            w->phases.collision += solver.timings.collision;
+            w->phases.integration += solver.timings.integration;
+            w->phases.reorder += solver.timings.reorder;
+            w->phases.constraints += solver.timings.constraints;
+            w->grid.merge(solver.grid_stats);
+            w->steps++;
+        }
+
+        if (window.steps == cfg.window) {
+            last_window_step_ms = toMs(window.step, window.steps);
+            if (last_window_step_ms > cfg.budget_ms) {
+                stop_reason = "budget";
+                ++step;
+                break;
+            }
+            max_objects = to<uint32_t>(solver.objects.size());
+            window.reset();
+        }
+
+        // Once emission is capped keep measuring for one full window, then stop
+        if (solver.objects.size() >= cfg.max_objects && ++steps_at_cap > cfg.window) {
+            stop_reason = "max_objects";
+            ++step;
+            break;
+        }
+    }
+
+    if (recorder.isOpen()) {
+        const auto t0 = clock::now();
+        recorder.close();
+        fprintf(stderr, "recorded %u frames, dropped %u, %.1f MB, %.1f ms to drain\n",
+            recorder.recorded_frames, recorder.dropped_frames, to<double>(recorder.written_bytes) / (1024.0 * 1024.0),
+            std::chrono::duration<double>(clock::now() - t0).count() * 1000.0);
+    }
+
+    if (profiler.enabled) {
+        profiler.enabled = false;
+        // The pool is idle, the buffers can be read
+        fprintf(stderr, "last second:%s\n", profiler.hudText().c_str());
+        if (!profiler.writeChromeTrace(cfg.trace_out.c_str())) {
+            fprintf(stderr, "cannot write trace %s\n", cfg.trace_out.c_str());
+        }
+    }
+
+    if (frame_count) {
+        fprintf(stderr, "rendered %u frames of %ux%u, %.2f ms to rasterize, %.2f ms to write\n",
+            frame_count, rasterizer->width, rasterizer->height, toMs(raster_time, frame_count), toMs(frame_write_time, frame_count));
+    }
+
+    if (!cfg.snapshot_out.empty()) {
+        const auto t0 = clock::now();
+        if (!saveSnapshot(cfg.snapshot_out.c_str(), solver, &emiter, 1, cfg.snapshot_quantized)) {
+            fprintf(stderr, "cannot write snapshot %s\n", cfg.snapshot_out.c_str());
+            return 1;
+        }
+        fprintf(stderr, "saved %u objects in %.1f ms\n", to<uint32_t>(solver.objects.size()),
+            std::chrono::duration<double>(clock::now() - t0).count() * 1000.0);
+    }
+
+    FILE* out = stdout;
+    if (!cfg.out.empty()) {
+#ifdef _MSC_VER
+        if (fopen_s(&out, cfg.out.c_str(), "w")) {
+            out = nullptr;
+        }
+#else
+        out = fopen(cfg.out.c_str(), "w");
+#endif
+        if (!out) {
+            fprintf(stderr, "cannot open %s\n", cfg.out.c_str());
+            return 1;
+        }
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\"threads\": %u, \"sub_steps\": %u, \"dt\": %.9g, \"radius\": %g, \"world_size\": %g, "
+        "\"budget_ms\": %.4f, \"window\": %u, \"max_objects\": %u, \"prefill\": %u, \"shuffle\": %d, \"emit_num\": %u, \"kernel\": \"%s\", \"fast_rsqrt\": %d, \"grid\": \"%s\", \"reorder\": %u, \"scheduler\": \"%s\", \"step_mode\": \"%s\", \"affinity\": \"%s\", \"first_touch\": %d, \"stripe_rows\": %u, \"balanced_stripes\": %u, \"big_every\": %u, \"big_radius\": %g, \"sleep\": %d, \"sleep_speed\": %g, \"deterministic\": %d, \"open\": %d, \"scene\": \"%s\", \"static_segments\": %u, \"static_circles\": %u, \"links\": %u, \"link_batches\": %u, \"constraint_iterations\": %u},\n",
+        cfg.threads, cfg.sub_steps, cfg.dt, cfg.radius, cfg.world_size,
+        cfg.budget_ms, cfg.window, cfg.max_objects, cfg.prefill, cfg.shuffle ? 1 : 0, cfg.emit_num,
+        ContactKernel::name(cfg.kernel), cfg.fast_rsqrt ? 1 : 0,
+        gridModeName(cfg.grid_mode), cfg.reorder,
+        cfg.scheduler == tp::Scheduler::WorkStealing ? "stealing" : "shared",
+        stepModeName(cfg.step_mode), affinityName(cfg.affinity), cfg.first_touch ? 1 : 0, cfg.stripe_rows, cfg.balanced_stripes, cfg.big_every, cfg.big_radius,
+        cfg.sleeping ? 1 : 0, cfg.sleep_speed, cfg.deterministic ? 1 : 0, cfg.open ? 1 : 0,
+        cfg.scene.c_str(), to<uint32_t>(solver.colliders.segments.size()), to<uint32_t>(solver.colliders.circles.size()),
+        to<uint32_t>(solver.constraints.links.size()), solver.constraints.batchCount(), cfg.constraint_iterations);
+    fprintf(out, "  \"stop_reason\": \"%s\",\n", stop_reason);
+    fprintf(out, "  \"steps\": %u,\n", step);
+    fprintf(out, "  \"objects\": %u,\n", to<uint32_t>(solver.objects.size()));
+    fprintf(out, "  \"max_objects_within_budget\": %u,\n", max_objects);
+    fprintf(out, "  \"frozen_regions\": %u,\n  \"regions\": %u,\n", solver.sleep_regions.frozen_count, solver.sleep_regions.size());
+    if (!cfg.verify_in.empty()) {
+        fprintf(out, "  \"replay\": {\"verified_steps\": %u, \"first_mismatch\": %lld},\n", verified_steps, static_cast<long long>(first_mismatch));
+    }
+    fprintf(out, "  \"last_window_step_ms\": %.4f,\n", last_window_step_ms);
+    // Per step averages over the last (possibly partial) window, i.e. at the ceiling
+    fprintf(out, "  \"window_ms\": {\"step\": %.4f, \"emit\": %.4f, \"grid\": %.4f, \"collision\": %.4f, \"constraints\": %.4f, \"integration\": %.4f, \"reorder\": %.4f},\n",
+        toMs(window.step, window.steps), toMs(window.emit, window.steps),
+        toMs(window.phases.grid, window.steps), toMs(window.phases.collision, window.steps),
+        toMs(window.phases.constraints, window.steps),
+        toMs(window.phases.integration, window.steps), toMs(window.phases.reorder, window.steps));
+    fprintf(out, "  \"run_ms\": {\"step\": %.4f, \"emit\": %.4f, \"grid\": %.4f, \"collision\": %.4f, \"constraints\": %.4f, \"integration\": %.4f, \"reorder\": %.4f},\n",
+        toMs(total.step, total.steps), toMs(total.emit, total.steps),
+        toMs(total.phases.grid, total.steps), toMs(total.phases.collision, total.steps),
+        toMs(total.phases.constraints, total.steps),
+        toMs(total.phases.integration, total.steps), toMs(total.phases.reorder, total.steps));
+    // Occupancy over the same two ranges, overflow counts are summed over every grid build
+    fprintf(out, "  \"window_grid\": {\"max_occupancy\": %u, \"overflow_cells\": %u, \"overflow_objects\": %u},\n",
+        window.grid.max_occupancy, window.grid.overflow_cells, window.grid.overflow_objects);
+    fprintf(out, "  \"run_grid\": {\"max_occupancy\": %u, \"overflow_cells\": %u, \"overflow_objects\": %u}%s\n",
+        total.grid.max_occupancy, total.grid.overflow_cells, total.grid.overflow_objects, solver.collect_stats ? "," : "");
+    if (solver.collect_stats) {
+        // Per step averages over the run, occupancy as the fraction of cells over every build
+        const double steps = step ? to<double>(step) : 1.;
+        uint64_t cells = 0;
+        for (uint64_t c : run_stats.occupancy) {
+            cells += c;
+        }
+        fprintf(out, "  \"run_stats\": {\"pairs_tested\": %.1f, \"contacts\": %.1f, \"mean_penetration\": %.6g, \"max_penetration\": %.6g, "
+            "\"kinetic_energy\": %.6g, \"stats_ms\": %.4f, \"occupancy\": [",
+            to<double>(run_stats.pairs_tested) / steps, to<double>(run_stats.contacts) / steps,
+            run_stats.meanPenetration(), run_stats.max_penetration, solver.stats.kinetic_energy, toMs(stats_time, step));
+        for (uint32_t i = 0; i < SolverStats::occupancy_buckets; ++i) {
+            fprintf(out, "%s%.6f", i ? ", " : "", cells ? to<double>(run_stats.occupancy[i]) / to<double>(cells) : 0.);
+        }
+        fprintf(out, "]}\n");
+    }
+    fprintf(out, "}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return first_mismatch < 0 ? 0 : 2;
+}